@@ -0,0 +1,190 @@
+#include "arena.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "slab.h"
+#include "cpu_affinity.h"
+
+struct arena_block
+{
+    arena_block *next;
+    char data[arena::BLOCK_SIZE - sizeof(arena_block *)];
+    /*不清零，slab分配时省掉4K的memset*/
+    arena_block() {}
+};
+
+/*单独mmap的大块，头部放在映射区的开头*/
+struct arena_big
+{
+    arena_big *next;
+    size_t bytes;
+};
+
+static slab<arena_block> blocks(256);
+
+static __thread long t_heap_allocs = 0;
+
+static char *align_up(char *p, size_t align)
+{
+    return (char *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+}
+
+arena::arena() : m_blocks(NULL), m_bigs(NULL), m_top(NULL), m_end(NULL), m_last(NULL), m_used(0), m_node(-1)
+{
+}
+
+arena::~arena()
+{
+    reset();
+}
+
+void *arena::alloc(size_t size, size_t align)
+{
+    char *p = m_top ? align_up(m_top, align) : NULL;
+    if (!p || p + size > m_end)
+    {
+        if (size + align > sizeof(((arena_block *)0)->data))
+        {
+            /*放不进一块的单独映射，不影响当前块*/
+            size_t bytes = sizeof(arena_big) + size + align;
+            arena_big *b = (arena_big *)alloc_on_node(bytes, m_node);
+            if (!b)
+                return NULL;
+            b->next = m_bigs;
+            b->bytes = bytes;
+            m_bigs = b;
+            m_used += size;
+            m_last = NULL;
+            return align_up((char *)(b + 1), align);
+        }
+        arena_block *b = blocks.alloc(m_node);
+        if (!b)
+            return NULL;
+        b->next = m_blocks;
+        m_blocks = b;
+        m_end = b->data + sizeof(b->data);
+        p = align_up(b->data, align);
+    }
+    m_top = p + size;
+    m_last = p;
+    m_used += size;
+    return p;
+}
+
+bool arena::extend(void *p, size_t old_size, size_t new_size)
+{
+    if (!p || p != m_last || (char *)p + new_size > m_end)
+        return false;
+    m_top = (char *)p + new_size;
+    m_used += new_size - old_size;
+    return true;
+}
+
+void arena::reset()
+{
+    while (m_blocks)
+    {
+        arena_block *next = m_blocks->next;
+        blocks.free(m_blocks);
+        m_blocks = next;
+    }
+    while (m_bigs)
+    {
+        arena_big *next = m_bigs->next;
+        free_on_node(m_bigs, m_bigs->bytes);
+        m_bigs = next;
+    }
+    m_top = m_end = m_last = NULL;
+    m_used = 0;
+}
+
+long arena::heap_allocs()
+{
+    return t_heap_allocs;
+}
+
+bool arena_string::append(const char *s, size_t n)
+{
+    if (m_failed)
+        return false;
+    if (m_len + n + 1 > m_cap)
+    {
+        size_t cap = m_cap ? m_cap : 256;
+        while (cap < m_len + n + 1)
+            cap *= 2;
+        if (!m_arena->extend(m_data, m_cap, cap))
+        {
+            char *p = (char *)m_arena->alloc(cap, 1);
+            if (!p)
+            {
+                m_failed = true;
+                return false;
+            }
+            if (m_len)
+                memcpy(p, m_data, m_len);
+            m_data = p;
+        }
+        m_cap = cap;
+    }
+    memcpy(m_data + m_len, s, n);
+    m_len += n;
+    m_data[m_len] = '\0';
+    return true;
+}
+
+#ifdef ARENA_COUNT_ALLOCS
+/*
+接管malloc一族，只是多数一次数，实际分配还是交给glibc（__libc_*）；
+operator new、strdup、fopen等最终都走到这里，所以libc内部的堆分配也数得到
+free和malloc_usable_size不用接管：内存本来就是glibc分配的
+*/
+extern "C"
+{
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+
+void *malloc(size_t size)
+{
+    ++t_heap_allocs;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    ++t_heap_allocs;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    ++t_heap_allocs;
+    return __libc_realloc(p, size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+    ++t_heap_allocs;
+    return __libc_memalign(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    ++t_heap_allocs;
+    return __libc_memalign(align, size);
+}
+
+int posix_memalign(void **out, size_t align, size_t size)
+{
+    if (align < sizeof(void *) || (align & (align - 1)) != 0)
+        return EINVAL;
+    ++t_heap_allocs;
+    void *p = __libc_memalign(align, size);
+    if (!p)
+        return ENOMEM;
+    *out = p;
+    return 0;
+}
+}
+#endif
@@ -0,0 +1,96 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+/*
+请求级的内存池：处理一个请求时用到的临时内存都从这里按顺序切（bump），不逐个释放，
+应答发送完、连接进入下一个请求时reset()一次性还回去
+块从slab里取，超过一块大小的分配单独mmap，都不经过全局堆
+不是线程安全的，同一时刻只有处理这个连接的那一个线程在用
+
+用 -DARENA_COUNT_ALLOCS 编译时，另外统计每个线程调用malloc一族（包括经由operator new和libc内部的）的次数（heap_allocs()），
+用来检查静态文件请求的处理过程中没有堆分配；计数要接管整个进程的malloc，只在测试时打开，平时不编译进去
+用 -DARENA_STRICT 编译时同样计数，静态文件请求里出现堆分配直接assert失败
+*/
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(ARENA_STRICT) && !defined(ARENA_COUNT_ALLOCS)
+#define ARENA_COUNT_ALLOCS 1
+#endif
+
+struct arena_block;
+struct arena_big;
+
+class arena
+{
+public:
+    /*每块的大小（含块头）*/
+    static const size_t BLOCK_SIZE = 4096;
+
+    arena();
+    ~arena();
+
+    /*之后的块从node上分配，-1表示不指定*/
+    void set_node(int node) { m_node = node; }
+    /*分配size字节，失败返回NULL*/
+    void *alloc(size_t size, size_t align = sizeof(void *));
+    /*把最近一次分配的p从old_size原地扩到new_size，p不是最近一次分配或者当前块放不下时返回false*/
+    bool extend(void *p, size_t old_size, size_t new_size);
+    /*释放所有分配*/
+    void reset();
+    /*已经分配出去的字节数*/
+    size_t used() const { return m_used; }
+
+    /*本线程到目前为止的堆分配次数（malloc、calloc、realloc和对齐分配），没有定义ARENA_COUNT_ALLOCS时总是0*/
+    static long heap_allocs();
+
+private:
+    arena(const arena &);
+    arena &operator=(const arena &);
+
+private:
+    arena_block *m_blocks;
+    arena_big *m_bigs;
+    char *m_top;      /*当前块中下一次分配的位置*/
+    char *m_end;
+    char *m_last;     /*最近一次分配的起始，extend()用*/
+    size_t m_used;
+    int m_node;
+};
+
+/*
+在arena里拼接的字符串，只能移动不能复制，内存随arena一起释放
+按倍数增长：是arena中最近一次分配时原地扩，否则搬到新位置；内存不足后append都返回false
+*/
+class arena_string
+{
+public:
+    explicit arena_string(arena &a) : m_arena(&a), m_data(NULL), m_len(0), m_cap(0), m_failed(false) {}
+    arena_string(arena_string &&other)
+        : m_arena(other.m_arena), m_data(other.m_data), m_len(other.m_len), m_cap(other.m_cap), m_failed(other.m_failed)
+    {
+        other.m_data = NULL;
+        other.m_len = other.m_cap = 0;
+    }
+
+    bool append(const char *s, size_t n);
+    bool append(const char *s) { return append(s, strlen(s)); }
+
+    const char *data() const { return m_data; }
+    size_t size() const { return m_len; }
+    bool failed() const { return m_failed; }
+
+private:
+    arena_string(const arena_string &);
+    arena_string &operator=(const arena_string &);
+
+private:
+    arena *m_arena;
+    char *m_data;
+    size_t m_len;
+    size_t m_cap;
+    bool m_failed;
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+/*压测工具（loadgen、soak）和微基准共用的延迟直方图*/
+
+#include <vector>
+
+/*延迟直方图（微秒）：小于64时每个值一个桶，之后每个2的幂区间再分32份，相对误差约3%*/
+class latency_histogram
+{
+public:
+    static const int SUB_BITS = 5;
+    static const int SUB = 1 << SUB_BITS;
+    static const int BUCKETS = 2 * SUB + 40 * SUB;
+
+    latency_histogram() : m_counts(BUCKETS, 0), m_total(0), m_max(0) {}
+
+    void record(long long v)
+    {
+        if (v < 0)
+            v = 0;
+        int index = bucket_of(v);
+        ++m_counts[index < BUCKETS ? index : BUCKETS - 1];
+        ++m_total;
+        if (v > m_max)
+            m_max = v;
+    }
+    void reset()
+    {
+        m_counts.assign(BUCKETS, 0);
+        m_total = 0;
+        m_max = 0;
+    }
+    void merge(const latency_histogram &other)
+    {
+        for (int i = 0; i < BUCKETS; ++i)
+            m_counts[i] += other.m_counts[i];
+        m_total += other.m_total;
+        if (other.m_max > m_max)
+            m_max = other.m_max;
+    }
+    /*第q分位（0~1）所在桶的上界*/
+    long long percentile(double q) const
+    {
+        if (m_total == 0)
+            return 0;
+        unsigned long long rank = (unsigned long long)(q * m_total);
+        if (rank >= m_total)
+            rank = m_total - 1;
+        unsigned long long seen = 0;
+        for (int i = 0; i < BUCKETS; ++i)
+        {
+            seen += m_counts[i];
+            if (seen > rank)
+            {
+                long long upper = bucket_upper(i);
+                return upper < m_max ? upper : m_max;
+            }
+        }
+        return m_max;
+    }
+    long long max() const { return m_max; }
+    unsigned long long total() const { return m_total; }
+
+private:
+    static int bucket_of(long long v)
+    {
+        if (v < 2 * SUB)
+            return v;
+        int e = 63 - __builtin_clzll(v);
+        int shift = e - SUB_BITS;
+        return 2 * SUB + (shift - 1) * SUB + (int)((v >> shift) - SUB);
+    }
+    static long long bucket_upper(int index)
+    {
+        if (index < 2 * SUB)
+            return index;
+        int shift = (index - 2 * SUB) / SUB + 1;
+        long long sub = (index - 2 * SUB) % SUB + SUB;
+        return ((sub + 1) << shift) - 1;
+    }
+
+private:
+    std::vector<unsigned long long> m_counts;
+    unsigned long long m_total;
+    long long m_max;
+};
+
+#endif
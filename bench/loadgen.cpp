@@ -0,0 +1,630 @@
+/*
+HTTP/1.1 压测工具，和服务器放在一起编译（不链接服务器的代码）：
+    make loadgen
+每个线程一个epoll，管理自己的一组非阻塞连接
+闭环（默认）：每个连接保持 -P 个请求在途，收到一个应答就补发一个，测的是最大吞吐
+开环（-r 每秒请求数）：按固定节奏发请求，不管应答回来没有；延迟从“按计划应该发出的时间”算起，
+服务器卡住期间本该发出、却因为连接都占着而推迟的请求，推迟的时间也计入延迟（修正coordinated omission）；
+超时或者连接断开丢掉的请求按丢掉的时刻、到结束还没收到应答或者还没发出去的按结束的时刻计入延迟，不会因为失败的请求不算数而低估尾部
+请求可以是单个（-m -u -b），也可以从文件读多行轮流发（-f，每行 METHOD URL [BODY]）；
+URL和BODY里的 %n 替换成全局唯一的序号，用来注册不重名的用户
+*/
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <deque>
+#include "latency_histogram.h"
+
+static long long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+struct request_template
+{
+    std::string method;
+    std::string url;
+    std::string body;
+};
+
+struct options
+{
+    const char *host;
+    int port;
+    int connections;
+    int threads;
+    int duration;
+    double rate;            /*每秒请求数，0表示闭环*/
+    int pipeline;
+    bool keep_alive;
+    int timeout;            /*秒，超过这个时间没有应答的请求记为超时并重连*/
+    bool json;
+    std::string headers;    /*-H 追加的请求头，已经带\r\n*/
+    std::vector<request_template> requests;
+};
+
+static options opt;
+static sockaddr_in server_addr;
+static std::atomic<unsigned long long> sequence(0);
+
+/*一个在途请求：计划发出的时间（算延迟）和实际发出的时间（算超时）*/
+struct in_flight
+{
+    long long intended;
+    long long sent;
+};
+
+struct connection
+{
+    enum STATE { CLOSED = 0, CONNECTING, OPEN };
+
+    int fd;
+    STATE state;
+    long long connect_start;
+    std::string out;
+    size_t out_off;
+    std::string in;
+    std::deque<in_flight> pending;
+    bool want_out;
+};
+
+struct thread_stats
+{
+    latency_histogram latency;
+    unsigned long long completed;
+    unsigned long long status[6];       /*按状态码的百位计数，0是解析不了的*/
+    unsigned long long bytes;
+    unsigned long long connect_errors;
+    unsigned long long read_errors;
+    unsigned long long timeouts;
+    unsigned long long unsent;          /*开环时到结束还没发出去的计划请求*/
+
+    thread_stats() : completed(0), bytes(0), connect_errors(0), read_errors(0), timeouts(0), unsent(0)
+    {
+        memset(status, 0, sizeof(status));
+    }
+};
+
+struct worker
+{
+    pthread_t tid;
+    int conn_count;
+    double rate;
+    thread_stats stats;
+};
+
+/*把s里的%n换成序号*/
+static void expand(std::string &out, const std::string &s, unsigned long long n)
+{
+    size_t pos = 0;
+    while (true)
+    {
+        size_t hit = s.find("%n", pos);
+        if (hit == std::string::npos)
+        {
+            out.append(s, pos, std::string::npos);
+            return;
+        }
+        out.append(s, pos, hit - pos);
+        char num[24];
+        snprintf(num, sizeof(num), "%llu", n);
+        out += num;
+        pos = hit + 2;
+    }
+}
+
+static void build_request(std::string &out)
+{
+    unsigned long long n = sequence.fetch_add(1, std::memory_order_relaxed);
+    const request_template &r = opt.requests[n % opt.requests.size()];
+    out += r.method;
+    out += ' ';
+    expand(out, r.url, n);
+    char line[128];
+    snprintf(line, sizeof(line), " HTTP/1.1\r\nHost: %s:%d\r\nConnection: %s\r\n", opt.host, opt.port,
+             opt.keep_alive ? "keep-alive" : "close");
+    out += line;
+    out += opt.headers;
+    if (!r.body.empty() || r.method == "POST")
+    {
+        std::string body;
+        expand(body, r.body, n);
+        snprintf(line, sizeof(line), "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: %d\r\n\r\n", (int)body.size());
+        out += line;
+        out += body;
+    }
+    else
+        out += "\r\n";
+}
+
+static void update_events(int epfd, connection &c)
+{
+    epoll_event ev;
+    ev.data.ptr = &c;
+    ev.events = EPOLLIN | EPOLLRDHUP | (c.want_out || c.state == connection::CONNECTING ? (uint32_t)EPOLLOUT : 0u);
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+static bool start_connect(int epfd, connection &c, thread_stats &stats)
+{
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c.fd < 0)
+    {
+        ++stats.connect_errors;
+        return false;
+    }
+    int one = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c.connect_start = now_us();
+    c.out.clear();
+    c.out_off = 0;
+    c.in.clear();
+    c.want_out = false;
+    if (connect(c.fd, (sockaddr *)&server_addr, sizeof(server_addr)) == 0)
+        c.state = connection::OPEN;
+    else if (errno == EINPROGRESS)
+        c.state = connection::CONNECTING;
+    else
+    {
+        ++stats.connect_errors;
+        close(c.fd);
+        c.fd = -1;
+        c.state = connection::CLOSED;
+        return false;
+    }
+    epoll_event ev;
+    ev.data.ptr = &c;
+    ev.events = EPOLLIN | EPOLLRDHUP | (c.state == connection::CONNECTING ? (uint32_t)EPOLLOUT : 0u);
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &ev);
+    return true;
+}
+
+/*关闭连接，在途的请求按lost计入错误，延迟算到现在；马上重连*/
+static void reset_conn(int epfd, connection &c, thread_stats &stats, unsigned long long &lost)
+{
+    lost += c.pending.size();
+    long long now = now_us();
+    for (size_t i = 0; i < c.pending.size(); ++i)
+        stats.latency.record(now - c.pending[i].intended);
+    c.pending.clear();
+    if (c.fd >= 0)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c.fd, NULL);
+        close(c.fd);
+    }
+    c.fd = -1;
+    c.state = connection::CLOSED;
+    start_connect(epfd, c, stats);
+}
+
+static void flush_out(int epfd, connection &c, thread_stats &stats)
+{
+    while (c.out_off < c.out.size())
+    {
+        ssize_t n = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            reset_conn(epfd, c, stats, stats.read_errors);
+            return;
+        }
+        c.out_off += n;
+    }
+    if (c.out_off == c.out.size())
+    {
+        c.out.clear();
+        c.out_off = 0;
+    }
+    bool want = !c.out.empty();
+    if (want != c.want_out)
+    {
+        c.want_out = want;
+        update_events(epfd, c);
+    }
+}
+
+static void send_request(int epfd, connection &c, thread_stats &stats, long long intended)
+{
+    in_flight f;
+    f.intended = intended;
+    f.sent = now_us();
+    c.pending.push_back(f);
+    build_request(c.out);
+    flush_out(epfd, c, stats);
+}
+
+/*闭环：补满在途请求；新连接上的第一个请求从开始连接时算起*/
+static void fill(int epfd, connection &c, thread_stats &stats)
+{
+    while (c.state == connection::OPEN && (int)c.pending.size() < opt.pipeline)
+    {
+        long long intended = c.pending.empty() && c.connect_start ? c.connect_start : now_us();
+        c.connect_start = 0;
+        send_request(epfd, c, stats, intended);
+        if (!opt.keep_alive)
+            break;
+    }
+}
+
+/*在头部里找某一项（不区分大小写），返回值的起点*/
+static const char *find_header(const char *begin, const char *end, const char *name)
+{
+    size_t len = strlen(name);
+    for (const char *p = begin; p + len < end; ++p)
+    {
+        if ((p == begin || p[-1] == '\n') && strncasecmp(p, name, len) == 0)
+            return p + len;
+    }
+    return NULL;
+}
+
+/*解析收到的应答，返回false表示连接要关掉*/
+static bool consume_responses(connection &c, thread_stats &stats)
+{
+    while (!c.in.empty())
+    {
+        const char *data = c.in.data();
+        const char *end = (const char *)memmem(data, c.in.size(), "\r\n\r\n", 4);
+        if (!end)
+            return true;
+        end += 4;
+        const char *cl = find_header(data, end, "Content-Length:");
+        size_t body = cl ? strtoul(cl, NULL, 10) : 0;
+        size_t total = (end - data) + body;
+        if (c.in.size() < total)
+            return true;
+
+        int status = 0;
+        if (c.in.size() > 12 && strncmp(data, "HTTP/1.", 7) == 0)
+            status = atoi(data + 9);
+        const char *conn_hdr = find_header(data, end, "Connection:");
+        bool close_after = conn_hdr && strncasecmp(conn_hdr + strspn(conn_hdr, " "), "close", 5) == 0;
+
+        if (c.pending.empty())
+            return false;   /*没发请求却收到应答，不认识的对端*/
+        stats.latency.record(now_us() - c.pending.front().intended);
+        c.pending.pop_front();
+        ++stats.completed;
+        ++stats.status[status >= 100 && status < 600 ? status / 100 : 0];
+        stats.bytes += total;
+        c.in.erase(0, total);
+        if (close_after || !opt.keep_alive)
+            return false;
+    }
+    return true;
+}
+
+static void on_readable(int epfd, connection &c, thread_stats &stats)
+{
+    char buf[16384];
+    while (true)
+    {
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if (n > 0)
+        {
+            c.in.append(buf, n);
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        /*对端关闭或出错：先把已经完整的应答算上*/
+        consume_responses(c, stats);
+        reset_conn(epfd, c, stats, stats.read_errors);
+        return;
+    }
+    if (!consume_responses(c, stats))
+    {
+        /*正常的Connection: close不算错误，剩下的在途请求才算*/
+        reset_conn(epfd, c, stats, stats.read_errors);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    worker *w = (worker *)arg;
+    thread_stats &stats = w->stats;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    std::vector<connection> conns(w->conn_count);
+    for (size_t i = 0; i < conns.size(); ++i)
+    {
+        conns[i].fd = -1;
+        conns[i].state = connection::CLOSED;
+        conns[i].out_off = 0;
+        start_connect(epfd, conns[i], stats);
+    }
+
+    bool open_loop = w->rate > 0;
+    long long start = now_us();
+    long long end = start + opt.duration * 1000000LL;
+    unsigned long long scheduled = 0;
+    size_t next_conn = 0;
+    long long last_timeout_check = start;
+    std::vector<epoll_event> events(conns.size() + 1);
+
+    while (true)
+    {
+        long long now = now_us();
+        if (now >= end)
+            break;
+
+        int wait_ms = 10;
+        if (open_loop)
+        {
+            /*到时间的请求依次分给有空位的连接，没有空位的留着，计划时间不变*/
+            while (true)
+            {
+                long long due = start + (long long)(scheduled * 1000000.0 / w->rate);
+                if (due > now)
+                {
+                    long long ms = (due - now + 999) / 1000;
+                    wait_ms = ms < wait_ms ? (int)ms : wait_ms;
+                    break;
+                }
+                size_t k = 0;
+                for (; k < conns.size(); ++k)
+                {
+                    connection &c = conns[(next_conn + k) % conns.size()];
+                    if (c.state == connection::OPEN && (int)c.pending.size() < opt.pipeline &&
+                        (opt.keep_alive || c.pending.empty()))
+                        break;
+                }
+                if (k == conns.size())
+                    break;
+                connection &c = conns[(next_conn + k) % conns.size()];
+                next_conn = (next_conn + k + 1) % conns.size();
+                send_request(epfd, c, stats, due);
+                ++scheduled;
+            }
+        }
+
+        int n = epoll_wait(epfd, &events[0], events.size(), wait_ms);
+        for (int i = 0; i < n; ++i)
+        {
+            connection &c = *(connection *)events[i].data.ptr;
+            if (c.state == connection::CONNECTING && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0)
+                {
+                    ++stats.connect_errors;
+                    unsigned long long lost = 0;
+                    reset_conn(epfd, c, stats, lost);
+                    continue;
+                }
+                c.state = connection::OPEN;
+                update_events(epfd, c);
+            }
+            else if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                on_readable(epfd, c, stats);
+            else if (c.state == connection::OPEN && (events[i].events & EPOLLOUT))
+                flush_out(epfd, c, stats);
+        }
+
+        now = now_us();
+        if (now - last_timeout_check > 100000)
+        {
+            last_timeout_check = now;
+            for (size_t i = 0; i < conns.size(); ++i)
+            {
+                connection &c = conns[i];
+                if (c.state == connection::CLOSED)
+                    start_connect(epfd, c, stats);  /*之前没连上的，隔一会儿再试*/
+                else if (!c.pending.empty() && now - c.pending.front().sent > opt.timeout * 1000000LL)
+                    reset_conn(epfd, c, stats, stats.timeouts);
+            }
+        }
+        if (!open_loop)
+        {
+            for (size_t i = 0; i < conns.size(); ++i)
+                fill(epfd, conns[i], stats);
+        }
+    }
+
+    if (open_loop)
+    {
+        /*开环时还在途的和到点了却没发出去的请求，延迟至少是到结束为止这么长*/
+        long long now = now_us();
+        for (size_t i = 0; i < conns.size(); ++i)
+        {
+            for (size_t k = 0; k < conns[i].pending.size(); ++k)
+                stats.latency.record(now - conns[i].pending[k].intended);
+        }
+        long long due_total = (long long)((now - start) * w->rate / 1000000.0);
+        stats.unsent = due_total > (long long)scheduled ? due_total - scheduled : 0;
+        for (unsigned long long k = scheduled; k < scheduled + stats.unsent; ++k)
+            stats.latency.record(now - (start + (long long)(k * 1000000.0 / w->rate)));
+    }
+    for (size_t i = 0; i < conns.size(); ++i)
+    {
+        if (conns[i].fd >= 0)
+            close(conns[i].fd);
+    }
+    close(epfd);
+    return NULL;
+}
+
+static bool load_requests(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        printf("open %s failed: %s\n", path, strerror(errno));
+        return false;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), fp))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        char method[16], url[2048];
+        int used = 0;
+        if (sscanf(line, "%15s %2047s %n", method, url, &used) < 2)
+            continue;
+        request_template r;
+        r.method = method;
+        r.url = url;
+        r.body = line + used;
+        opt.requests.push_back(r);
+    }
+    fclose(fp);
+    return !opt.requests.empty();
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [-h host] [-p port] [-c connections] [-t threads] [-d seconds] [-r rate] [-P pipeline] [-n] [-T timeout]\n"
+           "          [-m method] [-u url] [-b body] [-H header]... [-f request_file] [-j]\n", prog);
+    printf("  -r  开环：每秒发这么多请求，延迟从计划发出的时间算起；不指定时闭环，连接收到应答就补发\n");
+    printf("  -P  每个连接最多在途的请求数（流水线）；服务器不支持流水线时保持1\n");
+    printf("  -n  不保持连接，每个请求一个新连接（延迟包含建连）\n");
+    printf("  -f  请求文件，每行 METHOD URL [BODY]，依次轮流发送；URL和BODY中的%%n替换成唯一序号\n");
+    printf("  -j  结果以一行JSON输出\n");
+}
+
+int main(int argc, char *argv[])
+{
+    opt.host = "127.0.0.1";
+    opt.port = 9990;
+    opt.connections = 10;
+    opt.threads = 2;
+    opt.duration = 10;
+    opt.rate = 0;
+    opt.pipeline = 1;
+    opt.keep_alive = true;
+    opt.timeout = 5;
+    opt.json = false;
+    request_template single;
+    single.method = "GET";
+    single.url = "/judge.html";
+    const char *file = NULL;
+
+    int c;
+    while ((c = getopt(argc, argv, "h:p:c:t:d:r:P:nT:m:u:b:H:f:j")) != -1)
+    {
+        switch (c)
+        {
+        case 'h': opt.host = optarg; break;
+        case 'p': opt.port = atoi(optarg); break;
+        case 'c': opt.connections = atoi(optarg); break;
+        case 't': opt.threads = atoi(optarg); break;
+        case 'd': opt.duration = atoi(optarg); break;
+        case 'r': opt.rate = atof(optarg); break;
+        case 'P': opt.pipeline = atoi(optarg); break;
+        case 'n': opt.keep_alive = false; break;
+        case 'T': opt.timeout = atoi(optarg); break;
+        case 'm': single.method = optarg; break;
+        case 'u': single.url = optarg; break;
+        case 'b': single.body = optarg; break;
+        case 'H': opt.headers += optarg; opt.headers += "\r\n"; break;
+        case 'f': file = optarg; break;
+        case 'j': opt.json = true; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opt.threads < 1 || opt.connections < opt.threads || opt.pipeline < 1 || opt.duration < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (file)
+    {
+        if (!load_requests(file))
+            return 1;
+    }
+    else
+        opt.requests.push_back(single);
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(opt.port);
+    if (inet_pton(AF_INET, opt.host, &server_addr.sin_addr) != 1)
+    {
+        printf("bad host %s (IPv4 address expected)\n", opt.host);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<worker> workers(opt.threads);
+    for (int i = 0; i < opt.threads; ++i)
+    {
+        workers[i].conn_count = opt.connections / opt.threads + (i < opt.connections % opt.threads ? 1 : 0);
+        workers[i].rate = opt.rate / opt.threads;
+    }
+    long long start = now_us();
+    for (int i = 0; i < opt.threads; ++i)
+        pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]);
+    thread_stats total;
+    for (int i = 0; i < opt.threads; ++i)
+    {
+        pthread_join(workers[i].tid, NULL);
+        const thread_stats &s = workers[i].stats;
+        total.latency.merge(s.latency);
+        total.completed += s.completed;
+        for (int k = 0; k < 6; ++k)
+            total.status[k] += s.status[k];
+        total.bytes += s.bytes;
+        total.connect_errors += s.connect_errors;
+        total.read_errors += s.read_errors;
+        total.timeouts += s.timeouts;
+        total.unsent += s.unsent;
+    }
+    double seconds = (now_us() - start) / 1e6;
+
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999, 0.9999};
+    static const char *names[] = {"p50", "p90", "p99", "p99.9", "p99.99"};
+    if (opt.json)
+    {
+        printf("{\"mode\":\"%s\",\"rate\":%.1f,\"connections\":%d,\"threads\":%d,\"pipeline\":%d,\"keep_alive\":%s,"
+               "\"duration_s\":%.3f,\"requests\":%llu,\"rps\":%.1f,\"bytes\":%llu,"
+               "\"status\":{\"1xx\":%llu,\"2xx\":%llu,\"3xx\":%llu,\"4xx\":%llu,\"5xx\":%llu,\"other\":%llu},"
+               "\"errors\":{\"connect\":%llu,\"read\":%llu,\"timeout\":%llu,\"unsent\":%llu},\"latency_us\":{",
+               opt.rate > 0 ? "open" : "closed", opt.rate, opt.connections, opt.threads, opt.pipeline,
+               opt.keep_alive ? "true" : "false", seconds, total.completed, total.completed / seconds, total.bytes,
+               total.status[1], total.status[2], total.status[3], total.status[4], total.status[5], total.status[0],
+               total.connect_errors, total.read_errors, total.timeouts, total.unsent);
+        for (int i = 0; i < 5; ++i)
+            printf("\"%s\":%lld,", names[i], total.latency.percentile(quantiles[i]));
+        printf("\"max\":%lld}}\n", total.latency.max());
+        return 0;
+    }
+
+    printf("%s loop%s, %d connections, %d threads, pipeline %d%s\n", opt.rate > 0 ? "open" : "closed",
+           opt.rate > 0 ? " (latency corrected for coordinated omission)" : "", opt.connections, opt.threads,
+           opt.pipeline, opt.keep_alive ? "" : ", no keep-alive");
+    printf("%llu requests in %.2fs, %.1f req/s, %.2f MB read\n", total.completed, seconds, total.completed / seconds,
+           total.bytes / 1048576.0);
+    printf("status 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu\n", total.status[2], total.status[3],
+           total.status[4], total.status[5], total.status[0] + total.status[1]);
+    printf("errors connect %llu, read %llu, timeout %llu", total.connect_errors, total.read_errors, total.timeouts);
+    if (opt.rate > 0)
+        printf(", unsent %llu", total.unsent);
+    printf("\nlatency");
+    for (int i = 0; i < 5; ++i)
+        printf(" %s %.3fms", names[i], total.latency.percentile(quantiles[i]) / 1000.0);
+    printf(" max %.3fms\n", total.latency.max() / 1000.0);
+    return 0;
+}
@@ -0,0 +1,939 @@
+/*
+热点路径的微基准：请求解析、线程池交接、连接池、应答头格式化、表格页面生成，以及locker.h里几种同步原语和pthread的对比；
+BM_dispatch按1~64个工作线程比较各种请求队列（包括原来的list + 信号量）的吞吐和调度时延
+和服务器的代码一起编译（除main.cpp以外的全部源文件）：
+    make microbench
+参数和输出格式沿用Google Benchmark，两次运行的JSON可以直接用它的tools/compare.py比较：
+    ./microbench --benchmark_format=json --benchmark_out=before.json
+    --benchmark_filter=<正则>  只跑名字匹配的
+    --benchmark_min_time=<秒>   每项至少跑这么久，默认0.5
+连接池一项需要真实的MySQL：设置 BENCH_MYSQL=host,port,user,password,db 才会跑，否则记为跳过
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <regex>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <list>
+
+#include "latency_histogram.h"
+#include "http_conn.h"
+#include "threadpool.h"
+#include "work_queue.h"
+#include "locker.h"
+#include "user_store.h"
+#include "local_storage.h"
+#include "sql_connection_pool.h"
+
+/*每个线程拿到的运行状态；被测函数先做准备，start()和stop()之间是计时的部分*/
+struct bench_run;
+struct bench_state
+{
+    long iterations;        /*每个线程要做的次数*/
+    int thread_index;
+    int threads;
+    bench_run *run;
+
+    void start();
+    void stop();
+    /*本线程处理的条数，默认等于iterations；一次迭代处理多条时设置*/
+    void set_items(long n);
+    /*不能运行（缺少环境等），只需要一个线程调用*/
+    void skip(const char *reason);
+    /*记一次操作的延迟（纳秒），记过的项在结果里多出p50和p99*/
+    void record_latency(long long ns) { latency.record(ns); }
+
+    latency_histogram latency;
+};
+
+typedef void (*bench_fn)(bench_state &st);
+
+struct bench_run
+{
+    pthread_barrier_t barrier;
+    long long real_start, real_end;
+    long long cpu_start, cpu_end;
+    std::atomic<long> items;
+    std::string skipped;
+    latency_histogram latency;  /*各线程record_latency()的合并*/
+};
+
+static long long clock_ns(clockid_t id)
+{
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void bench_state::start()
+{
+    pthread_barrier_wait(&run->barrier);
+    if (thread_index == 0)
+    {
+        run->cpu_start = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+        run->real_start = clock_ns(CLOCK_MONOTONIC);
+    }
+}
+
+void bench_state::stop()
+{
+    pthread_barrier_wait(&run->barrier);
+    if (thread_index == 0)
+    {
+        run->real_end = clock_ns(CLOCK_MONOTONIC);
+        run->cpu_end = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    }
+    pthread_barrier_wait(&run->barrier);
+}
+
+void bench_state::set_items(long n)
+{
+    run->items.fetch_add(n - iterations, std::memory_order_relaxed);
+}
+
+void bench_state::skip(const char *reason)
+{
+    run->skipped = reason;
+}
+
+struct bench_case
+{
+    std::string name;
+    bench_fn fn;
+    int threads;
+};
+
+static std::vector<bench_case> cases;
+
+static void add(const char *name, bench_fn fn, int threads = 1)
+{
+    bench_case c;
+    c.name = name;
+    c.fn = fn;
+    c.threads = threads;
+    cases.push_back(c);
+}
+
+struct thread_arg
+{
+    bench_fn fn;
+    bench_state st;
+};
+
+static void *bench_thread(void *arg)
+{
+    thread_arg *a = (thread_arg *)arg;
+    a->fn(a->st);
+    return NULL;
+}
+
+/*跑一轮：threads个线程各做iterations次*/
+static void run_once(const bench_case &c, long iterations, bench_run &run)
+{
+    pthread_barrier_init(&run.barrier, NULL, c.threads);
+    run.items.store((long)c.threads * iterations);
+    run.skipped.clear();
+    std::vector<thread_arg> args(c.threads);
+    std::vector<pthread_t> tids(c.threads);
+    for (int i = 0; i < c.threads; ++i)
+    {
+        args[i].fn = c.fn;
+        args[i].st.iterations = iterations;
+        args[i].st.thread_index = i;
+        args[i].st.threads = c.threads;
+        args[i].st.run = &run;
+    }
+    for (int i = 1; i < c.threads; ++i)
+        pthread_create(&tids[i], NULL, bench_thread, &args[i]);
+    bench_thread(&args[0]);
+    for (int i = 1; i < c.threads; ++i)
+        pthread_join(tids[i], NULL);
+    pthread_barrier_destroy(&run.barrier);
+    run.latency.reset();
+    for (int i = 0; i < c.threads; ++i)
+        run.latency.merge(args[i].st.latency);
+}
+
+/* ---------------- 请求解析 ---------------- */
+
+static const char request_static[] =
+    "GET /judge.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9990\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+static const char request_browser[] =
+    "GET /judge.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9990\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Referer: http://127.0.0.1:9990/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "Cookie: theme=dark; sid=0123456789abcdef0123456789abcdef\r\n"
+    "\r\n";
+
+static const char request_login[] =
+    "POST /2CGISQL.cgi HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9990\r\n"
+    "Connection: keep-alive\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "Content-Length: 27\r\n"
+    "\r\n"
+    "user=bench&password=bench12";
+
+/*http_conn的内部接口只在这里用*/
+class http_conn_bench
+{
+public:
+    static void attach(http_conn &c)
+    {
+        c.m_node = -1;
+        c.m_last_write = 0;
+        c.init();
+        c.attach_read_buf();
+        c.attach_write_buf();
+    }
+    static void release(http_conn &c)
+    {
+        c.release_buffers();
+    }
+    /*和init()一样清解析状态，但不还缓冲区、不清m_real_file，只测解析本身*/
+    static void load(http_conn &c, const char *req, int len)
+    {
+        memcpy(c.m_read_buf, req, len);
+        c.m_read_idx = len;
+        c.m_checked_idx = 0;
+        c.m_start_line = 0;
+        c.m_check_state = http_conn::CHECK_STATE_REQUESTLINE;
+        c.m_method = http_conn::GET;
+        c.m_url = 0;
+        c.m_version = 0;
+        c.m_host = 0;
+        c.m_content_length = 0;
+        c.m_linger = false;
+        c.m_string = NULL;
+        c.m_sid[0] = '\0';
+        c.cgi = 0;
+    }
+    static bool process_read(http_conn &c)
+    {
+        return c.process_read() == http_conn::GET_REQUEST;
+    }
+    static int parse_lines(http_conn &c)
+    {
+        int n = 0;
+        while (c.parse_line() == http_conn::LINE_OK)
+        {
+            c.m_start_line = c.m_checked_idx;
+            ++n;
+        }
+        return n;
+    }
+    static int headers(http_conn &c, bool linger, bool cookie)
+    {
+        c.m_write_idx = 0;
+        c.m_linger = linger;
+        c.m_content_type = NULL;
+        if (cookie)
+            strcpy(c.m_new_sid, "0123456789abcdef0123456789abcdef");
+        else
+            c.m_new_sid[0] = '\0';
+        c.add_status_line(200, "OK");
+        c.add_headers(1234);
+        return c.m_write_idx;
+    }
+    static size_t render_table(http_conn &c)
+    {
+        arena_string html(c.m_arena);
+        c.generate_HTML(html);
+        size_t n = html.size();
+        c.m_arena.reset();
+        return n;
+    }
+};
+
+template <const char *Req, size_t Len>
+static void bm_process_read(bench_state &st)
+{
+    http_conn c;
+    http_conn_bench::attach(c);
+    st.start();
+    for (long i = 0; i < st.iterations; ++i)
+    {
+        http_conn_bench::load(c, Req, Len - 1);
+        if (!http_conn_bench::process_read(c))
+            abort();
+    }
+    st.stop();
+    http_conn_bench::release(c);
+}
+
+static void bm_parse_line_browser(bench_state &st)
+{
+    http_conn c;
+    http_conn_bench::attach(c);
+    long lines = 0;
+    st.start();
+    for (long i = 0; i < st.iterations; ++i)
+    {
+        http_conn_bench::load(c, request_browser, sizeof(request_browser) - 1);
+        lines += http_conn_bench::parse_lines(c);
+    }
+    st.stop();
+    st.set_items(lines);
+    http_conn_bench::release(c);
+}
+
+/* ---------------- 应答 ---------------- */
+
+template <bool Linger, bool Cookie>
+static void bm_response_headers(bench_state &st)
+{
+    http_conn c;
+    http_conn_bench::attach(c);
+    st.start();
+    for (long i = 0; i < st.iterations; ++i)
+    {
+        if (http_conn_bench::headers(c, Linger, Cookie) <= 0)
+            abort();
+    }
+    st.stop();
+    http_conn_bench::release(c);
+}
+
+/*本地存储后端里放rows条记录；日志文件打开后就删掉，只用内存里的索引*/
+static local_storage *make_store(int rows)
+{
+    char path[] = "/tmp/microbench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return NULL;
+    close(fd);
+    unlink(path);
+    local_storage *store = new local_storage();
+    if (!store->open(path))
+    {
+        delete store;
+        return NULL;
+    }
+    unlink(path);
+    char user[32], content[64];
+    for (int i = 0; i < rows; ++i)
+    {
+        snprintf(user, sizeof(user), "user%d", i % 100);
+        snprintf(content, sizeof(content), "content of row %d", i);
+        store->add_info(user, content);
+    }
+    return store;
+}
+
+/*表格页面，数据在各轮之间共用*/
+template <int Rows>
+static void bm_generate_html(bench_state &st)
+{
+    static local_storage *store = make_store(Rows);
+    if (!store)
+    {
+        st.skip("local storage open failed");
+        return;
+    }
+    storage *saved = http_conn::m_storage;
+    http_conn::m_storage = store;
+    http_conn c;
+    http_conn_bench::attach(c);
+    size_t bytes = 0;
+    st.start();
+    for (long i = 0; i < st.iterations; ++i)
+        bytes += http_conn_bench::render_table(c);
+    st.stop();
+    http_conn_bench::release(c);
+    http_conn::m_storage = saved;
+    (void)bytes;
+}
+
+/* ---------------- 线程池交接 ---------------- */
+
+/*m_enqueue_us为0：只测投递，不让线程池统计排队时延*/
+struct handoff_task
+{
+    std::atomic<long> *done;
+    long long m_enqueue_us;
+    handoff_task() : done(NULL), m_enqueue_us(0) {}
+    void process() { done->fetch_add(1, std::memory_order_relaxed); }
+};
+
+/*线程池只建一次，各轮共用，不把创建线程的时间算进去*/
+template <typename Queue>
+static threadpool<handoff_task, Queue> *handoff_pool()
+{
+    static threadpool<handoff_task, Queue> *pool = new threadpool<handoff_task, Queue>(4, 10000);
+    return pool;
+}
+
+/*一个生产者（同主线程）投递，4个工作线程执行；计时到全部执行完为止。Batch为1时用append()，否则用append_batch()*/
+template <typename Queue, int Batch>
+static void bm_threadpool_handoff(bench_state &st)
+{
+    threadpool<handoff_task, Queue> *pool = handoff_pool<Queue>();
+    std::atomic<long> done(0);
+    handoff_task task;
+    task.done = &done;
+    handoff_task *batch[Batch];
+    for (int k = 0; k < Batch; ++k)
+        batch[k] = &task;
+    st.start();
+    long sent = 0;
+    while (sent < st.iterations)
+    {
+        int n = st.iterations - sent < Batch ? st.iterations - sent : Batch;
+        int added = Batch == 1 ? (pool->append(&task) ? 1 : 0) : pool->append_batch(batch, n);
+        sent += added;
+        if (added == 0)
+            sched_yield();
+    }
+    while (done.load(std::memory_order_relaxed) < st.iterations)
+        sched_yield();
+    st.stop();
+}
+
+/* ---------------- 调度时延随工作线程数的变化 ---------------- */
+
+/*原来的线程池队列：std::list + 互斥锁 + 信号量，每个请求post一次、每次取之前wait一次，
+放在这里和work_queue.h里的几种实现对比；不支持伸缩和NUMA分组*/
+template <typename T>
+class sem_queue
+{
+public:
+    sem_queue(int workers, int max_requests) : m_workers(workers), m_max_requests(max_requests), m_stop(false) {}
+
+    bool push(T *request)
+    {
+        m_queuelocker.lock();
+        if ((int)m_workqueue.size() > m_max_requests)
+        {
+            m_queuelocker.unlock();
+            return false;
+        }
+        m_workqueue.push_back(request);
+        m_queuelocker.unlock();
+        m_queuestat.post();
+        return true;
+    }
+    int push_batch(T **requests, int n, const int * = NULL)
+    {
+        int i = 0;
+        while (i < n && push(requests[i]))
+            ++i;
+        return i;
+    }
+    T *pop(int)
+    {
+        while (true)
+        {
+            m_queuestat.wait();
+            if (m_stop)
+                return NULL;
+            m_queuelocker.lock();
+            if (m_workqueue.empty())
+            {
+                m_queuelocker.unlock();
+                continue;
+            }
+            T *request = m_workqueue.front();
+            m_workqueue.pop_front();
+            m_queuelocker.unlock();
+            return request;
+        }
+    }
+    void set_worker_nodes(const std::vector<int> &) {}
+    void set_active(int) {}
+    int size()
+    {
+        m_queuelocker.lock();
+        int n = m_workqueue.size();
+        m_queuelocker.unlock();
+        return n;
+    }
+    void stop()
+    {
+        m_stop = true;
+        for (int i = 0; i < m_workers; ++i)
+            m_queuestat.post();
+    }
+
+private:
+    int m_workers;
+    int m_max_requests;
+    std::list<T *> m_workqueue;
+    locker m_queuelocker;
+    sem m_queuestat;
+    volatile bool m_stop;
+};
+
+/*busy为1时还在队列里或正在执行；latency_ns是投递到开始执行的时间*/
+struct dispatch_task
+{
+    std::atomic<int> busy;
+    long long m_enqueue_us;
+    long long sent_ns;
+    long long latency_ns;
+    dispatch_task() : busy(0), m_enqueue_us(0), sent_ns(0), latency_ns(0) {}
+    void process()
+    {
+        latency_ns = clock_ns(CLOCK_MONOTONIC) - sent_ns;
+        busy.store(0, std::memory_order_release);
+    }
+};
+
+/*一个生产者往Workers个工作线程的线程池里投递，每轮新建线程池，不计入时间
+在途的请求限制在工作线程数的两倍：测的是交接和唤醒的开销，而不是队列积压的时间
+items/s是每秒调度的请求数，p99是从append()到process()开始的时间*/
+template <typename Queue, int Workers>
+static void bm_dispatch(bench_state &st)
+{
+    threadpool<dispatch_task, Queue> pool(Workers, 10000);
+    std::vector<dispatch_task> tasks(2 * Workers);
+    size_t next = 0;
+    st.start();
+    for (long i = 0; i < st.iterations; ++i)
+    {
+        dispatch_task &t = tasks[next];
+        next = next + 1 < tasks.size() ? next + 1 : 0;
+        while (t.busy.load(std::memory_order_acquire))
+            sched_yield();
+        if (t.sent_ns)
+            st.record_latency(t.latency_ns);
+        t.busy.store(1, std::memory_order_relaxed);
+        t.sent_ns = clock_ns(CLOCK_MONOTONIC);
+        while (!pool.append(&t))
+            sched_yield();
+    }
+    for (size_t k = 0; k < tasks.size(); ++k)
+    {
+        while (tasks[k].busy.load(std::memory_order_acquire))
+            sched_yield();
+        if (tasks[k].sent_ns)
+            st.record_latency(tasks[k].latency_ns);
+    }
+    st.stop();
+}
+
+template <typename Queue>
+static void add_dispatch(const char *queue)
+{
+    std::string name = std::string("BM_dispatch/") + queue + "/workers:";
+    add((name + "1").c_str(), bm_dispatch<Queue, 1>);
+    add((name + "2").c_str(), bm_dispatch<Queue, 2>);
+    add((name + "4").c_str(), bm_dispatch<Queue, 4>);
+    add((name + "8").c_str(), bm_dispatch<Queue, 8>);
+    add((name + "16").c_str(), bm_dispatch<Queue, 16>);
+    add((name + "32").c_str(), bm_dispatch<Queue, 32>);
+    add((name + "64").c_str(), bm_dispatch<Queue, 64>);
+}
+
+/* ---------------- 连接池 ---------------- */
+
+static bool mysql_pool_ready()
+{
+    static int ready = -1;
+    if (ready >= 0)
+        return ready;
+    ready = 0;
+    const char *env = getenv("BENCH_MYSQL");
+    char host[128], user[64], passwd[64], db[64];
+    int port;
+    if (!env || sscanf(env, "%127[^,],%d,%63[^,],%63[^,],%63s", host, &port, user, passwd, db) != 5)
+        return false;
+    /*init()连不上时直接exit，先试一次*/
+    MYSQL *probe = mysql_init(NULL);
+    if (!probe || !mysql_real_connect(probe, host, user, passwd, db, port, NULL, 0))
+    {
+        if (probe)
+            mysql_close(probe);
+        return false;
+    }
+    mysql_close(probe);
+    connection_pool::GetInstance()->init(host, user, passwd, db, port, 8);
+    ready = 1;
+    return true;
+}
+
+/*8个连接，线程数多于连接数时就是在测等待空闲连接*/
+static void bm_connection_pool(bench_state &st)
+{
+    if (st.thread_index == 0 && !mysql_pool_ready())
+        st.skip("BENCH_MYSQL not set or MySQL unreachable");
+    st.start();
+    if (st.run->skipped.empty())
+    {
+        connection_pool *pool = connection_pool::GetInstance();
+        for (long i = 0; i < st.iterations; ++i)
+        {
+            MYSQL *conn = pool->GetConnection();
+            pool->ReleaseConnection(conn);
+        }
+    }
+    st.stop();
+}
+
+/* ---------------- 同步原语 ---------------- */
+
+static long shared_counter;
+
+template <typename Lock>
+static void bm_lock(bench_state &st)
+{
+    static Lock lock;
+    st.start();
+    for (long i = 0; i < st.iterations; ++i)
+    {
+        lock.lock();
+        ++shared_counter;
+        lock.unlock();
+    }
+    st.stop();
+}
+
+/*两个线程：0号post，1号wait，测一次交接*/
+template <typename Sem>
+static void bm_sem_handoff(bench_state &st)
+{
+    static Sem s;
+    st.start();
+    for (long i = 0; i < st.iterations; ++i)
+    {
+        if (st.thread_index == 0)
+            s.post();
+        else
+            s.wait();
+    }
+    st.stop();
+}
+
+/*fsem和sem的接口一样；pthread的rwlock包一层，和rwlock对比*/
+class pthread_rwlock
+{
+public:
+    pthread_rwlock() { pthread_rwlock_init(&m_lock, NULL); }
+    ~pthread_rwlock() { pthread_rwlock_destroy(&m_lock); }
+    void rdlock() { pthread_rwlock_rdlock(&m_lock); }
+    void rdunlock() { pthread_rwlock_unlock(&m_lock); }
+    void wrlock() { pthread_rwlock_wrlock(&m_lock); }
+    void wrunlock() { pthread_rwlock_unlock(&m_lock); }
+
+private:
+    pthread_rwlock_t m_lock;
+};
+
+/*读多写少：0号线程每100次写一次，其他都是读*/
+template <typename Lock>
+static void bm_rwlock_read_mostly(bench_state &st)
+{
+    static Lock lock;
+    static volatile long value;
+    long sum = 0;
+    st.start();
+    for (long i = 0; i < st.iterations; ++i)
+    {
+        if (st.thread_index == 0 && i % 100 == 0)
+        {
+            lock.wrlock();
+            value = value + 1;
+            lock.wrunlock();
+        }
+        else
+        {
+            lock.rdlock();
+            sum += value;
+            lock.rdunlock();
+        }
+    }
+    st.stop();
+    (void)sum;
+}
+
+/* ---------------- 用户缓存 ---------------- */
+
+static user_store *bench_users()
+{
+    static user_store *store = NULL;
+    if (!store)
+    {
+        store = new user_store(64, 0);
+        char name[32];
+        for (int i = 0; i < 10000; ++i)
+        {
+            snprintf(name, sizeof(name), "user%d", i);
+            store->insert(name, "password");
+        }
+    }
+    return store;
+}
+
+/*按线程数扫描，看分片后的伸缩曲线；每16次取样一次单次耗时算尾延迟，取样本身的时钟开销不摊到其余15次上*/
+static void bm_user_store_check(bench_state &st)
+{
+    if (st.thread_index == 0)
+        bench_users();
+    st.start();
+    user_store *store = bench_users();
+    char name[32];
+    long hits = 0;
+    for (long i = 0; i < st.iterations; ++i)
+    {
+        snprintf(name, sizeof(name), "user%ld", (i * 7919 + st.thread_index) % 10000);
+        if (i % 16 == 0)
+        {
+            long long t = clock_ns(CLOCK_MONOTONIC);
+            hits += store->check(name, "password");
+            st.record_latency(clock_ns(CLOCK_MONOTONIC) - t);
+        }
+        else
+            hits += store->check(name, "password");
+    }
+    st.stop();
+    if (hits != st.iterations)
+        abort();
+}
+
+static void register_all()
+{
+    add("BM_process_read/static_get", bm_process_read<request_static, sizeof(request_static)>);
+    add("BM_process_read/browser_get", bm_process_read<request_browser, sizeof(request_browser)>);
+    add("BM_process_read/login_post", bm_process_read<request_login, sizeof(request_login)>);
+    add("BM_parse_line/browser_headers", bm_parse_line_browser);
+    add("BM_response_headers/close", bm_response_headers<false, false>);
+    add("BM_response_headers/keep_alive_cookie", bm_response_headers<true, true>);
+    add("BM_generate_HTML/rows:100", bm_generate_html<100>);
+    add("BM_generate_HTML/rows:10000", bm_generate_html<10000>);
+    add("BM_threadpool_handoff/list_queue", bm_threadpool_handoff<list_queue<handoff_task>, 1>);
+    add("BM_threadpool_handoff/steal_queue", bm_threadpool_handoff<steal_queue<handoff_task>, 1>);
+    add("BM_threadpool_handoff/ring_queue", bm_threadpool_handoff<ring_queue<handoff_task>, 1>);
+    add("BM_threadpool_handoff/list_queue/batch:64", bm_threadpool_handoff<list_queue<handoff_task>, 64>);
+    add("BM_threadpool_handoff/steal_queue/batch:64", bm_threadpool_handoff<steal_queue<handoff_task>, 64>);
+    add("BM_threadpool_handoff/ring_queue/batch:64", bm_threadpool_handoff<ring_queue<handoff_task>, 64>);
+    add_dispatch<sem_queue<dispatch_task> >("sem_queue");
+    add_dispatch<list_queue<dispatch_task> >("list_queue");
+    add_dispatch<steal_queue<dispatch_task> >("steal_queue");
+    add_dispatch<ring_queue<dispatch_task> >("ring_queue");
+    add("BM_connection_pool", bm_connection_pool, 1);
+    add("BM_connection_pool", bm_connection_pool, 4);
+    add("BM_connection_pool", bm_connection_pool, 16);
+    add("BM_mutex/locker", bm_lock<locker>, 1);
+    add("BM_mutex/locker", bm_lock<locker>, 4);
+    add("BM_mutex/fmutex", bm_lock<fmutex>, 1);
+    add("BM_mutex/fmutex", bm_lock<fmutex>, 4);
+    add("BM_sem_handoff/sem", bm_sem_handoff<sem>, 2);
+    add("BM_sem_handoff/fsem", bm_sem_handoff<fsem>, 2);
+    add("BM_rwlock_read_mostly/pthread", bm_rwlock_read_mostly<pthread_rwlock>, 4);
+    add("BM_rwlock_read_mostly/rwlock", bm_rwlock_read_mostly<rwlock>, 4);
+    for (int threads = 1; threads <= 64; threads *= 2)
+        add("BM_user_store_check", bm_user_store_check, threads);
+}
+
+/* ---------------- 运行和输出 ---------------- */
+
+struct bench_result
+{
+    std::string name;
+    int threads;
+    long iterations;
+    double real_ns;         /*每次迭代的墙钟时间*/
+    double cpu_ns;          /*每次迭代的CPU时间（所有线程加起来）*/
+    double items_per_second;
+    long long p50_ns, p99_ns;  /*没有记延迟时为-1*/
+    std::string skipped;
+};
+
+/*次数逐轮放大，直到一轮跑够min_time秒*/
+static bench_result measure(const bench_case &c, double min_time)
+{
+    bench_result r;
+    /*同一项按不同线程数注册了几次，或者本身是多线程的，名字后面加上线程数*/
+    int same = 0;
+    for (size_t i = 0; i < cases.size(); ++i)
+        same += cases[i].name == c.name;
+    r.name = c.threads > 1 || same > 1 ? c.name + "/threads:" + std::to_string(c.threads) : c.name;
+    r.threads = c.threads;
+    bench_run run;
+    long iterations = 1;
+    while (true)
+    {
+        run_once(c, iterations, run);
+        if (!run.skipped.empty())
+        {
+            r.iterations = 0;
+            r.real_ns = r.cpu_ns = r.items_per_second = 0;
+            r.p50_ns = r.p99_ns = -1;
+            r.skipped = run.skipped;
+            return r;
+        }
+        double secs = (run.real_end - run.real_start) / 1e9;
+        if (secs >= min_time || iterations >= 1000000000L)
+        {
+            r.iterations = iterations;
+            r.real_ns = (run.real_end - run.real_start) / (double)iterations;
+            r.cpu_ns = (run.cpu_end - run.cpu_start) / (double)iterations;
+            r.items_per_second = secs > 0 ? run.items.load() / secs : 0;
+            r.p50_ns = run.latency.total() ? run.latency.percentile(0.5) : -1;
+            r.p99_ns = run.latency.total() ? run.latency.percentile(0.99) : -1;
+            return r;
+        }
+        double grow = secs > 0 ? min_time * 1.4 / secs : 100;
+        if (grow > 100)
+            grow = 100;
+        if (grow < 2)
+            grow = 2;
+        iterations = (long)(iterations * grow);
+    }
+}
+
+static void print_json(FILE *out, const std::vector<bench_result> &results, const char *prog)
+{
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    char date[64];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", &tm);
+    fprintf(out, "{\n  \"context\": {\n    \"date\": \"%s\",\n    \"host_name\": \"%s\",\n    \"executable\": \"%s\",\n"
+                 "    \"num_cpus\": %ld,\n    \"library_build_type\": \"%s\"\n  },\n  \"benchmarks\": [\n",
+            date, host, prog, sysconf(_SC_NPROCESSORS_ONLN),
+#ifdef NDEBUG
+            "release"
+#else
+            "debug"
+#endif
+    );
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const bench_result &r = results[i];
+        fprintf(out, "    {\n      \"name\": \"%s\",\n      \"run_name\": \"%s\",\n      \"run_type\": \"iteration\",\n"
+                     "      \"repetitions\": 1,\n      \"repetition_index\": 0,\n      \"threads\": %d,\n",
+                r.name.c_str(), r.name.c_str(), r.threads);
+        if (!r.skipped.empty())
+            fprintf(out, "      \"error_occurred\": true,\n      \"error_message\": \"%s\",\n", r.skipped.c_str());
+        /*和Google Benchmark的自定义计数器一样，作为额外的字段*/
+        if (r.p99_ns >= 0)
+            fprintf(out, "      \"p50_latency_ns\": %lld,\n      \"p99_latency_ns\": %lld,\n", r.p50_ns, r.p99_ns);
+        fprintf(out, "      \"iterations\": %ld,\n      \"real_time\": %.4f,\n      \"cpu_time\": %.4f,\n"
+                     "      \"time_unit\": \"ns\",\n      \"items_per_second\": %.4f\n    }%s\n",
+                r.iterations, r.real_ns, r.cpu_ns, r.items_per_second, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+static void print_console_header(FILE *out)
+{
+    fprintf(out, "%-48s %14s %14s %12s %16s %14s %14s\n", "Benchmark", "Time", "CPU", "Iterations", "items/s", "p50", "p99");
+}
+
+static void print_console(FILE *out, const bench_result &r)
+{
+    if (!r.skipped.empty())
+        fprintf(out, "%-48s skipped: %s\n", r.name.c_str(), r.skipped.c_str());
+    else if (r.p99_ns >= 0)
+        fprintf(out, "%-48s %11.1f ns %11.1f ns %12ld %16.0f %11lld ns %11lld ns\n", r.name.c_str(), r.real_ns, r.cpu_ns, r.iterations,
+                r.items_per_second, r.p50_ns, r.p99_ns);
+    else
+        fprintf(out, "%-48s %11.1f ns %11.1f ns %12ld %16.0f\n", r.name.c_str(), r.real_ns, r.cpu_ns, r.iterations, r.items_per_second);
+    fflush(out);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filter = NULL;
+    const char *out_path = NULL;
+    bool json = false;
+    double min_time = 0.5;
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *a = argv[i];
+        if (strncmp(a, "--benchmark_filter=", 19) == 0)
+            filter = a + 19;
+        else if (strncmp(a, "--benchmark_out=", 16) == 0)
+            out_path = a + 16;
+        else if (strcmp(a, "--benchmark_format=json") == 0)
+            json = true;
+        else if (strcmp(a, "--benchmark_format=console") == 0)
+            json = false;
+        else if (strncmp(a, "--benchmark_min_time=", 21) == 0)
+            min_time = atof(a + 21);
+        else if (strcmp(a, "--benchmark_list_tests") == 0)
+            filter = "\x01list";
+        else
+        {
+            printf("usage: %s [--benchmark_filter=regex] [--benchmark_format=console|json] [--benchmark_out=file]"
+                   " [--benchmark_min_time=seconds] [--benchmark_list_tests]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    /*被测代码里的printf（线程池、存储的启动信息）改到标准错误，标准输出只留结果*/
+    FILE *results_out = stdout;
+    int saved_stdout = dup(STDOUT_FILENO);
+    if (saved_stdout >= 0)
+    {
+        results_out = fdopen(saved_stdout, "w");
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
+    register_all();
+    bool list = filter && strcmp(filter, "\x01list") == 0;
+    std::regex re(filter && !list ? filter : ".");
+    std::vector<bench_result> results;
+    if (!json && !list)
+        print_console_header(results_out);
+    for (size_t i = 0; i < cases.size(); ++i)
+    {
+        const bench_case &c = cases[i];
+        if (!std::regex_search(c.name, re))
+            continue;
+        if (list)
+        {
+            fprintf(results_out, "%s (threads %d)\n", c.name.c_str(), c.threads);
+            continue;
+        }
+        results.push_back(measure(c, min_time));
+        if (!json)
+            print_console(results_out, results.back());
+    }
+    if (list)
+        return 0;
+
+    if (json)
+        print_json(results_out, results, argv[0]);
+    if (out_path)
+    {
+        /*--benchmark_out 总是写JSON*/
+        FILE *fp = fopen(out_path, "w");
+        if (!fp)
+        {
+            fprintf(stderr, "open %s failed\n", out_path);
+            return 1;
+        }
+        print_json(fp, results, argv[0]);
+        fclose(fp);
+    }
+    return 0;
+}
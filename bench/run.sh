@@ -0,0 +1,171 @@
+#!/bin/bash
+# 端到端压测：在本机起一个服务器，依次跑 bench/scenarios/ 下的场景，结果每个场景一行JSON
+# 存储用本地后端（-s local，追加日志 + 内存索引），不需要mysqld，整套可以离线在一台机器上跑
+# 每个场景前后各抓一次 /metrics，结果里的 syscalls_per_request 是服务器平均每个应答的系统调用次数（http_syscalls_total的差值除以应答数）
+#
+# 用法：bench/run.sh [场景...]      场景即 scenarios/<名字>.txt，默认 static login register insert table mixed
+# 环境变量：
+#   SERVER    服务器程序，不指定时用仓库里的Makefile构建 server（已经是最新的就不重新编译）
+#   LOADGEN   压测程序，不指定时同样构建 loadgen；构建参数（STD、CXXFLAGS、MYSQL_LIBS等）可以通过环境变量传给make
+#   DOCS      网站根目录，默认生成一组占位页面
+#   PORT      默认 9990
+#   DURATION  每个场景的秒数，默认 10
+#   CONNS     连接数，默认 50；THREADS 压测线程数，默认 2
+#   RATE      开环的每秒请求数（延迟按计划发出时间计算）；不设为闭环
+#   ARGS      传给服务器的其他参数，如 "-t 4,8,4 -g"
+#   OUT       结果文件，默认 bench-results.jsonl（追加）
+#   AFFINITY  绑核对比，如 auto 或 0,2-7：每个场景先不绑核、再加 -a $AFFINITY 各跑一遍（各自重启服务器），
+#             结果行带 "pinned"，最后每个场景再输出一行 {"compare":"affinity",...} 列出两次的rps和延迟
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+REPO=$(dirname "$BENCH")
+targets=""
+[ -z "$SERVER" ] && targets="$targets server"
+[ -z "$LOADGEN" ] && targets="$targets loadgen"
+if [ -n "$targets" ]; then
+    # make的输出放到stderr，stdout只有结果
+    make -C "$REPO" $targets >&2 || exit 1
+fi
+SERVER=$(realpath "${SERVER:-$REPO/server}")
+LOADGEN=$(realpath "${LOADGEN:-$REPO/loadgen}")
+PORT=${PORT:-9990}
+DURATION=${DURATION:-10}
+CONNS=${CONNS:-50}
+THREADS=${THREADS:-2}
+OUT=$(realpath "${OUT:-bench-results.jsonl}")
+SCENARIOS=${*:-static login register insert table mixed}
+
+for f in "$SERVER" "$LOADGEN"; do
+    if [ ! -x "$f" ]; then
+        echo "$f not found" >&2
+        exit 1
+    fi
+done
+
+WORK=$(mktemp -d)
+trap 'kill $PID 2>/dev/null; wait $PID 2>/dev/null; rm -rf "$WORK"' EXIT
+
+# 服务器在工作目录下找 docs/
+if [ -n "$DOCS" ]; then
+    cp -r "$DOCS" "$WORK/docs"
+else
+    mkdir "$WORK/docs"
+    for page in judge log register welcome_2 logError registerError insert_info fans; do
+        echo "<html><body>$page</body></html>" > "$WORK/docs/$page.html"
+    done
+fi
+
+cd "$WORK"
+PID=""
+
+# 不用curl：用bash的/dev/tcp发一个不保持连接的请求，服务器回完就关
+request() {
+    exec 3<>"/dev/tcp/127.0.0.1/$PORT" || return 1
+    printf '%s %s HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Length: %d\r\n\r\n%s' "$1" "$2" "${#3}" "$3" >&3
+    cat <&3 > /dev/null 2>&1
+    exec 3<&-
+}
+
+# 服务器的系统调用计数和应答数，每行 "名字 值"
+counters() {
+    exec 3<>"/dev/tcp/127.0.0.1/$PORT" || return 1
+    printf 'GET /metrics HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n' >&3
+    cat <&3 2>/dev/null | awk '
+        /^http_syscalls_total[{]/ { match($1, /call="[^"]*"/); print substr($1, RSTART + 6, RLENGTH - 7), $2 }
+        /^http_response_bytes_count / { print "responses", $2 }'
+    exec 3<&-
+}
+
+# 两次counters()的输出之间的差值，除以应答数，输出一个JSON对象
+per_request() {
+    printf '%s\n---\n%s\n' "$1" "$2" | awk '
+        $1 == "---" { after = 1; next }
+        !after { before[$1] = $2; next }
+        { delta[$1] = $2 - before[$1] }
+        END {
+            n = split("epoll_wait epoll_ctl accept read write file", calls, " ")
+            out = ""
+            total = 0
+            for (i = 1; i <= n; ++i) {
+                v = delta["responses"] > 0 ? delta[calls[i]] / delta["responses"] : 0
+                total += v
+                out = out sprintf("\"%s\":%.2f,", calls[i], v)
+            }
+            printf "{%s\"total\":%.2f}", out, total
+        }'
+}
+
+# 用参数$1启动服务器，等它能处理请求后注册压测用的账号；每次用新的数据文件
+start_server() {
+    rm -rf "$WORK/bench.db" "$WORK/logs"
+    "$SERVER" -i 127.0.0.1 -p "$PORT" -s local -d "$WORK/bench.db" -l "$WORK/logs" $1 > server.out 2>&1 &
+    PID=$!
+    for i in $(seq 50); do
+        request GET /judge.html 2>/dev/null && break
+        sleep 0.1
+    done
+    if ! kill -0 $PID 2>/dev/null; then
+        cat server.out >&2
+        exit 1
+    fi
+    request POST /3CGISQL.cgi "user=bench&password=bench"
+}
+
+stop_server() {
+    kill $PID 2>/dev/null
+    wait $PID 2>/dev/null
+    PID=""
+}
+
+# 从loadgen的JSON结果里取一个数值字段
+field() {
+    echo "$1" | grep -o "\"$2\":[0-9.]*" | head -1 | cut -d: -f2
+}
+
+MODE=""
+if [ -n "$RATE" ]; then
+    MODE="-r $RATE"
+fi
+
+# 每种服务器参数跑一遍所有场景；设了AFFINITY时多一遍绑核的
+CONFIGS=("$ARGS")
+if [ -n "$AFFINITY" ]; then
+    CONFIGS+=("${ARGS:+$ARGS }-a $AFFINITY")
+fi
+declare -A summary
+for c in "${!CONFIGS[@]}"; do
+    args=${CONFIGS[$c]}
+    pinned=$([ "$c" -eq 1 ] && echo true || echo false)
+    start_server "$args"
+    for s in $SCENARIOS; do
+        file="$BENCH/scenarios/$s.txt"
+        if [ ! -f "$file" ]; then
+            echo "unknown scenario $s" >&2
+            continue
+        fi
+        before=$(counters)
+        result=$("$LOADGEN" -p "$PORT" -c "$CONNS" -t "$THREADS" -d "$DURATION" $MODE -f "$file" -j)
+        after=$(counters)
+        syscalls=$(per_request "$before" "$after")
+        line="{\"scenario\":\"$s\",\"server_args\":\"$args\","
+        if [ -n "$AFFINITY" ]; then
+            line="$line\"pinned\":$pinned,"
+        fi
+        line="$line\"result\":$result,\"syscalls_per_request\":$syscalls}"
+        echo "$line"
+        echo "$line" >> "$OUT"
+        summary[$s,$c]="{\"rps\":$(field "$result" rps),\"p50_us\":$(field "$result" p50),\"p99_us\":$(field "$result" p99),\"p99.9_us\":$(field "$result" p99.9)}"
+    done
+    stop_server
+done
+
+if [ -n "$AFFINITY" ]; then
+    for s in $SCENARIOS; do
+        if [ -z "${summary[$s,0]}" ] || [ -z "${summary[$s,1]}" ]; then
+            continue
+        fi
+        line="{\"compare\":\"affinity\",\"scenario\":\"$s\",\"affinity\":\"$AFFINITY\",\"unpinned\":${summary[$s,0]},\"pinned\":${summary[$s,1]}}"
+        echo "$line"
+        echo "$line" >> "$OUT"
+    done
+fi
@@ -0,0 +1,490 @@
+/*
+连接数浸泡测试：爬坡建立大量保持连接的空闲连接，每个连接隔一段时间发一个请求，持续观察服务器的内存和事件循环
+    make soak
+源地址轮流使用 127.0.0.1、127.0.0.2 ……（整个127/8都在lo上，不用配置），每个源地址最多约2.8万个端口（ip_local_port_range），
+十万连接至少要4个；客户端和服务器的 ulimit -n 都要调大（fs.nr_open / ulimit -Hn）
+每隔 -s 秒抓一次服务器的 /metrics，输出一行：客户端的在线连接数、建连速率、请求延迟，
+服务器的在线连接、连接对象、缓冲区池占用、RSS、每连接内存（相对开始前的基线）、fd数、accept速率、事件循环一轮耗时的p99
+*/
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "latency_histogram.h"
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+static long long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+struct options
+{
+    const char *host;
+    int port;
+    int connections;
+    int aliases;            /*源地址个数*/
+    int ramp;               /*每秒新建的连接数*/
+    int interval;           /*每个连接发请求的间隔（秒）*/
+    int hold;               /*全部建好之后保持的秒数*/
+    int stats;              /*输出间隔（秒）*/
+    const char *url;
+    bool json;
+};
+
+static options opt;
+static sockaddr_in server_addr;
+
+/*十万个连接，每个只记最少的状态*/
+struct soak_conn
+{
+    int fd;
+    unsigned char state;
+    bool in_wheel;
+    bool pending;           /*请求发出去了，应答还没收完*/
+    int remaining;          /*当前应答还差的字节数，-1表示还没收到头部*/
+    long long sent;
+};
+
+enum { CLOSED = 0, CONNECTING, OPEN };
+
+struct client_stats
+{
+    long open;
+    long connects;
+    long connect_errors;
+    long closed;            /*被服务器关掉的*/
+    long requests;
+    long responses;
+    latency_histogram latency;
+
+    client_stats() : open(0), connects(0), connect_errors(0), closed(0), requests(0), responses(0) {}
+};
+
+/*/metrics 的一次抓取：指标名（含标签）到值*/
+typedef std::map<std::string, double> sample;
+
+static bool scrape(sample &out)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+    struct timeval tv = {3, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (sockaddr *)&server_addr, sizeof(server_addr)) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    const char req[] = "GET /metrics HTTP/1.1\r\nHost: soak\r\n\r\n";
+    send(fd, req, sizeof(req) - 1, MSG_NOSIGNAL);
+    std::string text;
+    char buf[65536];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+        text.append(buf, n);
+    close(fd);
+
+    size_t body = text.find("\r\n\r\n");
+    if (body == std::string::npos)
+        return false;
+    out.clear();
+    size_t pos = body + 4;
+    while (pos < text.size())
+    {
+        size_t end = text.find('\n', pos);
+        if (end == std::string::npos)
+            end = text.size();
+        if (text[pos] != '#')
+        {
+            size_t space = text.rfind(' ', end);
+            if (space != std::string::npos && space > pos)
+                out[text.substr(pos, space - pos)] = atof(text.c_str() + space + 1);
+        }
+        pos = end + 1;
+    }
+    return true;
+}
+
+static double value(const sample &s, const char *name)
+{
+    sample::const_iterator it = s.find(name);
+    return it == s.end() ? 0 : it->second;
+}
+
+/*两次抓取之间某个直方图的第q分位：按le累计的桶相减，找第一个达到q的上界*/
+static double histogram_quantile(const sample &now, const sample &before, const char *name, double q)
+{
+    std::string prefix = std::string(name) + "_bucket{le=\"";
+    std::vector<std::pair<double, double> > buckets;
+    for (sample::const_iterator it = now.lower_bound(prefix); it != now.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+    {
+        std::string le = it->first.substr(prefix.size());
+        double bound = le.compare(0, 4, "+Inf") == 0 ? 1e300 : atof(le.c_str());
+        sample::const_iterator old = before.find(it->first);
+        buckets.push_back(std::make_pair(bound, it->second - (old == before.end() ? 0 : old->second)));
+    }
+    std::sort(buckets.begin(), buckets.end());
+    if (buckets.empty() || buckets.back().second <= 0)
+        return 0;
+    double target = q * buckets.back().second;
+    for (size_t i = 0; i < buckets.size(); ++i)
+    {
+        if (buckets[i].second >= target)
+            return buckets[i].first;
+    }
+    return buckets.back().first;
+}
+
+static int raise_fd_limit()
+{
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    return rl.rlim_cur == RLIM_INFINITY ? 1 << 30 : (int)rl.rlim_cur;
+}
+
+static bool start_connect(int epfd, std::vector<soak_conn> &conns, int i, client_stats &st)
+{
+    soak_conn &c = conns[i];
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c.fd < 0)
+    {
+        ++st.connect_errors;
+        return false;
+    }
+    /*源地址轮流换，端口等到connect时才按四元组分配，不受每个源地址bind时的端口数限制*/
+    int one = 1;
+    setsockopt(c.fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+    sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(0x7f000001 + i % opt.aliases);
+    if (bind(c.fd, (sockaddr *)&local, sizeof(local)) != 0 ||
+        (connect(c.fd, (sockaddr *)&server_addr, sizeof(server_addr)) != 0 && errno != EINPROGRESS))
+    {
+        ++st.connect_errors;
+        close(c.fd);
+        c.fd = -1;
+        return false;
+    }
+    c.state = CONNECTING;
+    epoll_event ev;
+    ev.data.u32 = i;
+    ev.events = EPOLLOUT;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &ev);
+    return true;
+}
+
+static void close_conn(int epfd, soak_conn &c, client_stats &st)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c.fd, NULL);
+    close(c.fd);
+    c.fd = -1;
+    if (c.state == OPEN)
+    {
+        --st.open;
+        ++st.closed;
+    }
+    else
+        ++st.connect_errors;
+    c.state = CLOSED;
+    c.pending = false;
+}
+
+static void send_request(int epfd, soak_conn &c, client_stats &st, const std::string &req)
+{
+    if (c.state != OPEN || c.pending)
+        return;
+    ssize_t n = send(c.fd, req.data(), req.size(), MSG_NOSIGNAL);
+    if (n != (ssize_t)req.size())
+    {
+        close_conn(epfd, c, st);
+        return;
+    }
+    c.pending = true;
+    c.remaining = -1;
+    c.sent = now_us();
+    ++st.requests;
+}
+
+/*应答很小，头部总在第一次读到的数据里*/
+static void on_readable(int epfd, soak_conn &c, client_stats &st)
+{
+    static char buf[65536];
+    while (true)
+    {
+        ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            close_conn(epfd, c, st);
+            return;
+        }
+        if (n < 0)
+            return;
+        if (!c.pending)
+            continue;
+        if (c.remaining < 0)
+        {
+            const char *end = (const char *)memmem(buf, n, "\r\n\r\n", 4);
+            const char *cl = (const char *)memmem(buf, n, "Content-Length:", 15);
+            if (!end)
+                continue;
+            int body = cl && cl < end ? atoi(cl + 15) : 0;
+            c.remaining = (int)(end + 4 - buf) + body;
+        }
+        c.remaining -= n;
+        if (c.remaining <= 0)
+        {
+            c.pending = false;
+            ++st.responses;
+            st.latency.record(now_us() - c.sent);
+        }
+    }
+}
+
+static void report(double t, const client_stats &st, long connects_delta, double secs,
+                   const sample &now, const sample &before, const sample &baseline, bool ok)
+{
+    double live = value(now, "http_connections");
+    double rss = value(now, "process_resident_memory_bytes");
+    double base_live = value(baseline, "http_connections");
+    double base_rss = value(baseline, "process_resident_memory_bytes");
+    double per_conn = live > base_live ? (rss - base_rss) / (live - base_live) : 0;
+    double accept_rate = (value(now, "http_connections_accepted_total") - value(before, "http_connections_accepted_total")) / secs;
+    double loop_p99 = histogram_quantile(now, before, "event_loop_iteration_seconds", 0.99);
+    double events_p99 = histogram_quantile(now, before, "epoll_wait_events", 0.99);
+    if (opt.json)
+    {
+        printf("{\"t\":%.1f,\"client\":{\"open\":%ld,\"connect_rate\":%.1f,\"connect_errors\":%ld,\"closed\":%ld,"
+               "\"requests\":%ld,\"responses\":%ld,\"latency_us\":{\"p50\":%lld,\"p99\":%lld,\"max\":%lld}}",
+               t, st.open, connects_delta / secs, st.connect_errors, st.closed, st.requests, st.responses,
+               st.latency.percentile(0.5), st.latency.percentile(0.99), st.latency.max());
+        if (ok)
+            printf(",\"server\":{\"connections\":%.0f,\"conn_objects\":%.0f,\"conn_bytes\":%.0f,\"read_buffers\":%.0f,"
+                   "\"write_buffers\":%.0f,\"rss_bytes\":%.0f,\"rss_per_conn\":%.0f,\"open_fds\":%.0f,\"max_fds\":%.0f,"
+                   "\"accept_rate\":%.1f,\"loop_p99_us\":%.0f,\"epoll_events_p99\":%.0f}",
+                   live, value(now, "http_conn_objects"), value(now, "http_conn_bytes"),
+                   value(now, "http_buffers_in_use{kind=\"read\"}"), value(now, "http_buffers_in_use{kind=\"write\"}"),
+                   rss, per_conn, value(now, "process_open_fds"), value(now, "process_max_fds"), accept_rate,
+                   loop_p99 * 1e6, events_p99);
+        printf("}\n");
+    }
+    else
+    {
+        printf("%6.1fs client open %ld (+%.0f/s) errors %ld closed %ld, %ld req p50 %.2fms p99 %.2fms",
+               t, st.open, connects_delta / secs, st.connect_errors, st.closed, st.responses,
+               st.latency.percentile(0.5) / 1000.0, st.latency.percentile(0.99) / 1000.0);
+        if (ok)
+            printf(" | server live %.0f objs %.0f (%.1fMB) bufs r%.0f/w%.0f rss %.1fMB (%.1fKB/conn) fds %.0f/%.0f accept %.0f/s loop p99 %.3fms events p99 %.0f",
+                   live, value(now, "http_conn_objects"), value(now, "http_conn_bytes") / 1048576.0,
+                   value(now, "http_buffers_in_use{kind=\"read\"}"), value(now, "http_buffers_in_use{kind=\"write\"}"),
+                   rss / 1048576.0, per_conn / 1024.0, value(now, "process_open_fds"), value(now, "process_max_fds"),
+                   accept_rate, loop_p99 * 1000.0, events_p99);
+        else
+            printf(" | /metrics scrape failed");
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [-h host] [-p port] [-n connections] [-a aliases] [-r ramp_per_sec] [-i request_interval] [-d hold_secs] [-s stats_secs] [-u url] [-j]\n", prog);
+    printf("  -a  源地址个数（127.0.0.1起），默认每2.5万个连接一个\n");
+    printf("  -i  每个连接隔多少秒发一个请求，0表示只建连接不发请求\n");
+    printf("  -j  每行输出一个JSON\n");
+}
+
+int main(int argc, char *argv[])
+{
+    opt.host = "127.0.0.1";
+    opt.port = 9990;
+    opt.connections = 100000;
+    opt.aliases = 0;
+    opt.ramp = 10000;
+    opt.interval = 30;
+    opt.hold = 60;
+    opt.stats = 5;
+    opt.url = "/judge.html";
+    opt.json = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "h:p:n:a:r:i:d:s:u:j")) != -1)
+    {
+        switch (c)
+        {
+        case 'h': opt.host = optarg; break;
+        case 'p': opt.port = atoi(optarg); break;
+        case 'n': opt.connections = atoi(optarg); break;
+        case 'a': opt.aliases = atoi(optarg); break;
+        case 'r': opt.ramp = atoi(optarg); break;
+        case 'i': opt.interval = atoi(optarg); break;
+        case 'd': opt.hold = atoi(optarg); break;
+        case 's': opt.stats = atoi(optarg); break;
+        case 'u': opt.url = optarg; break;
+        case 'j': opt.json = true; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opt.aliases <= 0)
+        opt.aliases = (opt.connections + 24999) / 25000;
+    if (opt.connections <= 0 || opt.ramp <= 0 || opt.stats <= 0 || opt.interval < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    int limit = raise_fd_limit();
+    if (opt.connections > limit - 64)
+    {
+        fprintf(stderr, "fd limit %d: holding %d connections instead of %d (raise ulimit -n)\n", limit, limit - 64, opt.connections);
+        opt.connections = limit - 64;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(opt.port);
+    if (inet_pton(AF_INET, opt.host, &server_addr.sin_addr) != 1)
+    {
+        printf("bad host %s (IPv4 address expected)\n", opt.host);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char line[512];
+    snprintf(line, sizeof(line), "GET %s HTTP/1.1\r\nHost: %s:%d\r\nConnection: keep-alive\r\n\r\n", opt.url, opt.host, opt.port);
+    std::string request(line);
+
+    sample baseline, before, now;
+    if (!scrape(baseline))
+    {
+        printf("cannot scrape http://%s:%d/metrics\n", opt.host, opt.port);
+        return 1;
+    }
+    before = baseline;
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    std::vector<soak_conn> conns(opt.connections);
+    for (size_t i = 0; i < conns.size(); ++i)
+    {
+        conns[i].fd = -1;
+        conns[i].state = CLOSED;
+        conns[i].in_wheel = false;
+        conns[i].pending = false;
+    }
+    /*按秒的时间轮：连接建好时随机放进一格，每个间隔轮到一次，请求均匀地散开*/
+    std::vector<std::vector<int> > wheel(opt.interval > 0 ? opt.interval : 1);
+    std::vector<epoll_event> events(4096);
+    client_stats st;
+
+    long long start = now_us();
+    long long ramp_end = 0;
+    long long last_stats = start;
+    long last_connects = 0;
+    long long wheel_sec = 0;
+    int opened = 0;
+    srand(start);
+
+    while (true)
+    {
+        long long t = now_us();
+        if (ramp_end && t - ramp_end >= opt.hold * 1000000LL)
+            break;
+
+        /*爬坡：按速率补上应该建立的连接*/
+        long long due = (t - start) * opt.ramp / 1000000;
+        while (opened < opt.connections && opened < due)
+            start_connect(epfd, conns, opened++, st);
+        if (!ramp_end && opened == opt.connections)
+            ramp_end = t;
+
+        /*时间轮：每过一秒处理一格*/
+        long long sec = (t - start) / 1000000;
+        while (opt.interval > 0 && wheel_sec < sec)
+        {
+            ++wheel_sec;
+            std::vector<int> &slot = wheel[wheel_sec % wheel.size()];
+            for (size_t k = 0; k < slot.size(); ++k)
+                send_request(epfd, conns[slot[k]], st, request);
+        }
+
+        int n = epoll_wait(epfd, &events[0], events.size(), 10);
+        for (int k = 0; k < n; ++k)
+        {
+            int i = events[k].data.u32;
+            soak_conn &sc = conns[i];
+            if (sc.state == CONNECTING)
+            {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(sc.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0 || (events[k].events & (EPOLLERR | EPOLLHUP)))
+                {
+                    close_conn(epfd, sc, st);
+                    continue;
+                }
+                sc.state = OPEN;
+                ++st.open;
+                ++st.connects;
+                epoll_event ev;
+                ev.data.u32 = i;
+                ev.events = EPOLLIN | EPOLLRDHUP;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, sc.fd, &ev);
+                if (!sc.in_wheel && opt.interval > 0)
+                {
+                    wheel[rand() % wheel.size()].push_back(i);
+                    sc.in_wheel = true;
+                }
+            }
+            else if (sc.state == OPEN)
+                on_readable(epfd, sc, st);
+        }
+
+        t = now_us();
+        if (t - last_stats >= opt.stats * 1000000LL)
+        {
+            double secs = (t - last_stats) / 1e6;
+            bool ok = scrape(now);
+            report((t - start) / 1e6, st, st.connects - last_connects, secs, now, before, baseline, ok);
+            if (ok)
+                before = now;
+            last_stats = t;
+            last_connects = st.connects;
+            st.latency.reset();
+        }
+    }
+
+    for (size_t i = 0; i < conns.size(); ++i)
+    {
+        if (conns[i].fd >= 0)
+            close(conns[i].fd);
+    }
+    close(epfd);
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include <math.h>
+#include "bloom_filter.h"
+
+bloom_filter::bloom_filter() : m_bits(NULL), m_nbits(0), m_k(0), m_ready(false)
+{
+}
+
+bloom_filter::~bloom_filter()
+{
+    delete[] m_bits;
+}
+
+void bloom_filter::init(long expected, double fp_rate)
+{
+    if (expected < 1024)
+        expected = 1024;
+    /*m = -n*ln(p)/(ln2)^2, k = m/n*ln2*/
+    double bits = -expected * log(fp_rate) / (log(2.0) * log(2.0));
+    uint64_t words = (uint64_t)(bits / 64) + 1;
+    m_bits = new std::atomic<uint64_t>[words];
+    for (uint64_t i = 0; i < words; ++i)
+        m_bits[i].store(0, std::memory_order_relaxed);
+    m_nbits = words * 64;
+    m_k = (int)(bits / expected * log(2.0) + 0.5);
+    if (m_k < 1)
+        m_k = 1;
+}
+
+/*一次FNV-1a得到h1，再用splitmix的混合函数得到h2，第i个哈希取 h1 + i*h2*/
+void bloom_filter::hash2(const char *key, uint64_t &h1, uint64_t &h2)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)key; *p; ++p)
+    {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    h1 = h;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    h2 = h | 1;
+}
+
+void bloom_filter::add(const char *key)
+{
+    if (!m_bits)
+        return;
+    uint64_t h1, h2;
+    hash2(key, h1, h2);
+    for (int i = 0; i < m_k; ++i)
+    {
+        uint64_t bit = (h1 + i * h2) % m_nbits;
+        m_bits[bit >> 6].fetch_or(1ULL << (bit & 63), std::memory_order_relaxed);
+    }
+}
+
+bool bloom_filter::maybe_contains(const char *key)
+{
+    if (!m_bits)
+        return true;
+    uint64_t h1, h2;
+    hash2(key, h1, h2);
+    for (int i = 0; i < m_k; ++i)
+    {
+        uint64_t bit = (h1 + i * h2) % m_nbits;
+        if (!(m_bits[bit >> 6].load(std::memory_order_relaxed) & (1ULL << (bit & 63))))
+            return false;
+    }
+    return true;
+}
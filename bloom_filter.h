@@ -0,0 +1,37 @@
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <stdint.h>
+#include <atomic>
+
+/*
+用户名的布隆过滤器，回答“这个用户名一定没被注册”
+只会置位不会清位，所以add()和maybe_contains()可以并发、无锁进行；
+后台加载完成之前（ready()为false）不能用它下“一定不存在”的结论
+*/
+class bloom_filter
+{
+public:
+    bloom_filter();
+    ~bloom_filter();
+
+    /*按预计元素个数和误判率分配位数组，只能在使用前调用一次*/
+    void init(long expected, double fp_rate = 0.01);
+    void add(const char *key);
+    /*返回false表示一定不存在，返回true表示可能存在*/
+    bool maybe_contains(const char *key);
+
+    bool ready() { return m_ready.load(std::memory_order_acquire); }
+    void set_ready() { m_ready.store(true, std::memory_order_release); }
+
+private:
+    static void hash2(const char *key, uint64_t &h1, uint64_t &h2);
+
+private:
+    std::atomic<uint64_t> *m_bits;
+    uint64_t m_nbits;
+    int m_k;                    /*哈希函数个数*/
+    std::atomic<bool> m_ready;
+};
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef CORO_H
+#define CORO_H
+
+/*
+C++20协程：请求处理函数可以按顺序写，等待数据库查询时挂起，不占着工作线程
+    task                 处理函数的返回类型，创建后立即运行，结束后自动释放协程帧
+    resume_on(ex)        切换到执行器ex的线程上继续运行；ex的队列满了返回false，仍在原线程
+    offload(ex, fn)      把会阻塞的fn（查库）交给执行器ex的线程执行，本协程挂起，fn执行完后
+                         回到挂起前的执行器继续；ex的队列满了返回false，fn没有执行
+socket不在协程里等：请求由主线程读全了才交给协程，应答写不完时由主线程等EPOLLOUT接着写（见http_conn::write()）
+执行器就是一个threadpool<coro_job>，挂起的协程作为任务投递进去，由工作线程恢复
+只有用 -std=c++20 编译时可用（定义CORO_ENABLED），否则这个头文件是空的，服务器照常用同步方式处理请求
+*/
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#define CORO_ENABLED 1
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <time.h>
+
+/*执行器线程池中的任务：恢复一个协程，或者执行一段阻塞的代码
+m_enqueue_us是投递时的单调时钟微秒，线程池用它测量排队时延*/
+struct coro_job
+{
+    coro_job() : m_enqueue_us(0) {}
+    virtual ~coro_job() {}
+    virtual void process() = 0;
+    long long m_enqueue_us;
+};
+
+struct resume_job : public coro_job
+{
+    std::coroutine_handle<> handle;
+    void process() { handle.resume(); }
+};
+
+/*协程在哪里运行*/
+class coro_executor
+{
+public:
+    virtual ~coro_executor() {}
+    /*队列满了返回false*/
+    virtual bool post(coro_job *job) = 0;
+};
+
+template <typename Pool>
+class pool_executor : public coro_executor
+{
+public:
+    pool_executor(Pool *pool) : m_pool(pool) {}
+    bool post(coro_job *job)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        job->m_enqueue_us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+        return m_pool->append(job);
+    }
+
+private:
+    Pool *m_pool;
+};
+
+struct task
+{
+    struct promise_type
+    {
+        task get_return_object() { return task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/*投递成功后别的线程可能马上恢复协程并销毁这个awaiter，所以post()之后不能再访问成员*/
+class resume_on
+{
+public:
+    explicit resume_on(coro_executor &ex) : m_ex(ex), m_moved(false) {}
+    bool await_ready() { return false; }
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        m_job.handle = h;
+        m_moved = true;
+        if (m_ex.post(&m_job))
+            return true;
+        m_moved = false;
+        return false;
+    }
+    bool await_resume() { return m_moved; }
+
+private:
+    coro_executor &m_ex;
+    resume_job m_job;
+    bool m_moved;
+};
+
+class offload : public coro_job
+{
+public:
+    offload(coro_executor &worker, coro_executor &back, std::function<void()> fn)
+        : m_worker(worker), m_back(back), m_fn(fn), m_done(false) {}
+    bool await_ready() { return false; }
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        m_resume.handle = h;
+        m_done = true;
+        if (m_worker.post(this))
+            return true;
+        m_done = false;
+        return false;
+    }
+    bool await_resume() { return m_done; }
+
+    /*在worker的线程上执行fn，然后把协程投递回原来的执行器；那边也满了就在这里直接恢复*/
+    void process()
+    {
+        m_fn();
+        coro_executor &back = m_back;
+        resume_job *resume = &m_resume;
+        if (!back.post(resume))
+            resume->handle.resume();
+    }
+
+private:
+    coro_executor &m_worker;
+    coro_executor &m_back;
+    std::function<void()> m_fn;
+    resume_job m_resume;
+    bool m_done;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <atomic>
+#include "cpu_affinity.h"
+
+static bool g_huge_pages = false;
+static std::atomic<long> g_page_bytes[3];
+
+std::vector<int> parse_cpu_list(const char *list)
+{
+    std::vector<int> cpus;
+    const char *p = list;
+    while (*p)
+    {
+        char *end;
+        long lo = strtol(p, &end, 10);
+        if (end == p)
+            break;
+        long hi = lo;
+        p = end;
+        if (*p == '-')
+        {
+            hi = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long c = lo; c <= hi; ++c)
+            cpus.push_back(c);
+        while (*p == ',' || *p == '\n' || *p == ' ')
+            ++p;
+    }
+    return cpus;
+}
+
+cpu_topology *cpu_topology::GetInstance()
+{
+    static cpu_topology topology;
+    return &topology;
+}
+
+cpu_topology::cpu_topology()
+{
+    int ncpu = sysconf(_SC_NPROCESSORS_CONF);
+    m_cpu_node.assign(ncpu > 0 ? ncpu : 1, 0);
+
+    for (int node = 0;; ++node)
+    {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *fp = fopen(path, "r");
+        if (!fp)
+            break;
+        char buf[4096] = {0};
+        if (!fgets(buf, sizeof(buf), fp))
+            buf[0] = '\0';
+        fclose(fp);
+
+        std::vector<int> cpus = parse_cpu_list(buf);
+        for (size_t i = 0; i < cpus.size(); ++i)
+        {
+            if (cpus[i] >= (int)m_cpu_node.size())
+                m_cpu_node.resize(cpus[i] + 1, 0);
+            m_cpu_node[cpus[i]] = node;
+        }
+        m_node_cpus.push_back(cpus);
+    }
+
+    if (m_node_cpus.empty())
+    {
+        std::vector<int> cpus;
+        for (size_t i = 0; i < m_cpu_node.size(); ++i)
+            cpus.push_back(i);
+        m_node_cpus.push_back(cpus);
+    }
+}
+
+int cpu_topology::node_of_cpu(int cpu)
+{
+    if (cpu < 0 || cpu >= (int)m_cpu_node.size())
+        return 0;
+    return m_cpu_node[cpu];
+}
+
+bool affinity_plan::parse(const char *spec, int workers)
+{
+    cpu_topology *topo = cpu_topology::GetInstance();
+    worker_cpu.clear();
+    worker_node.clear();
+
+    if (strcmp(spec, "auto") == 0)
+    {
+        /*reactor占用节点0的第一个CPU；工作线程轮流分到各个节点，节点内依次取CPU*/
+        int nodes = topo->node_count();
+        reactor_cpu = topo->cpus_of_node(0).empty() ? 0 : topo->cpus_of_node(0)[0];
+        std::vector<int> next(nodes, 0);
+        for (int i = 0; i < workers; ++i)
+        {
+            int node = i % nodes;
+            const std::vector<int> &cpus = topo->cpus_of_node(node);
+            if (cpus.empty())
+                return false;
+            int cpu = cpus[next[node]++ % cpus.size()];
+            /*CPU足够时避开reactor所在的CPU*/
+            if (cpu == reactor_cpu && cpus.size() > 1)
+                cpu = cpus[next[node]++ % cpus.size()];
+            worker_cpu.push_back(cpu);
+            worker_node.push_back(node);
+        }
+    }
+    else
+    {
+        std::vector<int> cpus = parse_cpu_list(spec);
+        if (cpus.empty())
+            return false;
+        reactor_cpu = cpus[0];
+        if (cpus.size() > 1)
+            cpus.erase(cpus.begin());
+        for (int i = 0; i < workers; ++i)
+        {
+            int cpu = cpus[i % cpus.size()];
+            worker_cpu.push_back(cpu);
+            worker_node.push_back(topo->node_of_cpu(cpu));
+        }
+    }
+    enabled = true;
+    return true;
+}
+
+affinity_plan affinity_plan::slice(int first, int n) const
+{
+    affinity_plan sub;
+    sub.enabled = enabled;
+    sub.reactor_cpu = reactor_cpu;
+    for (int i = first; i < first + n && i < (int)worker_cpu.size(); ++i)
+    {
+        sub.worker_cpu.push_back(worker_cpu[i]);
+        sub.worker_node.push_back(worker_node[i]);
+    }
+    return sub;
+}
+
+bool pin_current_thread(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+int socket_node(int fd)
+{
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) != 0 || cpu < 0)
+        return -1;
+    return cpu_topology::GetInstance()->node_of_cpu(cpu);
+}
+
+static void prefer_node(void *addr, size_t size, int node)
+{
+    if (node >= 0)
+    {
+        unsigned long mask = 1UL << node;
+        syscall(SYS_mbind, addr, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+    }
+}
+
+void *alloc_on_node(size_t size, int node)
+{
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+        return NULL;
+    /*只是偏好该节点，内存不够时允许落到别的节点上*/
+    prefer_node(addr, size, node);
+    return addr;
+}
+
+void free_on_node(void *addr, size_t size)
+{
+    if (addr)
+        munmap(addr, size);
+}
+
+void set_huge_pages(bool on)
+{
+    g_huge_pages = on;
+}
+
+bool huge_pages_enabled()
+{
+    return g_huge_pages;
+}
+
+void *alloc_huge_on_node(size_t *size, int node, int *kind)
+{
+    size_t bytes = (*size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    void *addr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr != MAP_FAILED)
+    {
+        *kind = PAGE_HUGETLB;
+    }
+    else
+    {
+        /*没有预留的大页：多映射一个大页的长度，截出2M对齐的一段，透明大页才能整页映射*/
+        char *raw = (char *)mmap(NULL, bytes + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED)
+            return NULL;
+        char *aligned = (char *)(((unsigned long)raw + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+        if (aligned > raw)
+            munmap(raw, aligned - raw);
+        munmap(aligned + bytes, raw + HUGE_PAGE_SIZE - aligned);
+        madvise(aligned, bytes, MADV_HUGEPAGE);
+        addr = aligned;
+        *kind = PAGE_THP;
+    }
+    prefer_node(addr, bytes, node);
+    g_page_bytes[*kind] += bytes;
+    *size = bytes;
+    return addr;
+}
+
+void free_huge_on_node(void *addr, size_t size, int kind)
+{
+    if (!addr)
+        return;
+    munmap(addr, size);
+    g_page_bytes[kind] -= size;
+}
+
+long huge_page_bytes(int kind)
+{
+    return g_page_bytes[kind].load();
+}
+
+long anon_huge_kb()
+{
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    if (!fp)
+        return -1;
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+            break;
+    }
+    fclose(fp);
+    return kb;
+}
@@ -0,0 +1,74 @@
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+#include <stddef.h>
+#include <vector>
+
+/*
+CPU和NUMA拓扑（来自/sys/devices/system/node），以及线程绑核、按节点分配内存
+没有NUMA信息的机器上视为只有一个节点0
+*/
+class cpu_topology
+{
+public:
+    static cpu_topology *GetInstance();
+
+    int node_count() { return m_node_cpus.size(); }
+    int cpu_count() { return m_cpu_node.size(); }
+    /*cpu所在的节点，未知时返回0*/
+    int node_of_cpu(int cpu);
+    const std::vector<int> &cpus_of_node(int node) { return m_node_cpus[node]; }
+
+private:
+    cpu_topology();
+
+    std::vector<std::vector<int> > m_node_cpus;
+    std::vector<int> m_cpu_node;
+};
+
+/*
+绑核方案：主线程（reactor）一个CPU，工作线程按NUMA节点分组绑到其余CPU上
+spec为"auto"时自动分配：reactor用节点0的第一个CPU，工作线程轮流分到各个节点；
+否则spec是CPU列表（如"0,2-7"），第一个给reactor，其余依次给工作线程
+*/
+struct affinity_plan
+{
+    bool enabled;
+    int reactor_cpu;
+    std::vector<int> worker_cpu;    /*第i个工作线程绑定的CPU*/
+    std::vector<int> worker_node;   /*第i个工作线程所属的节点*/
+
+    affinity_plan() : enabled(false), reactor_cpu(-1) {}
+    bool parse(const char *spec, int workers);
+    /*取出第first个起的n个工作线程的方案，用于把一个方案分给多个线程池*/
+    affinity_plan slice(int first, int n) const;
+};
+
+/*把当前线程绑到cpu上*/
+bool pin_current_thread(int cpu);
+/*连接是在哪个节点上收到的（SO_INCOMING_CPU），未知时返回-1*/
+int socket_node(int fd);
+/*在node上分配内存（mmap + mbind），node为-1时不指定；用free_on_node释放*/
+void *alloc_on_node(size_t size, int node);
+void free_on_node(void *addr, size_t size);
+
+/*
+大页：连接对象和读写缓冲区常驻内存、按fd随机访问，连接多时4K页的TLB不够用
+先用MAP_HUGETLB（需要预留 /proc/sys/vm/nr_hugepages），失败时退回普通页按2M对齐并madvise(MADV_HUGEPAGE)交给透明大页
+*/
+enum PAGE_KIND { PAGE_SMALL = 0, PAGE_HUGETLB, PAGE_THP };
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+/*是否启用大页，启动时设置一次，之后分配的slab块按此决定*/
+void set_huge_pages(bool on);
+bool huge_pages_enabled();
+/*在node上分配大页内存，*size向上取整到HUGE_PAGE_SIZE，*kind返回实际用的是哪种页；用free_huge_on_node释放*/
+void *alloc_huge_on_node(size_t *size, int node, int *kind);
+void free_huge_on_node(void *addr, size_t size, int kind);
+/*当前以kind方式映射的字节数*/
+long huge_page_bytes(int kind);
+/*本进程实际由透明大页支撑的内存（/proc/self/smaps_rollup中的AnonHugePages），KB，读不到时返回-1*/
+long anon_huge_kb();
+/*解析"0,2-7"形式的CPU列表*/
+std::vector<int> parse_cpu_list(const char *list);
+
+#endif
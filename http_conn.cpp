@@ -1,7 +1,12 @@
 #include "http_conn.h"
-#include <mysql/mysql.h>
+#include "slab.h"
+#include "user_store.h"
+#include "bloom_filter.h"
+#include "metrics.h"
+#include "log.h"
+#include "profiler.h"
+#include <deque>
 
-#include <fstream>
 
 
 /*定义http响应的一些状态信息*/
@@ -14,11 +19,69 @@ const char *error_404_title = "Not Found";
 const char *error_404_form = "The requested file was not found on this server.\n";
 const char *error_500_title = "Internal Error";
 const char *error_500_form = "There was an unusual problem serving the requested file.\n";
+const char *error_503_title = "Service Unavailable";
+const char *error_503_form = "The server is overloaded, please try again later.\n";
+
+static const char *method_names[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATCH"};
 
 /*网站的根目录*/
 const char *doc_root = "docs";
-map<string, string> users;
-locker m_lock;
+/*用户名和密码的缓存：登录无锁读，注册按分片加锁写；
+不再启动时全量加载，而是按需从数据库加载，最多缓存USER_CACHE_SIZE个用户*/
+const int USER_CACHE_SIZE = 100000;
+user_store users(64, USER_CACHE_SIZE);
+/*所有已注册用户名的布隆过滤器，后台线程加载，用来免去注册时的查重查询*/
+bloom_filter user_bloom;
+/*登录会话，默认30分钟不活动过期*/
+session_store sessions;
+/*读写缓冲区池：缓冲区不再嵌在每个连接对象里，只有正在处理请求的连接才占用，
+按连接所在的NUMA节点分配*/
+struct read_buffer
+{
+    char data[http_conn::READ_BUFFER_SIZE];
+};
+struct write_buffer
+{
+    char data[http_conn::WRITE_BUFFER_SIZE];
+};
+static slab<read_buffer> read_buffers(1024, true);
+static slab<write_buffer> write_buffers(1024, true);
+/*交给采样线程的 GET /profile 请求*/
+struct profile_job
+{
+    http_conn *conn;
+    int seconds;
+    int hz;
+    int mode;
+};
+
+/*从 key1=value1&key2=value2 形式的消息体中取出key对应的值*/
+static bool get_form_value(const char *body, const char *key, char *value, int len)
+{
+    if (!body)
+        return false;
+    int key_len = strlen(key);
+    const char *p = body;
+    while (p && *p)
+    {
+        if (strncmp(p, key, key_len) == 0 && p[key_len] == '=')
+        {
+            p += key_len + 1;
+            int i = 0;
+            while (p[i] && p[i] != '&' && i < len - 1)
+            {
+                value[i] = p[i];
+                ++i;
+            }
+            value[i] = '\0';
+            return true;
+        }
+        p = strchr(p, '&');
+        if (p)
+            ++p;
+    }
+    return false;
+}
 
 int setnonblocking(int fd)
 {
@@ -49,6 +112,7 @@ void removefd(int epollfd, int fd)
 
 void modfd(int epollfd, int fd, int ev)
 {
+    metrics::inc(metrics::SYSCALL_EPOLL_CTL);
     epoll_event event;
     event.data.fd = fd;
     event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
@@ -57,20 +121,67 @@ void modfd(int epollfd, int fd, int ev)
 
 int http_conn::m_user_count = 0;
 int http_conn::m_epollfd = -1;
+int http_conn::m_retry_after = 1;
+bool http_conn::m_profiling = false;
+std::atomic<long> http_conn::m_static_heap_allocs(0);
+/*等客户端关闭的连接，按加入的先后（也就是期限的先后）排列*/
+static std::deque<http_conn::half_closed> half_closed_conns;
+static fmutex half_closed_lock;
+storage *http_conn::m_storage = NULL;
 
 void http_conn::close_conn(bool real_close)
 {
     if (real_close && (m_sockfd != -1))
     {
-        // modfd( m_epollfd, m_sockfd, EPOLLIN );
-        /*关闭这个连接，从epoll中移除这个连接的监听*/
-        removefd(m_epollfd, m_sockfd);
+        /*关闭这个连接；fd没有被复制过，close时内核自动把它从epoll里移除，不用先EPOLL_CTL_DEL*/
+        close(m_sockfd);
         m_sockfd = -1;
         m_user_count--; /*关闭连接，客户总量-1*/
+        unmap();
+        release_buffers();
+        m_arena.reset();
+    }
+}
+
+bool http_conn::attach_read_buf()
+{
+    /*新取的缓冲区已经清零*/
+    read_buffer *buf = read_buffers.alloc(m_node);
+    if (!buf)
+        return false;
+    m_read_buf = buf->data;
+    return true;
+}
+
+bool http_conn::attach_write_buf()
+{
+    write_buffer *buf = write_buffers.alloc(m_node);
+    if (!buf)
+        return false;
+    m_write_buf = buf->data;
+    return true;
+}
+
+long http_conn::buffers_in_use(bool write)
+{
+    return write ? write_buffers.live() : read_buffers.live();
+}
+
+void http_conn::release_buffers()
+{
+    if (m_read_buf)
+    {
+        read_buffers.free((read_buffer *)m_read_buf);
+        m_read_buf = NULL;
+    }
+    if (m_write_buf)
+    {
+        write_buffers.free((write_buffer *)m_write_buf);
+        m_write_buf = NULL;
     }
 }
 
-void http_conn::init(int sockfd, const sockaddr_in &addr, string user, string passwd, string sqlname)
+void http_conn::init(int sockfd, const sockaddr_in &addr)
 {
     m_sockfd = sockfd;
     m_address = addr;
@@ -83,19 +194,21 @@ void http_conn::init(int sockfd, const sockaddr_in &addr, string user, string pa
     setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
     /* 把当前socket连接加入到epoll内核事件表中*/
+    metrics::inc(metrics::SYSCALL_EPOLL_CTL);
     addfd(m_epollfd, sockfd, true);
     m_user_count++;
 
-    strcpy(sql_user, user.c_str());
-    strcpy(sql_passwd, passwd.c_str());
-    strcpy(sql_name, sqlname.c_str());
+    m_last_write = 0;
+    m_enqueue_us = 0;
+    m_deadline_ms = 0;
+    m_trace.mark(request_trace::ACCEPT);
+    m_arena.set_node(m_node);
 
     init();
 }
 
 void http_conn::init()
 {
-    mysql = NULL;
     cgi = 0;
     m_check_state = CHECK_STATE_REQUESTLINE;
     /*判断这次请求完成之后，是否关闭这个连接，或者继续保持连接*/
@@ -110,15 +223,29 @@ void http_conn::init()
     m_checked_idx = 0;
     m_read_idx = 0;
     m_write_idx = 0;
-    memset(m_read_buf, '\0', READ_BUFFER_SIZE);
-    memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
+    m_string = NULL;
+    m_sid[0] = '\0';
+    m_new_sid[0] = '\0';
     memset(m_real_file, '\0', FILENAME_LEN);
+    m_content_type = NULL;
+    m_response_us = 0;
+    m_status = 0;
+    m_response_size = 0;
+    m_iv_count = 0;
+    m_trace.reset();
+    /*一个请求处理完了，缓冲区还给池子；保持连接的，下一次读时再取*/
+    release_buffers();
+    m_arena.reset();
 }
 
 /*循环读取客户数据，直到无数据可读或者对方关闭连接
 read 与 write函数都是交给主线程执行的*/
 bool http_conn::read()
 {
+    if (!m_read_buf && !attach_read_buf())
+    {
+        return false;
+    }
     if (m_read_idx >= READ_BUFFER_SIZE)
     {
         return false;
@@ -128,6 +255,7 @@ bool http_conn::read()
     while (true)
     {
         /*recv函数参数：sockfd, 读到哪里，读多少字节，*/
+        metrics::inc(metrics::SYSCALL_READ);
         bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
         if (bytes_read == -1)
         {
@@ -142,80 +270,280 @@ bool http_conn::read()
             return false;
         }
 
+        if (m_read_idx == 0)
+            m_trace.mark(request_trace::FIRST_BYTE);
         m_read_idx += bytes_read;
     }
     return true;
 }
 
-/*写HTTP响应*/
+/*写HTTP响应
+应答填好后工作线程先直接调用一次（发送缓冲区几乎总是有空间），写不完才注册EPOLLOUT，由主线程在可写时接着写
+调用时这个连接在epoll里没有注册事件（EPOLLONESHOT），同一时刻只有调用者在用它*/
 bool http_conn::write()
 {
-    int temp = 0;
-    int bytes_have_send = 0;
-    int bytes_to_send = m_write_idx;  /*要送出这么多数据*/
-    /*没有需要写入m_sockfd的数据，说明没有需求？所以改成侦听EPOLLIN，客户的需求？*/
-    if (bytes_to_send == 0)
+    /*没有需要写入m_sockfd的数据，继续等客户的下一个请求*/
+    if (response_bytes() == 0)
     {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
         init();
+        arm(EPOLLIN);
         return true;
     }
 
     while (1)
-    {   
+    {
         /*向m_sockfd写入数据，从m_iv中，数量是m_iv_count*/
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        metrics::inc(metrics::SYSCALL_WRITE);
+        int temp = writev(m_sockfd, m_iv, m_iv_count);
         if (temp <= -1)
         {
             /*如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件。虽然在此期间，服务器无
             法立即接收到同一客户的下一个请求，但这可以保证连接的完整性*/
             if (errno == EAGAIN)
             {
-                modfd(m_epollfd, m_sockfd, EPOLLOUT);
+                arm(EPOLLOUT);
                 return true;
             }
             unmap();
             return false;
         }
 
-        bytes_to_send -= temp;  /*还要送出这么多数据*/
-        bytes_have_send += temp;  /*已经送出了这么多数据， 两者加起来等于m_write_idx*/
-        if (bytes_to_send <= 0)  /*TODO 没看懂这个判断*/
+        /*只写出去一部分时把iovec往后挪，下次从没写的地方接着写*/
+        size_t sent = temp;
+        for (int i = 0; i < m_iv_count; ++i)
+        {
+            size_t n = sent < m_iv[i].iov_len ? sent : m_iv[i].iov_len;
+            m_iv[i].iov_base = (char *)m_iv[i].iov_base + n;
+            m_iv[i].iov_len -= n;
+            sent -= n;
+        }
+        if (response_bytes() == 0)
         {
-            /*发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接*/
+            m_trace.mark(request_trace::LAST_BYTE);
+            long long now_us = metrics::now_us();
+            if (m_response_us)
+                metrics::observe(metrics::WRITE, now_us - m_response_us);
+            log_access(now_us);
+            tracer::finish(m_trace, m_sockfd, m_url ? method_names[m_method] : "-", m_url ? m_url : "-", m_status, m_response_size);
+            /*发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否关闭连接*/
             unmap();
-            if (m_linger)  /*如果要保持连接，就初始化（方便后面的读取与输入）*/
+            bool linger = m_linger;
+            /*先初始化再注册：注册之后这个连接随时可能被主线程拿去处理下一个请求*/
+            init();
+            if (!linger)
             {
-                init();
-                modfd(m_epollfd, m_sockfd, EPOLLIN);
+                /*监听socket设了SO_LINGER{1,0}，直接close会发RST，丢掉还在内核发送缓冲里没发出去的应答；
+                这里只关掉写的一方，应答发完后跟一个FIN，客户端关闭时（EPOLLRDHUP）由主线程关闭回收；
+                客户端迟迟不关的，CLOSE_LINGER_MS之后主线程也会关闭（见take_expired()）*/
+                shutdown(m_sockfd, SHUT_WR);
+                half_closed h = {m_sockfd, this, now_ms() + CLOSE_LINGER_MS};
+                m_close_deadline_ms.store(h.deadline_ms, std::memory_order_relaxed);
+                /*注册之后连接随时可能被主线程关闭回收，登记用的都是之前取好的值*/
+                arm(EPOLLIN);
+                scoped_lock<fmutex> guard(half_closed_lock);
+                half_closed_conns.push_back(h);
                 return true;
             }
-            else
-            {
-                modfd(m_epollfd, m_sockfd, EPOLLIN);
-                return false;
-            }
+            arm(EPOLLIN);
+            return true;
         }
     }
 }
 
+/*写出错时工作线程也不直接关闭连接：fd一关，主线程就可能accept到同一个fd并回收这个连接对象，
+这里只shutdown并重新注册，主线程收到EPOLLHUP后关闭并回收*/
+void http_conn::send_response()
+{
+    if (!write())
+    {
+        shutdown(m_sockfd, SHUT_RDWR);
+        arm(EPOLLIN);
+    }
+}
+
+/*do_request()交过来的采样请求
+连接在epoll里没有注册事件，主线程不会动它，采样期间只有这个线程在用；参数放在连接的m_arena里，随应答一起释放*/
+void *http_conn::profile_main(void *arg)
+{
+    profile_job *job = (profile_job *)arg;
+    http_conn *conn = job->conn;
+    arena_string text(conn->m_arena);
+    HTTP_CODE ret = SERVICE_UNAVAILABLE;
+    if (profiler::run(job->seconds, job->hz, job->mode, text))
+    {
+        conn->m_content_type = "text/plain";
+        conn->m_file_address = (char *)text.data();
+        conn->m_file_mapped = false;
+        conn->m_file_stat.st_size = text.size();
+        ret = FILE_REQUEST;
+    }
+    if (!conn->process_write(ret))
+    {
+        shutdown(conn->m_sockfd, SHUT_RDWR);
+        conn->arm(EPOLLIN);
+        return NULL;
+    }
+    conn->send_response();
+    return NULL;
+}
+
+/*EPOLLONESHOT的事件一触发，fd在epoll里就不再注册任何事件，所以每个请求处理完都要一次epoll_ctl(MOD)重新注册，
+没有“和已注册的一样就跳过”的余地；ONESHOT保证了同一时刻只有一个线程在处理这个连接，这一次系统调用是它的代价*/
+void http_conn::arm(int ev)
+{
+    modfd(m_epollfd, m_sockfd, ev);
+}
+
+int http_conn::take_expired(long long now_ms, half_closed *out, int max)
+{
+    scoped_lock<fmutex> guard(half_closed_lock);
+    int n = 0;
+    while (n < max && !half_closed_conns.empty() && half_closed_conns.front().deadline_ms <= now_ms)
+    {
+        out[n++] = half_closed_conns.front();
+        half_closed_conns.pop_front();
+    }
+    return n;
+}
+
+long long http_conn::now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void http_conn::reject()
+{
+    metrics::inc(metrics::REJECTED);
+    m_linger = false;
+    m_write_idx = 0;
+    m_new_sid[0] = '\0';
+    process_write(SERVICE_UNAVAILABLE);
+    send_response();
+}
+
 void http_conn::process()
 {
-    HTTP_CODE read_ret = process_read();
+    /*解析会改写请求行，先分好类*/
+    m_trace.mark(request_trace::DEQUEUED);
+    LANE l = lane();
+    if (m_enqueue_us)
+        metrics::observe(metrics::QUEUE_WAIT + (int)l, metrics::now_us() - m_enqueue_us);
+    /*在队列里等得太久，客户端多半已经放弃了，不再做任何处理（也就不会有写库之类的副作用）*/
+    if (m_deadline_ms && now_ms() > m_deadline_ms)
+    {
+        reject();
+        return;
+    }
+
+#ifdef ARENA_COUNT_ALLOCS
+    bool fast_path = l == LANE_STATIC;
+    long heap_allocs = arena::heap_allocs();
+#endif
+    HTTP_CODE read_ret;
+    {
+        metric_timer timer(metrics::PARSE);
+        read_ret = process_read();
+    }
+    m_trace.mark(request_trace::PARSED);
     if (read_ret == NO_REQUEST)  /*没有读取到完整的http头部请求行，需要继续读取数据*/
     {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);  /*继续监听请求 因为当前客户的m_buff是一直保存的*/
+        arm(EPOLLIN);  /*继续监听请求 因为当前客户的m_buff是一直保存的*/
         return;
     }
+    /*请求完整了，处理它（可能读写数据库）*/
+    if (read_ret == GET_REQUEST)
+    {
+        tracer::set_current(&m_trace);
+        read_ret = do_request();
+        tracer::set_current(NULL);
+        /*连接已经交给别的线程，也不算静态文件的快速路径*/
+        if (read_ret == DEFERRED_REQUEST)
+            return;
+    }
 
     bool write_ret = process_write(read_ret);
+
+#ifdef ARENA_COUNT_ALLOCS
+    /*静态文件请求从解析到填好应答都不应该碰全局堆，临时内存只用m_arena*/
+    if (fast_path && arena::heap_allocs() != heap_allocs)
+    {
+        m_static_heap_allocs.fetch_add(arena::heap_allocs() - heap_allocs, std::memory_order_relaxed);
+#ifdef ARENA_STRICT
+        assert(!"heap allocation on the static file path");
+#endif
+    }
+#endif
+
     if (!write_ret)
     {
-        close_conn();
+        /*应答都填不了，关闭连接（见send_response()）*/
+        shutdown(m_sockfd, SHUT_RDWR);
+        arm(EPOLLIN);
+        return;
+    }
+    /*填充好了，直接发出去，不再先等一轮EPOLLOUT*/
+    send_response();
+}
+
+#ifdef CORO_ENABLED
+/*和process()一样，只是do_request()交给数据库线程执行，期间本协程挂起，不占用协程线程
+主线程调用，第一步就切到协程线程上，不在主线程上解析*/
+task http_conn::process_async(coro_executor &self, coro_executor &db)
+{
+    if (!co_await resume_on(self))
+    {
+        reject();
+        co_return;
+    }
+    m_trace.mark(request_trace::DEQUEUED);
+    LANE l = lane();
+    if (m_enqueue_us)
+        metrics::observe(metrics::QUEUE_WAIT + (int)l, metrics::now_us() - m_enqueue_us);
+    if (m_deadline_ms && now_ms() > m_deadline_ms)
+    {
+        reject();
+        co_return;
     }
 
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);  /*填充好了，等待可以写的通知，就发出去*/
+    HTTP_CODE read_ret;
+    {
+        metric_timer timer(metrics::PARSE);
+        read_ret = process_read();
+    }
+    m_trace.mark(request_trace::PARSED);
+    if (read_ret == NO_REQUEST)
+    {
+        arm(EPOLLIN);
+        co_return;
+    }
+    if (read_ret == GET_REQUEST)
+    {
+        /*在数据库线程池里排队也算在期限内，轮到时已经过期的同样不处理*/
+        bool ran = co_await offload(db, self, [this, &read_ret] {
+            tracer::set_current(&m_trace);
+            read_ret = (m_deadline_ms && now_ms() > m_deadline_ms) ? SERVICE_UNAVAILABLE : do_request();
+            tracer::set_current(NULL);
+        });
+        if (!ran || read_ret == SERVICE_UNAVAILABLE)
+        {
+            reject();
+            co_return;
+        }
+        if (read_ret == DEFERRED_REQUEST)
+            co_return;
+    }
+
+    if (!process_write(read_ret))
+    {
+        shutdown(m_sockfd, SHUT_RDWR);
+        arm(EPOLLIN);
+        co_return;
+    }
+    send_response();
 }
+#endif
 
 http_conn::HTTP_CODE http_conn::process_read()
 {
@@ -235,7 +563,7 @@ http_conn::HTTP_CODE http_conn::process_read()
         */
         text = get_line();  
         m_start_line = m_checked_idx;  /*m_checked_idx一直指向的是下一个待解析的文本的起始*/
-        printf("got 1 http line: %s\n", text);
+        LOG_DEBUG("got 1 http line: %s", text);
 
         switch (m_check_state)
         {
@@ -257,7 +585,7 @@ http_conn::HTTP_CODE http_conn::process_read()
             }
             else if (ret == GET_REQUEST)
             {
-                return do_request();
+                return GET_REQUEST;
             }
             break;
         }
@@ -267,7 +595,7 @@ http_conn::HTTP_CODE http_conn::process_read()
             ret = parse_content(text);
             if (ret == GET_REQUEST)
             {
-                return do_request();
+                return GET_REQUEST;
             }
             line_status = LINE_OPEN;
             break;
@@ -319,6 +647,34 @@ http_conn::LINE_STATUS http_conn::parse_line()
     return LINE_OPEN;
 }
 
+/*和do_request()的路由一致：看URL最后一段的第一个字符
+POST 2CGISQL 登录（可能查库）、5 查看数据 是读；POST 3CGISQL 注册、4CGISQL 编写 是写；其余都是静态文件
+请求行还没读全时按静态文件处理，反正process()只会返回NO_REQUEST继续读*/
+http_conn::LANE http_conn::lane() const
+{
+    const char *end = m_read_buf + m_read_idx;
+    const char *url = (const char *)memchr(m_read_buf, ' ', m_read_idx);
+    if (!url)
+        return LANE_STATIC;
+    bool post = (url - m_read_buf == 4 && strncasecmp(m_read_buf, "POST", 4) == 0);
+    ++url;
+    const char *last = NULL;
+    for (const char *q = url; q < end && *q != ' ' && *q != '\t' && *q != '\r'; ++q)
+    {
+        if (*q == '/')
+            last = q;
+    }
+    if (!last || last + 2 >= end)
+        return LANE_STATIC;
+
+    char c = last[1];
+    if ((post && c == '3') || (c == '4' && last[2] == 'C'))
+        return LANE_DB_WRITE;
+    if ((post && c == '2') || c == '5')
+        return LANE_DB_READ;
+    return LANE_STATIC;
+}
+
 http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
 {
     m_url = strpbrk(text, " \t");
@@ -398,6 +754,27 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)
         text += strspn(text, " \t");
         m_content_length = atol(text);
     }
+    else if (strncasecmp(text, "Cookie:", 7) == 0)
+    {
+        /*Cookie: a=1; sid=xxxx 只关心会话令牌*/
+        text += 7;
+        while (*text)
+        {
+            text += strspn(text, " \t;");
+            if (strncmp(text, "sid=", 4) == 0)
+            {
+                text += 4;
+                int n = strcspn(text, "; \t");
+                if (n == session_store::TOKEN_LEN)
+                {
+                    memcpy(m_sid, text, n);
+                    m_sid[n] = '\0';
+                }
+                break;
+            }
+            text += strcspn(text, ";");
+        }
+    }
     else if (strncasecmp(text, "Host:", 5) == 0)
     {
         text += 5;
@@ -406,7 +783,7 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)
     }
     else
     {
-        printf("oop! unknow header %s\n", text);
+        LOG_DEBUG("oop! unknow header %s", text);
     }
 
     return NO_REQUEST;
@@ -452,6 +829,50 @@ http_conn::HTTP_CODE http_conn::parse_content(char *text)
 // }
 http_conn::HTTP_CODE http_conn::do_request()
 {
+    /*内部指标，在m_arena里生成*/
+    if (strcmp(m_url, "/metrics") == 0)
+    {
+        arena_string text(m_arena);
+        if (!metrics::render(text))
+            return INTERNAL_ERROR;
+        m_content_type = "text/plain; version=0.0.4";
+        m_file_address = (char *)text.data();
+        m_file_mapped = false;
+        m_file_stat.st_size = text.size();
+        return FILE_REQUEST;
+    }
+    /*在线采样 /profile?seconds=10&hz=99&mode=cpu|wall：采样要持续好几秒，交给单独的线程做，工作线程马上返回，
+    采样结束后由那个线程发送应答（见profile_main()）；已经有采样在进行时回503*/
+    if (m_profiling && strncmp(m_url, "/profile", 8) == 0 && (m_url[8] == '\0' || m_url[8] == '?'))
+    {
+        const char *query = m_url[8] ? m_url + 9 : NULL;
+        char value[16];
+        profile_job *job = (profile_job *)m_arena.alloc(sizeof(profile_job));
+        if (!job)
+            return INTERNAL_ERROR;
+        job->conn = this;
+        job->seconds = get_form_value(query, "seconds", value, sizeof(value)) ? atoi(value) : 10;
+        job->hz = get_form_value(query, "hz", value, sizeof(value)) ? atoi(value) : 99;
+        job->mode = get_form_value(query, "mode", value, sizeof(value)) && strcmp(value, "wall") == 0 ? profiler::WALL : profiler::CPU;
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, profile_main, job) != 0)
+            return SERVICE_UNAVAILABLE;
+        pthread_detach(tid);
+        return DEFERRED_REQUEST;
+    }
+    /*抽样和慢请求的跟踪记录，Chrome trace格式*/
+    if (strcmp(m_url, "/trace") == 0)
+    {
+        arena_string text(m_arena);
+        if (!tracer::render(text))
+            return INTERNAL_ERROR;
+        m_content_type = "application/json";
+        m_file_address = (char *)text.data();
+        m_file_mapped = false;
+        m_file_stat.st_size = text.size();
+        return FILE_REQUEST;
+    }
+
     strcpy(m_real_file, doc_root);
     int len = strlen(doc_root);
     //printf("m_url:%s\n", m_url);
@@ -464,46 +885,42 @@ http_conn::HTTP_CODE http_conn::do_request()
         //根据标志判断是登录检测还是注册检测
         char flag = m_url[1];
 
-        char *m_url_real = (char *)malloc(sizeof(char) * 200);
-        strcpy(m_url_real, "/");
-        strcat(m_url_real, m_url + 2);  /*m_url_real = 2GCISQL.cgi*/
-        strncpy(m_real_file + len, m_url_real, FILENAME_LEN - len - 1);   /*放到m_real_file中*/
-        free(m_url_real);
+        m_real_file[len] = '/';
+        strncpy(m_real_file + len + 1, m_url + 2, FILENAME_LEN - len - 2);   /*m_real_file = docs/2GCISQL.cgi*/
 
         //将用户名和密码提取出来
-        //user=123&passwd=123
+        //user=123&password=123
         char name[100], password[100];
-        int i;
-        for (i = 5; m_string[i] != '&'; ++i)  /*m_string保存了 content 消息体中的内容*/
-            name[i - 5] = m_string[i];
-        name[i - 5] = '\0';
+        bool has_name = get_form_value(m_string, "user", name, sizeof(name));  /*m_string保存了 content 消息体中的内容*/
+        if (!get_form_value(m_string, "password", password, sizeof(password)))
+            password[0] = '\0';
 
-        int j = 0;
-        for (i = i + 10; m_string[i] != '\0'; ++i, ++j)
-            password[j] = m_string[i];
-        password[j] = '\0';
-
-        if (*(p + 1) == '3')
+        if (*(p + 1) == '3' && !has_name)
+        {
+            strcpy(m_url, "/registerError.html");
+        }
+        else if (*(p + 1) == '3')
         {
             //如果是注册，先检测数据库中是否有重名的
             //没有重名的，进行增加数据
-            char *sql_insert = (char *)malloc(sizeof(char) * 200);
-            strcpy(sql_insert, "INSERT INTO user(username, passwd) VALUES(");
-            strcat(sql_insert, "'");
-            strcat(sql_insert, name);
-            strcat(sql_insert, "', '");
-            strcat(sql_insert, password);
-            strcat(sql_insert, "')");
-
-            if (users.find(name) == users.end())
-            {
-                m_lock.lock();
-                int res = mysql_query(mysql, sql_insert);
-                users.insert(pair<string, string>(name, password));
-                m_lock.unlock();
+            bool taken = users.contains(name);
+            /*布隆过滤器说“一定不存在”时直接插入；可能存在或者还没加载完时，再做一次强一致查重*/
+            if (!taken && !(user_bloom.ready() && !user_bloom.maybe_contains(name)))
+                taken = m_storage->has_user(name);
 
-                if (!res)
+            if (!taken)
+            {
+                /*同名并发注册由存储层（数据库的唯一约束/本地存储的锁）兜底，注册成功与否只看存储的结果；
+                缓存只是顺带放进去，insert()因为已有同名记录返回false也不影响；缓存里没有的，登录时由load_user()从存储加载*/
+                bool res = m_storage->add_user(name, password);
+
+                if (res)
+                {
+                    users.insert(name, password);
+                    user_bloom.add(name);
+                    note_write();
                     strcpy(m_url, "/log.html");
+                }
                 else
                     strcpy(m_url, "/registerError.html");
             }
@@ -514,11 +931,27 @@ http_conn::HTTP_CODE http_conn::do_request()
         //若浏览器端输入的用户名和密码在表中可以查找到，返回1，否则返回0
         else if (*(p + 1) == '2')
         {
-            if (users.find(name) != users.end() && users[name] == password)
+            /*没有提交用户名、但带着有效会话的，凭令牌直接放行，不再比较密码*/
+            char session_user[100];
+            if (!has_name && m_sid[0] && sessions.lookup(m_sid, session_user, sizeof(session_user)))
             {
                 strcpy(m_url, "/welcome_2.html");
             }
-                
+            else if (has_name)
+            {
+                /*缓存里没有时才查库；布隆过滤器能确定用户不存在的就不用查了*/
+                if (!users.contains(name) && !(user_bloom.ready() && !user_bloom.maybe_contains(name)))
+                    load_user(name);
+
+                if (users.check(name, password))
+                {
+                    /*登录成功，发放会话令牌*/
+                    sessions.create(name, m_new_sid, last_write());
+                    strcpy(m_url, "/welcome_2.html");
+                }
+                else
+                    strcpy(m_url, "/logError.html");
+            }
             else
                 strcpy(m_url, "/logError.html");
         }
@@ -527,96 +960,51 @@ http_conn::HTTP_CODE http_conn::do_request()
     if (*(p + 1) == '4' && *(p + 2) == 'C')
     {
         //将用户名和内容提取出来
-        //user=123&content=123
+        //有会话时用户名来自会话，消息体只需要 content=123；没有会话时兼容 user=123&content=123
         char name[100], content[100];
-        int i;
-        for (i = 5; m_string[i] != '&'; ++i)  /*m_string保存了 content 消息体中的内容*/
-            name[i - 5] = m_string[i];
-        name[i - 5] = '\0';
-
-        int j = 0;
-        for (i = i + 9; m_string[i] != '\0'; ++i, ++j)
-            content[j] = m_string[i];
-        content[j] = '\0';
-
-        char *sql_insert = (char *)malloc(sizeof(char) * 200);
-        strcpy(sql_insert, "INSERT INTO info(user, content) VALUES(");
-        strcat(sql_insert, "'");
-        strcat(sql_insert, name);
-        strcat(sql_insert, "', '");
-        strcat(sql_insert, content);
-        strcat(sql_insert, "')");  
-        m_lock.lock();
-        int res = mysql_query(mysql, sql_insert);
-        m_lock.unlock();
+        if (!(m_sid[0] && sessions.lookup(m_sid, name, sizeof(name))) &&
+            !get_form_value(m_string, "user", name, sizeof(name)))
+            name[0] = '\0';
+        if (!get_form_value(m_string, "content", content, sizeof(content)))
+            content[0] = '\0';
+
+        if (name[0] && m_storage->add_info(name, content))
+            note_write();
         strcpy(m_url, "/insert_info.html");
     }
 
     /*这些不是cgi了，是判断其他的*/
     if (*(p + 1) == '0')
     {
-        char *m_url_real = (char *)malloc(sizeof(char) * 200);
-        strcpy(m_url_real, "/register.html");
-        strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
-
-        free(m_url_real);
+        strcpy(m_real_file + len, "/register.html");
     }
     else if (*(p + 1) == '1')  /*用123代号，进行判断，再给出真正的url名字*/
     {
-        char *m_url_real = (char *)malloc(sizeof(char) * 200);
-         strcpy(m_url_real, "/log.html");
-        strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
-
-        free(m_url_real);
+        strcpy(m_real_file + len, "/log.html");
     }
     else if (*(p + 1) == '5')  /*查看数据*/
     {
-        /*先生成一个html，保存它*/
-        /*查询mysql中的所有数据量的大小*/
-        char *sql_query = (char *)malloc(sizeof(char) * 200);
-        strcpy(sql_query, "SELECT* from info");
-
-        int res = mysql_query(mysql, sql_query);
-        std::vector<std::vector<string> >query_results;
-        // 获取查询结果
-        MYSQL_RES *result = mysql_store_result(mysql);
-        // 遍历查询结果并打印
-        int num_fields = mysql_num_fields(result);  /*列*/
-        MYSQL_ROW row;
-        while ((row = mysql_fetch_row(result))) {  /*提取每一行的结果*/
-            std::vector<string> tmp;
-            tmp.push_back(row[0]);
-            tmp.push_back(row[1]);
-            query_results.push_back(tmp);
-        }
-        generate_HTML(query_results);  /* name = tables.html*/
-
-        /*读取这个tables.html*/
-        char *m_url_real = (char *)malloc(sizeof(char) * 200);
-        strcpy(m_url_real, "/tables.html");
-        strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
-
-        free(m_url_real);
+        /*在请求的arena里生成表格页面，直接作为应答的内容发送，不再写到共享的docs/tables.html再读回来*/
+        arena_string html(m_arena);
+        if (!generate_HTML(html))
+            return INTERNAL_ERROR;
+        m_file_address = (char *)html.data();
+        m_file_mapped = false;
+        m_file_stat.st_size = html.size();
+        return FILE_REQUEST;
     }
     else if (*(p + 1) == '6')  /*插入数据*/
     {
-        char *m_url_real = (char *)malloc(sizeof(char) * 200);
-        strcpy(m_url_real, "/insert_info.html");
-        strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
-
-        free(m_url_real);
+        strcpy(m_real_file + len, "/insert_info.html");
     }
     else if (*(p + 1) == '7')
     {
-        char *m_url_real = (char *)malloc(sizeof(char) * 200);
-        strcpy(m_url_real, "/fans.html");
-        strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
-
-        free(m_url_real);
+        strcpy(m_real_file + len, "/fans.html");
     }
     else
         strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);  /*此时m_url保存了要返回的资源界面*/
 
+    metrics::inc(metrics::SYSCALL_FILE);
     if (stat(m_real_file, &m_file_stat) < 0)
         return NO_RESOURCE;
 
@@ -628,12 +1016,18 @@ http_conn::HTTP_CODE http_conn::do_request()
 
     int fd = open(m_real_file, O_RDONLY);
     m_file_address = (char *)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    m_file_mapped = true;
     close(fd);
+    metrics::inc(metrics::SYSCALL_FILE, 3);
     return FILE_REQUEST;
 }
 
 bool http_conn::process_write(HTTP_CODE ret)
 {
+    if (!m_write_buf && !attach_write_buf())
+    {
+        return false;
+    }
     switch (ret)
     {
     case INTERNAL_ERROR:
@@ -666,6 +1060,17 @@ bool http_conn::process_write(HTTP_CODE ret)
         }
         break;
     }
+    case SERVICE_UNAVAILABLE:
+    {
+        add_status_line(503, error_503_title);
+        add_response("Retry-After: %d\r\n", m_retry_after);
+        add_headers(strlen(error_503_form));
+        if (!add_content(error_503_form))
+        {
+            return false;
+        }
+        break;
+    }
     case FORBIDDEN_REQUEST:
     {
         add_status_line(403, error_403_title);
@@ -687,6 +1092,7 @@ bool http_conn::process_write(HTTP_CODE ret)
             m_iv[1].iov_base = m_file_address;
             m_iv[1].iov_len = m_file_stat.st_size;
             m_iv_count = 2;
+            response_ready();
             return true;
         }
         else
@@ -698,6 +1104,7 @@ bool http_conn::process_write(HTTP_CODE ret)
                 return false;
             }
         }
+        break;
     }
     default:
     {
@@ -708,16 +1115,50 @@ bool http_conn::process_write(HTTP_CODE ret)
     m_iv[0].iov_base = m_write_buf;
     m_iv[0].iov_len = m_write_idx;
     m_iv_count = 1;
+    response_ready();
     return true;
 }
 
+size_t http_conn::response_bytes() const
+{
+    size_t bytes = 0;
+    for (int i = 0; i < m_iv_count; ++i)
+        bytes += m_iv[i].iov_len;
+    return bytes;
+}
+
+void http_conn::response_ready()
+{
+    m_response_size = response_bytes();
+    metrics::observe(metrics::RESPONSE_BYTES, m_response_size);
+    m_response_us = metrics::now_us();
+    m_trace.mark(request_trace::RESPONSE_QUEUED);
+}
+
+/*访问日志：一个请求一行，key=value格式；耗时从主线程读完请求算起，包括排队、处理和写*/
+void http_conn::log_access(long long now_us)
+{
+    char ip[INET_ADDRSTRLEN];
+    if (!inet_ntop(AF_INET, &m_address.sin_addr, ip, sizeof(ip)))
+        strcpy(ip, "-");
+    LOG_ACCESS("client=%s:%d method=%s url=\"%s\" status=%d bytes=%zu time_us=%lld write_us=%lld",
+               ip, ntohs(m_address.sin_port), m_url ? method_names[m_method] : "-", m_url ? m_url : "-",
+               m_status, m_response_size, m_enqueue_us ? now_us - m_enqueue_us : 0LL,
+               m_response_us ? now_us - m_response_us : 0LL);
+}
+
 /*munmap函数释放由mmap创建的这段内存空间*/
 void http_conn::unmap()
 {
     if (m_file_address)
     {
-        munmap(m_file_address, m_file_stat.st_size);
+        if (m_file_mapped)
+        {
+            metrics::inc(metrics::SYSCALL_FILE);
+            munmap(m_file_address, m_file_stat.st_size);
+        }
         m_file_address = 0;
+        m_file_mapped = false;
     }
 }
 
@@ -742,13 +1183,14 @@ bool http_conn::add_response(const char *format, ...)
 
 bool http_conn::add_status_line(int status, const char *title)
 {
+    m_status = status;
     return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
 bool http_conn::add_headers(int content_len)
 {
-    return add_content_length(content_len) && add_linger() &&
-           add_blank_line();
+    return add_content_length(content_len) && add_content_type() && add_linger() &&
+           add_cookie() && add_blank_line();
 }
 
 bool http_conn::add_content_length(int content_len)
@@ -761,6 +1203,13 @@ bool http_conn::add_linger()
     return add_response("Connection: %s\r\n", (m_linger == true) ? "keep-alive" : "close");
 }
 
+bool http_conn::add_cookie()
+{
+    if (m_new_sid[0] == '\0')
+        return true;
+    return add_response("Set-Cookie: sid=%s; Path=/; Max-Age=%d; HttpOnly\r\n", m_new_sid, sessions.ttl());
+}
+
 bool http_conn::add_blank_line()
 {
     return add_response("%s", "\r\n");
@@ -773,68 +1222,91 @@ bool http_conn::add_content(const char *content)
 
 bool http_conn::add_content_type()
 {
-    return add_response("Content-Type:%s\r\n", "text/html");
+    if (!m_content_type)
+        return true;
+    return add_response("Content-Type: %s\r\n", m_content_type);
 }
 
-/*NEW databases*/
-void http_conn::initmysql_result(connection_pool *connPool)
+static void add_to_bloom(const char *name, void *)
 {
-    //先从连接池中取一个连接
-    MYSQL *mysql = NULL;
-    connectionRAII mysqlcon(&mysql, connPool);
+    user_bloom.add(name);
+}
 
-    //在user表中检索username，passwd数据，浏览器端输入
-    if (mysql_query(mysql, "SELECT username,passwd FROM user"))
-    {
-        printf("SELECT error:%s\n", mysql_error(mysql));
-    }
+/*后台加载布隆过滤器的线程：遍历存储中的所有用户名*/
+static void *load_user_bloom(void *arg)
+{
+    storage *store = (storage *)arg;
+    if (!store->scan_users(add_to_bloom, NULL))
+        return NULL;
 
-    //从表中检索完整的结果集
-    MYSQL_RES *result = mysql_store_result(mysql);
+    user_bloom.set_ready();
+    LOG_INFO("user bloom filter loaded");
+    return NULL;
+}
 
-    //返回结果集中的列数
-    int num_fields = mysql_num_fields(result);
+/*启动时不再把整张user表读进内存：这里只按估计的用户数分配布隆过滤器，
+然后交给后台线程填充，服务器可以马上开始服务；用户记录在登录时由load_user()按需加载*/
+void http_conn::init_users(storage *store)
+{
+    /*预留一倍给新注册的用户*/
+    long expected = store->estimate_users();
+    user_bloom.init(expected > 0 ? expected * 2 : 1000000);
 
-    //返回所有字段结构的数组
-    MYSQL_FIELD *fields = mysql_fetch_fields(result);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, load_user_bloom, store) == 0)
+        pthread_detach(tid);
+}
 
-    //从结果集中获取下一行，将对应的用户名和密码，存入map中
-    while (MYSQL_ROW row = mysql_fetch_row(result))
-    {
-        string temp1(row[0]);
-        string temp2(row[1]);
-        users[temp1] = temp2;
-    }
+/*刚写过存储：连接和会话都记下时间，之后的读在窗口内走主库*/
+void http_conn::note_write()
+{
+    m_last_write = time(NULL);
+    if (m_sid[0])
+        sessions.wrote(m_sid, m_last_write);
 }
 
-/*生成html文件*/
-void http_conn:: generate_HTML(std::vector<std::vector<string> >&contents)
+/*读己之写看的时间：这个连接和请求所属会话里较晚的一次写，会话换了连接也算*/
+time_t http_conn::last_write()
 {
-    int n_row = contents.size();
-    std::ofstream outputFile("docs/tables.html", std::ios::trunc);
+    time_t t = m_sid[0] ? sessions.last_write(m_sid) : 0;
+    return t > m_last_write ? t : m_last_write;
+}
 
+/*从存储加载一个用户到缓存，用户存在时返回true*/
+bool http_conn::load_user(const char *name)
+{
+    char passwd[user_store::NAME_LEN];
+    if (!m_storage->get_user(name, passwd, sizeof(passwd), last_write()))
+        return false;
+    users.insert(name, passwd);
+    return true;
+}
+
+/*每条info记录生成表格的一行，user和content直接拼进页面，不复制*/
+static void add_table_row(const char *user, const char *content, void *arg)
+{
+    arena_string *html = (arena_string *)arg;
+    html->append("<tr>\n<td>");
+    html->append(user);
+    html->append("</td>\n<td>");
+    html->append(content);
+    html->append("</td>\n</tr>\n");
+}
+
+/*生成html页面，内容在m_arena中，内存不足或者查询失败时返回false*/
+bool http_conn::generate_HTML(arena_string &html)
+{
     // 写入 HTML 头部
-    outputFile << "<!DOCTYPE html>\n";
-    outputFile << "<html>\n";
-    outputFile << "<head>\n";
-    outputFile << "<title>Table</title>\n";
-    outputFile << "</head>\n";
-    outputFile << "<body>\n";
+    html.append("<!DOCTYPE html>\n<html>\n<head>\n<title>Table</title>\n</head>\n<body>\n");
 
     // 写入表格
-    outputFile << "<table border=\"1\">\n";
-    for (int i = 0; i < n_row; ++i) {
-        outputFile << "<tr>\n";
-        outputFile << "<td>" << contents[i][0] << "</td>\n";
-        outputFile << "<td>" << contents[i][1] << "</td>\n";
-        outputFile << "</tr>\n";
-    }
-    outputFile << "</table>\n";
+    html.append("<table border=\"1\">\n");
+    /*只读查询，MySQL后端会分发到从库；刚写过的会话在窗口内仍读主库*/
+    if (!m_storage->scan_info(add_table_row, &html, last_write()))
+        return false;
+    html.append("</table>\n");
 
     // 写入 HTML 尾部
-    outputFile << "</body>\n";
-    outputFile << "</html>\n";
-
-    outputFile.close();
-    std::cout << "HTML file generated successfully: tables.html" << std::endl;
+    html.append("</body>\n</html>\n");
+    return !html.failed();
 }
\ No newline at end of file
@@ -16,17 +16,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <stdarg.h>
 #include <errno.h>
 #include "locker.h"
 
 #include <map>
 #include <vector>
-#include "sql_connection_pool.h"
+#include "storage.h"
+#include "session_store.h"
+#include "coro.h"
+#include "arena.h"
+#include "trace.h"
 
 /*线程池的模板参数类*/
 class http_conn
 {
+    /*微基准（bench/microbench.cpp）直接调用解析和应答的内部函数*/
+    friend class http_conn_bench;
+
 public:
     /*文件名的最大长度*/
     static const int FILENAME_LEN = 200;
@@ -44,31 +52,68 @@ public:
     NO_REQUEST 请求不完整，需要继续读取客户数据
     GET_REQUEST 获得了一个完整的客户请求
     BAD_REQUEST 客户请求有语法错误
+    SERVICE_UNAVAILABLE 过载，请求没有被处理，回503
+    DEFERRED_REQUEST 应答由另一个线程稍后填好并发送，当前线程不再碰这个连接
     */
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION, SERVICE_UNAVAILABLE, DEFERRED_REQUEST };
     /*行的读取状态
     读取到一个完整行，行出错，行数据尚且不完整
     */
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+    /*请求交给哪个线程池（隔舱）处理：静态文件，读数据库，写数据库
+    慢的数据库请求占满自己的线程池时，静态文件请求不受影响*/
+    enum LANE { LANE_STATIC = 0, LANE_DB_READ, LANE_DB_WRITE, LANE_COUNT };
+    /*回完Connection: close的应答后只关了写端，等客户端关闭；客户端一直不关的，过了这么久（毫秒）由主线程关闭*/
+    static const int CLOSE_LINGER_MS = 3000;
+    /*写端已经关闭、等客户端关闭的连接*/
+    struct half_closed
+    {
+        int fd;
+        http_conn *conn;
+        long long deadline_ms;
+    };
 
 public:
-    http_conn(){}
+    /*连接对象由slab分配，每次分配都会构造；读写缓冲区在处理请求时才从缓冲区池里取*/
+    http_conn() : m_sockfd(-1), m_read_buf(NULL), m_write_buf(NULL), m_file_address(0), m_file_mapped(false), m_close_deadline_ms(0) {}
     ~http_conn(){}
 
 public:
     /*初始化新接受的连接*/
-    void init( int sockfd, const sockaddr_in& addr, string user, string passwd, string sqlname);
+    void init( int sockfd, const sockaddr_in& addr );
     /*关闭连接*/
     void close_conn( bool real_close = true );
     /*处理客户请求*/
     void process();
+#ifdef CORO_ENABLED
+    /*以协程处理客户请求：在self上解析和应答，查库的部分在db上执行，等待时挂起*/
+    task process_async(coro_executor &self, coro_executor &db);
+#endif
     /*非阻塞读操作*/
     bool read();
     /*非阻塞写操作*/
     bool write();
+    /*读完数据后由主线程调用，只看请求行就判断该交给哪个线程池*/
+    LANE lane() const;
+    /*过载时不处理请求，直接回503和Retry-After并关闭连接
+    主线程在入队失败时调用，工作线程在请求排队超过期限时调用*/
+    void reject();
+    /*单调时钟，毫秒*/
+    static long long now_ms();
+    /*主线程每轮调用：取出期限在now_ms之前的半关闭连接，最多max个，返回个数
+    取出来的连接可能已经关闭回收、或者客户端又发来了请求，要先用still_half_closed()确认*/
+    static int take_expired(long long now_ms, half_closed *out, int max);
+    /*还在等客户端关闭，而且是deadline_ms那一次*/
+    bool still_half_closed(long long deadline_ms) const { return m_close_deadline_ms.load(std::memory_order_relaxed) == deadline_ms; }
+    /*主线程读到新数据时调用，连接又要交给工作线程了，不再按半关闭的期限关闭*/
+    void clear_close_deadline() { m_close_deadline_ms.store(0, std::memory_order_relaxed); }
 
-    /*NEW databases*/
-    void initmysql_result(connection_pool *connPool);
+    /*分配用户名布隆过滤器并启动后台加载*/
+    static void init_users(storage *store);
+    /*静态文件请求处理过程中发生的全局堆分配次数，应该一直是0；只有定义了ARENA_COUNT_ALLOCS才统计*/
+    static long static_heap_allocs() { return m_static_heap_allocs.load(std::memory_order_relaxed); }
+    /*从缓冲区池取出、还没还回去的读（write为false）或写缓冲区个数*/
+    static long buffers_in_use(bool write);
 
 private:
     /*初始化连接*/
@@ -85,9 +130,28 @@ private:
     HTTP_CODE parse_headers( char* text );
     HTTP_CODE parse_content( char* text );
     HTTP_CODE do_request();
-    void generate_HTML(std::vector<std::vector<string> >&contents);
+    bool load_user(const char *name);
+    void note_write();
+    time_t last_write();
+    bool generate_HTML(arena_string &html);
     char* get_line() { return m_read_buf + m_start_line; }
     LINE_STATUS parse_line();
+    /*从缓冲区池取读/写缓冲区，请求处理完（或连接关闭）时一起还回去*/
+    bool attach_read_buf();
+    bool attach_write_buf();
+    void release_buffers();
+    /*应答填好了：记录应答大小，开始计算写完需要的时间*/
+    void response_ready();
+    /*应答填好后直接写，写不完再等EPOLLOUT*/
+    void send_response();
+    /*GET /profile 的采样线程：采样结束后填好应答并发送*/
+    static void *profile_main(void *arg);
+    /*重新注册epoll事件（EPOLLONESHOT）*/
+    void arm(int ev);
+    /*m_iv中还没写出去的字节数*/
+    size_t response_bytes() const;
+    /*应答写完，记一行访问日志*/
+    void log_access(long long now_us);
 
     /*下面这组函数被process_write()调用以填充http请求*/
     void unmap();
@@ -98,6 +162,7 @@ private:
     bool add_content_length( int content_length );
     bool add_content_type();
     bool add_linger();
+    bool add_cookie();
     bool add_blank_line();
 
 public:
@@ -105,7 +170,20 @@ public:
     static int m_epollfd;
     /*统计用户数量*/
     static int m_user_count;
-    MYSQL *mysql;
+    /*user表和info表的存储后端，启动时在mysql和本地存储之间选择*/
+    static storage *m_storage;
+    /*503响应中Retry-After的秒数*/
+    static int m_retry_after;
+    /*是否开放 GET /profile（进程内采样，见profiler.h）*/
+    static bool m_profiling;
+    static std::atomic<long> m_static_heap_allocs;
+    /*连接是在哪个NUMA节点上收到的，-1表示未知（未开启绑核）*/
+    int m_node;
+    /*主线程入队的时间（单调时钟微秒，用于统计排队时间）和处理期限（毫秒），工作线程取到时已经过了期限的直接回503，0表示不限*/
+    long long m_enqueue_us;
+    long long m_deadline_ms;
+    /*这个请求经过各阶段的时间戳，主线程记入队，存储后端记数据库的两项*/
+    request_trace m_trace;
     int m_state;  //读为0, 写为1
 
 private:
@@ -113,16 +191,16 @@ private:
     int m_sockfd;
     sockaddr_in m_address;
 
-    /*读缓冲区*/
-    char m_read_buf[ READ_BUFFER_SIZE ];
+    /*读缓冲区，大小READ_BUFFER_SIZE，没有请求在处理时为NULL*/
+    char *m_read_buf;
     /*标记读缓冲区中已经读入的客户数据的最后一个字节的下一个位置*/
     int m_read_idx;
     /*当前正在分析的字符在读缓冲区中的位置*/
     int m_checked_idx;
     /*当前正在解析的行的起始位置*/
     int m_start_line;
-    /*写缓冲区*/
-    char m_write_buf[ WRITE_BUFFER_SIZE ];
+    /*写缓冲区，大小WRITE_BUFFER_SIZE，没有请求在处理时为NULL*/
+    char *m_write_buf;
     /*写缓冲区中待发送的字节数*/
     int m_write_idx;
 
@@ -144,20 +222,36 @@ private:
     /*http请求是否要求保持连接*/
     bool m_linger;
 
-    /*客户请求的目标文件被mmap到内存中的起始位置*/
+    /*客户请求的目标文件被mmap到内存中的起始位置；动态生成的页面指向m_arena中的内容*/
     char* m_file_address;
+    /*m_file_address是否是mmap出来的，unmap()时要不要munmap*/
+    bool m_file_mapped;
     /*目标文件的状态，通过它可以判断文件是否存在、是否为目录，是否可读，并获取文件大小等*/
     struct stat m_file_stat;
+    /*应答的Content-Type，为NULL时不发送（浏览器按html处理）*/
+    const char *m_content_type;
+    /*应答填好的时间（微秒），0表示没有*/
+    long long m_response_us;
+    /*应答的状态码，0表示还没有应答*/
+    int m_status;
+    /*应答的总字节数（头部+内容）；m_iv随着写出去往后挪，剩下没写的是response_bytes()*/
+    size_t m_response_size;
+    /*写端关闭后等客户端关闭的期限，0表示没在等；工作线程写、主线程清除和检查*/
+    std::atomic<long long> m_close_deadline_ms;
     /*我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量*/
     struct iovec m_iv[2];
     int m_iv_count;
 
     int cgi;
     char *m_string; //存储请求头数据
-    map<string, string> m_users;
-    char sql_user[100];
-    char sql_passwd[100];
-    char sql_name[100];
+    /*该连接最近一次写数据库的时间；带着会话的请求还要看会话里记的（last_write()），用于读己之写*/
+    time_t m_last_write;
+    /*请求Cookie中带来的会话令牌*/
+    char m_sid[session_store::TOKEN_LEN + 1];
+    /*本次登录新发放的会话令牌，非空时在响应里Set-Cookie*/
+    char m_new_sid[session_store::TOKEN_LEN + 1];
+    /*处理这个请求时的临时内存，应答发送完（init()）时整体释放*/
+    arena m_arena;
 };
 
 #endif
@@ -0,0 +1,40 @@
+#include "hw_counter.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+hw_counter::~hw_counter()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+bool hw_counter::open(uint32_t type, uint64_t config)
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    /*之后创建的线程也计入，读的时候内核把它们的计数加在一起*/
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    m_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    return m_fd >= 0;
+}
+
+bool hw_counter::open_dtlb_misses(bool store)
+{
+    uint64_t op = store ? PERF_COUNT_HW_CACHE_OP_WRITE : PERF_COUNT_HW_CACHE_OP_READ;
+    return open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (op << 8) | ((uint64_t)PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+}
+
+long long hw_counter::read()
+{
+    long long value;
+    if (m_fd < 0 || ::read(m_fd, &value, sizeof(value)) != sizeof(value))
+        return -1;
+    return value;
+}
@@ -0,0 +1,34 @@
+#ifndef HW_COUNTER_H
+#define HW_COUNTER_H
+
+/*
+硬件性能计数器（perf_event_open），统计整个进程：打开之后创建的线程也计入，所以要在创建线程池之前打开
+用来观察大页对dTLB缺失的影响，例如 kill -USR1 <pid> 让服务器打印计数
+没有权限（/proc/sys/kernel/perf_event_paranoid）或者虚拟机不支持时open()返回false
+*/
+
+#include <stdint.h>
+
+class hw_counter
+{
+public:
+    hw_counter() : m_fd(-1) {}
+    ~hw_counter();
+
+    /*type/config同perf_event_attr*/
+    bool open(uint32_t type, uint64_t config);
+    /*dTLB读缺失（store为true时是写缺失）*/
+    bool open_dtlb_misses(bool store = false);
+    bool valid() const { return m_fd >= 0; }
+    /*到目前为止的计数，无效时返回-1*/
+    long long read();
+
+private:
+    hw_counter(const hw_counter &);
+    hw_counter &operator=(const hw_counter &);
+
+private:
+    int m_fd;
+};
+
+#endif
@@ -0,0 +1,297 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "local_storage.h"
+#include "metrics.h"
+#include "log.h"
+#include "trace.h"
+#include "profiler.h"
+
+local_storage::local_storage(int sync_delay_us)
+    : m_fd(-1), m_sync_delay_us(sync_delay_us), m_written(0), m_synced(0),
+      m_sync_failed(false), m_waiters(0), m_stop(false), m_flusher_started(false)
+{
+}
+
+local_storage::~local_storage()
+{
+    if (m_flusher_started)
+    {
+        m_lock.lock();
+        m_stop = true;
+        m_need_sync.signal();
+        m_lock.unlock();
+        pthread_join(m_flusher, NULL);
+    }
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+bool local_storage::open(const char *path)
+{
+    m_fd = ::open(path, O_RDWR | O_CREAT, 0644);
+    if (m_fd < 0)
+    {
+        printf("local storage: open %s failed: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (!recover())
+        return false;
+
+    if (pthread_create(&m_flusher, NULL, flusher, this) != 0)
+        return false;
+    m_flusher_started = true;
+    printf("local storage: %s, %d users, %d info records\n", path, (int)m_users.size(), (int)m_info.size());
+    return true;
+}
+
+uint32_t local_storage::crc32(const unsigned char *data, size_t len)
+{
+    static uint32_t table[256];
+    static bool inited = false;
+    if (!inited)
+    {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        inited = true;
+    }
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < len; ++i)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffff;
+}
+
+/*从头重放日志；第一条不完整或校验失败的记录及其后的内容都是崩溃留下的，截断掉*/
+bool local_storage::recover()
+{
+    vector<unsigned char> buf;
+    unsigned char chunk[65536];
+    ssize_t n;
+    while ((n = ::read(m_fd, chunk, sizeof(chunk))) > 0)
+        buf.insert(buf.end(), chunk, chunk + n);
+    if (n < 0)
+        return false;
+
+    size_t off = 0;
+    while (off + 8 <= buf.size())
+    {
+        uint32_t len, crc;
+        memcpy(&len, &buf[off], 4);
+        memcpy(&crc, &buf[off + 4], 4);
+        if (len < 3 || off + 8 + len > buf.size())
+            break;
+        const unsigned char *payload = &buf[off + 8];
+        if (crc32(payload, len) != crc || payload[len - 1] != '\0')
+            break;
+        const char *a = (const char *)payload + 1;
+        const char *b = a + strlen(a) + 1;
+        if (b >= (const char *)payload + len)
+            break;
+        apply(payload[0], a, b);
+        off += 8 + len;
+    }
+
+    if (off != buf.size())
+    {
+        printf("local storage: truncating %d bytes of torn log tail\n", (int)(buf.size() - off));
+        if (ftruncate(m_fd, off) != 0)
+            return false;
+        fdatasync(m_fd);
+    }
+    lseek(m_fd, off, SEEK_SET);
+    m_written = m_synced = off;
+    return true;
+}
+
+void local_storage::apply(int type, const char *a, const char *b)
+{
+    write_guard guard(m_index_lock);
+    if (type == RECORD_USER)
+        m_users[a] = b;
+    else if (type == RECORD_INFO)
+        m_info.push_back(make_pair(string(a), string(b)));
+}
+
+bool local_storage::append(int type, const char *a, const char *b)
+{
+    /*上一次刷盘失败的写入者还没全部返回时先等着，新记录不算进失败的那一批*/
+    while (m_sync_failed)
+        m_synced_cond.wait(m_lock.get());
+
+    size_t la = strlen(a) + 1, lb = strlen(b) + 1;
+    uint32_t len = 1 + la + lb;
+    vector<unsigned char> rec(8 + len);
+    rec[8] = (unsigned char)type;
+    memcpy(&rec[9], a, la);
+    memcpy(&rec[9 + la], b, lb);
+    uint32_t crc = crc32(&rec[8], len);
+    memcpy(&rec[0], &len, 4);
+    memcpy(&rec[4], &crc, 4);
+
+    /*总是写在m_written处：写失败留下的半条记录会被截掉或者被下一条覆盖，不会夹在后面的记录前面*/
+    size_t done = 0;
+    while (done < rec.size())
+    {
+        ssize_t n = pwrite(m_fd, &rec[done], rec.size() - done, m_written + done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR("local storage: write failed: %s", strerror(errno));
+            if (done > 0 && ftruncate(m_fd, m_written) != 0)
+                LOG_ERROR("local storage: ftruncate failed: %s", strerror(errno));
+            return false;
+        }
+        done += n;
+    }
+    m_written += rec.size();
+    if (type == RECORD_USER)
+        m_pending_users.insert(a);
+
+    /*等待刷盘线程把这条记录（以及同一批的其他记录）fdatasync到磁盘*/
+    uint64_t lsn = m_written;
+    m_need_sync.signal();
+    ++m_waiters;
+    while (m_synced < lsn && !m_sync_failed)
+        m_synced_cond.wait(m_lock.get());
+    --m_waiters;
+    bool ok = m_synced >= lsn;
+
+    if (type == RECORD_USER)
+        m_pending_users.erase(a);
+    if (ok)
+        apply(type, a, b);
+    /*失败的这一批都返回了，刷盘线程可以继续*/
+    if (m_sync_failed && m_waiters == 0)
+        m_synced_cond.broadcast();
+    return ok;
+}
+
+void *local_storage::flusher(void *arg)
+{
+    local_storage *store = (local_storage *)arg;
+    store->flush_loop();
+    return NULL;
+}
+
+void local_storage::flush_loop()
+{
+    m_lock.lock();
+    while (true)
+    {
+        while (m_synced == m_written && !m_stop)
+            m_need_sync.wait(m_lock.get());
+        if (m_synced == m_written && m_stop)
+            break;
+
+        /*稍等片刻再刷，让并发的写入者搭同一次fdatasync*/
+        m_lock.unlock();
+        if (m_sync_delay_us > 0)
+            usleep(m_sync_delay_us);
+        m_lock.lock();
+
+        uint64_t target = m_written;
+        m_lock.unlock();
+        int ret = fdatasync(m_fd);
+        m_lock.lock();
+
+        if (ret != 0)
+        {
+            /*没落盘的记录（包括刷盘期间新追加的）都截掉，等待它们的写入者返回失败，
+            之后的写入从上次落盘的位置重新开始，不会因为一次失败一直拒绝写入*/
+            LOG_ERROR("local storage: fdatasync failed: %s", strerror(errno));
+            if (ftruncate(m_fd, m_synced) != 0)
+                LOG_ERROR("local storage: ftruncate failed: %s", strerror(errno));
+            m_written = m_synced;
+            m_sync_failed = true;
+            m_synced_cond.broadcast();
+            while (m_waiters > 0)
+                m_synced_cond.wait(m_lock.get());
+            m_sync_failed = false;
+            m_synced_cond.broadcast();
+            continue;
+        }
+        m_synced = target;
+        m_synced_cond.broadcast();
+    }
+    m_lock.unlock();
+}
+
+/*本地存储没有从库，读总能读到自己刚写的，不需要last_write*/
+bool local_storage::get_user(const char *name, char *passwd, int len, time_t)
+{
+    profile_state db_wait(profiler::DB_WAIT);
+    metric_timer timer(metrics::QUERY);
+    read_guard guard(m_index_lock);
+    trace_db_call traced;
+    std::unordered_map<string, string>::iterator it = m_users.find(name);
+    if (it == m_users.end())
+        return false;
+    strncpy(passwd, it->second.c_str(), len);
+    passwd[len - 1] = '\0';
+    return true;
+}
+
+bool local_storage::has_user(const char *name)
+{
+    profile_state db_wait(profiler::DB_WAIT);
+    metric_timer timer(metrics::QUERY);
+    read_guard guard(m_index_lock);
+    trace_db_call traced;
+    return m_users.count(name) > 0;
+}
+
+/*查重和追加在同一把锁下完成，用户名唯一性由这里保证；等待落盘时m_lock是放开的，所以还要查没落盘的用户名
+索引只有持有m_lock的写入者才会修改，所以这里查重不需要再加读锁*/
+bool local_storage::add_user(const char *name, const char *passwd)
+{
+    profile_state db_wait(profiler::DB_WAIT);
+    metric_timer timer(metrics::QUERY);
+    scoped_lock<locker> guard(m_lock);
+    trace_db_call traced;
+    if (m_users.count(name) != 0 || m_pending_users.count(name) != 0)
+        return false;
+    return append(RECORD_USER, name, passwd);
+}
+
+bool local_storage::add_info(const char *user, const char *content)
+{
+    profile_state db_wait(profiler::DB_WAIT);
+    metric_timer timer(metrics::QUERY);
+    scoped_lock<locker> guard(m_lock);
+    trace_db_call traced;
+    return append(RECORD_INFO, user, content);
+}
+
+bool local_storage::scan_info(void (*fn)(const char *user, const char *content, void *arg), void *arg, time_t)
+{
+    profile_state db_wait(profiler::DB_WAIT);
+    metric_timer timer(metrics::QUERY);
+    read_guard guard(m_index_lock);
+    trace_db_call traced;
+    for (size_t i = 0; i < m_info.size(); ++i)
+        fn(m_info[i].first.c_str(), m_info[i].second.c_str(), arg);
+    return true;
+}
+
+bool local_storage::scan_users(void (*fn)(const char *name, void *arg), void *arg)
+{
+    read_guard guard(m_index_lock);
+    std::unordered_map<string, string>::iterator it;
+    for (it = m_users.begin(); it != m_users.end(); ++it)
+        fn(it->first.c_str(), arg);
+    return true;
+}
+
+long local_storage::estimate_users()
+{
+    read_guard guard(m_index_lock);
+    return m_users.size();
+}
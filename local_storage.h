@@ -0,0 +1,70 @@
+#ifndef LOCAL_STORAGE_H
+#define LOCAL_STORAGE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include "locker.h"
+#include "storage.h"
+
+/*
+不依赖mysqld的嵌入式存储：所有写入追加到一个日志文件，内存中保存索引，读请求不出进程
+日志记录格式：[长度 u32][crc32 u32][类型 u8][字段1 \0][字段2 \0]
+写入者追加记录后等待后台刷盘线程fdatasync，一次fdatasync覆盖这段时间内所有写入者（组提交）
+记录落盘之后才更新内存索引；fdatasync失败时截掉没落盘的记录，这一批写入者都返回失败，之后的写入照常进行
+启动时重放日志重建索引，遇到不完整或校验失败的尾部记录（崩溃时写了一半）就截断
+*/
+class local_storage : public storage
+{
+public:
+    /*sync_delay_us：刷盘线程被唤醒后先等这么久再fdatasync，用来攒更多的写入*/
+    local_storage(int sync_delay_us = 200);
+    ~local_storage();
+
+    /*打开（不存在则创建）日志文件并重放，失败返回false*/
+    bool open(const char *path);
+
+    bool get_user(const char *name, char *passwd, int len, time_t last_write = 0);
+    bool has_user(const char *name);
+    bool add_user(const char *name, const char *passwd);
+    bool add_info(const char *user, const char *content);
+    bool scan_info(void (*fn)(const char *user, const char *content, void *arg), void *arg, time_t last_write = 0);
+    bool scan_users(void (*fn)(const char *name, void *arg), void *arg);
+    long estimate_users();
+
+private:
+    enum RECORD_TYPE { RECORD_USER = 1, RECORD_INFO = 2 };
+
+    bool recover();
+    /*把记录应用到内存索引，调用者持有m_lock，内部再加m_index_lock的写锁*/
+    void apply(int type, const char *a, const char *b);
+    /*追加一条记录，等它落盘后应用到内存索引，调用者持有m_lock*/
+    bool append(int type, const char *a, const char *b);
+    static uint32_t crc32(const unsigned char *data, size_t len);
+    static void *flusher(void *arg);
+    void flush_loop();
+
+private:
+    int m_fd;
+    int m_sync_delay_us;
+    locker m_lock;          /*串行化写入者（查重、文件追加、等待落盘）*/
+    rwlock m_index_lock;    /*保护内存索引：读请求只加读锁，不和等待落盘的写入者抢m_lock*/
+    cond m_need_sync;       /*通知刷盘线程有新数据*/
+    cond m_synced_cond;     /*通知写入者数据已落盘*/
+    uint64_t m_written;     /*已追加的字节数*/
+    uint64_t m_synced;      /*已落盘的字节数*/
+    bool m_sync_failed;     /*刷盘失败，正在等这一批的写入者全部返回*/
+    int m_waiters;          /*等待落盘的写入者数*/
+    bool m_stop;
+    pthread_t m_flusher;
+    bool m_flusher_started;
+
+    std::unordered_map<string, string> m_users;
+    std::unordered_set<string> m_pending_users;  /*已追加还没落盘的用户名，查重时也要算上，受m_lock保护*/
+    vector<pair<string, string> > m_info;
+};
+
+#endif
@@ -4,6 +4,386 @@
 #include <exception>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
+#include <climits>
+#include <sched.h>
+
+/*futex系统调用的薄封装：*addr仍等于val时睡眠，直到被futex_wake唤醒*/
+inline int futex_wait(volatile int *addr, int val, const struct timespec *timeout = NULL)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+/*最多唤醒n个在addr上睡眠的线程*/
+inline int futex_wake(volatile int *addr, int n)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/*自旋等待时让出流水线资源给同核的另一个超线程*/
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/*
+自适应自旋：睡眠之前先自旋检查一会儿
+自旋期间等到了就把下次的自旋上限翻倍，没等到就减半，
+这样负载高时线程在自旋中接住任务，负载低时很快就去睡眠
+每个等待线程自己持有一个，不需要同步
+*/
+class adaptive_spin
+{
+public:
+    adaptive_spin(int min_spins = 16, int max_spins = 2048) : m_min(min_spins), m_max(max_spins), m_limit(min_spins) {}
+
+    template <typename F>
+    bool spin(F ready)
+    {
+        for (int i = 0; i < m_limit; ++i)
+        {
+            if (ready())
+            {
+                m_limit = m_limit * 2 > m_max ? m_max : m_limit * 2;
+                return true;
+            }
+            cpu_relax();
+        }
+        m_limit = m_limit / 2 < m_min ? m_min : m_limit / 2;
+        return false;
+    }
+
+private:
+    int m_min;
+    int m_max;
+    int m_limit;
+};
+
+/*
+事件计数器：等待者先prepare_wait()登记，再复查条件，条件仍不满足才wait()
+通知者只有在有登记的等待者时才做futex系统调用，没人等的时候notify()只是一次原子读
+一次notify(n)可以唤醒n个等待者，用于成批投递任务
+*/
+class eventcount
+{
+public:
+    eventcount() : m_epoch(0), m_waiters(0) {}
+
+    /*登记为等待者，返回当前纪元，之后必须调用wait()或cancel_wait()*/
+    int prepare_wait()
+    {
+        m_waiters.fetch_add(1, std::memory_order_seq_cst);
+        return m_epoch.load(std::memory_order_seq_cst);
+    }
+    void cancel_wait()
+    {
+        m_waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+    /*纪元仍为key时睡眠，直到被通知*/
+    void wait(int key)
+    {
+        while (m_epoch.load(std::memory_order_acquire) == key)
+            futex_wait((volatile int *)&m_epoch, key);
+        m_waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+    /*条件已经改变（对等待者可见）之后调用，最多唤醒n个等待者*/
+    void notify(int n = 1)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_waiters.load(std::memory_order_relaxed) == 0)
+            return;
+        m_epoch.fetch_add(1, std::memory_order_release);
+        futex_wake((volatile int *)&m_epoch, n);
+    }
+    void notify_all()
+    {
+        notify(INT_MAX);
+    }
+    int waiters()
+    {
+        return m_waiters.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<int> m_epoch;    /*futex字，每次通知加一*/
+    std::atomic<int> m_waiters;  /*已登记的等待者数*/
+};
+
+/*锁的竞争计数：acquires 获取次数，contended 没能立即获取的次数，parks 在futex上睡眠的次数*/
+struct lock_stats
+{
+    long acquires;
+    long contended;
+    long parks;
+};
+
+/*
+futex互斥锁（Drepper《Futexes Are Tricky》中的三态实现）：0 未加锁，1 加锁无等待者，2 加锁且可能有等待者
+不竞争时加锁解锁各一次原子操作，不进内核；竞争时先自旋一会儿，再在futex上睡眠
+解锁时只有状态为2才做futex_wake
+*/
+class fmutex
+{
+public:
+    fmutex() : m_state(0), m_acquires(0), m_contended(0), m_parks(0) {}
+
+    void lock()
+    {
+        int c = 0;
+        if (!m_state.compare_exchange_strong(c, 1, std::memory_order_acquire, std::memory_order_relaxed))
+            lock_slow();
+        m_acquires.fetch_add(1, std::memory_order_relaxed);
+    }
+    bool trylock()
+    {
+        int c = 0;
+        if (!m_state.compare_exchange_strong(c, 1, std::memory_order_acquire, std::memory_order_relaxed))
+            return false;
+        m_acquires.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    void unlock()
+    {
+        if (m_state.exchange(0, std::memory_order_release) == 2)
+            futex_wake((volatile int *)&m_state, 1);
+    }
+    lock_stats stats()
+    {
+        lock_stats st = {m_acquires.load(std::memory_order_relaxed), m_contended.load(std::memory_order_relaxed),
+                         m_parks.load(std::memory_order_relaxed)};
+        return st;
+    }
+
+private:
+    static const int SPINS = 128;
+
+    void lock_slow()
+    {
+        m_contended.fetch_add(1, std::memory_order_relaxed);
+        /*已经有人在睡眠（状态2）时自旋多半也等不到，直接去睡*/
+        for (int i = 0; i < SPINS && m_state.load(std::memory_order_relaxed) != 2; ++i)
+        {
+            int c = 0;
+            if (m_state.load(std::memory_order_relaxed) == 0 &&
+                m_state.compare_exchange_weak(c, 1, std::memory_order_acquire, std::memory_order_relaxed))
+                return;
+            cpu_relax();
+        }
+        /*置为2再睡；醒来后仍以2获取，因为可能还有别的等待者*/
+        while (m_state.exchange(2, std::memory_order_acquire) != 0)
+        {
+            m_parks.fetch_add(1, std::memory_order_relaxed);
+            futex_wait((volatile int *)&m_state, 2);
+        }
+    }
+
+    std::atomic<int> m_state;
+    std::atomic<long> m_acquires;
+    std::atomic<long> m_contended;
+    std::atomic<long> m_parks;
+};
+
+/*
+futex计数信号量：计数大于0时wait()只是一次CAS；为0时先自旋，再登记为等待者在计数上睡眠
+post()只有在有等待者时才做futex_wake
+*/
+class fsem
+{
+public:
+    fsem(int num = 0) : m_count(num), m_waiters(0), m_acquires(0), m_contended(0), m_parks(0) {}
+
+    bool wait()
+    {
+        m_acquires.fetch_add(1, std::memory_order_relaxed);
+        if (trywait())
+            return true;
+        m_contended.fetch_add(1, std::memory_order_relaxed);
+        for (int i = 0; i < SPINS; ++i)
+        {
+            cpu_relax();
+            if (trywait())
+                return true;
+        }
+        /*先登记再复查，和post()中“先加计数再看等待者”配对，不会丢失唤醒*/
+        m_waiters.fetch_add(1, std::memory_order_seq_cst);
+        while (!trywait())
+        {
+            m_parks.fetch_add(1, std::memory_order_relaxed);
+            futex_wait((volatile int *)&m_count, 0);
+        }
+        m_waiters.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+    bool trywait()
+    {
+        int c = m_count.load(std::memory_order_seq_cst);
+        while (c > 0)
+        {
+            if (m_count.compare_exchange_weak(c, c - 1, std::memory_order_acquire, std::memory_order_relaxed))
+                return true;
+        }
+        return false;
+    }
+    bool post()
+    {
+        m_count.fetch_add(1, std::memory_order_seq_cst);
+        if (m_waiters.load(std::memory_order_seq_cst) > 0)
+            futex_wake((volatile int *)&m_count, 1);
+        return true;
+    }
+    lock_stats stats()
+    {
+        lock_stats st = {m_acquires.load(std::memory_order_relaxed), m_contended.load(std::memory_order_relaxed),
+                         m_parks.load(std::memory_order_relaxed)};
+        return st;
+    }
+
+private:
+    static const int SPINS = 128;
+
+    std::atomic<int> m_count;
+    std::atomic<int> m_waiters;
+    std::atomic<long> m_acquires;
+    std::atomic<long> m_contended;
+    std::atomic<long> m_parks;
+};
+
+/*
+读多写少的读写锁：读计数分散在多个缓存行上，读者按线程落到其中一个，
+读加锁解锁只碰自己那一行，多个核同时读不会互相抢缓存行
+写者先互斥，再举起写标志，等所有读计数归零；举旗期间新来的读者退回去睡在eventcount上
+写者优先，写多的场景不适用
+*/
+class rwlock
+{
+public:
+    rwlock() : m_writer(0), m_read_waits(0), m_write_waits(0) {}
+
+    void rdlock()
+    {
+        reader_slot &s = m_slots[slot_index()];
+        while (true)
+        {
+            s.readers.fetch_add(1, std::memory_order_seq_cst);
+            if (m_writer.load(std::memory_order_seq_cst) == 0)
+                return;
+            s.readers.fetch_sub(1, std::memory_order_release);
+            m_read_waits.fetch_add(1, std::memory_order_relaxed);
+            int key = m_done.prepare_wait();
+            if (m_writer.load(std::memory_order_seq_cst) == 0)
+            {
+                m_done.cancel_wait();
+                continue;
+            }
+            m_done.wait(key);
+        }
+    }
+    void rdunlock()
+    {
+        m_slots[slot_index()].readers.fetch_sub(1, std::memory_order_release);
+    }
+    void wrlock()
+    {
+        m_wmutex.lock();
+        m_writer.store(1, std::memory_order_seq_cst);
+        for (int i = 0; i < SLOTS; ++i)
+        {
+            if (m_slots[i].readers.load(std::memory_order_seq_cst) == 0)
+                continue;
+            m_write_waits.fetch_add(1, std::memory_order_relaxed);
+            for (int spins = 0; m_slots[i].readers.load(std::memory_order_acquire) != 0; ++spins)
+            {
+                if (spins < 1024)
+                    cpu_relax();
+                else
+                    sched_yield();
+            }
+        }
+    }
+    void wrunlock()
+    {
+        m_writer.store(0, std::memory_order_seq_cst);
+        m_done.notify_all();
+        m_wmutex.unlock();
+    }
+    /*acquires是写锁的获取次数（读锁不计数，免得读者共享一个计数器）；
+    contended是读者遇到写者和写者等待读者的次数之和*/
+    lock_stats stats()
+    {
+        lock_stats st = m_wmutex.stats();
+        st.contended += m_read_waits.load(std::memory_order_relaxed) + m_write_waits.load(std::memory_order_relaxed);
+        return st;
+    }
+
+private:
+    static const int SLOTS = 16;
+    struct reader_slot
+    {
+        std::atomic<int> readers;
+        char padding[64 - sizeof(std::atomic<int>)];
+        reader_slot() : readers(0) {}
+    };
+
+    /*每个线程第一次使用时分到一个固定的槽，加锁和解锁一定落在同一个槽上*/
+    static int slot_index()
+    {
+        static std::atomic<int> next(0);
+        static thread_local int index = next.fetch_add(1, std::memory_order_relaxed) % SLOTS;
+        return index;
+    }
+
+    reader_slot m_slots[SLOTS];
+    std::atomic<int> m_writer;
+    fmutex m_wmutex;
+    eventcount m_done;
+    std::atomic<long> m_read_waits;
+    std::atomic<long> m_write_waits;
+};
+
+/*作用域锁：构造时加锁，析构时解锁，提前return也不会漏解锁；locker和fmutex都可以用*/
+template <typename Lock>
+class scoped_lock
+{
+public:
+    explicit scoped_lock(Lock &lock) : m_lock(lock) { m_lock.lock(); }
+    ~scoped_lock() { m_lock.unlock(); }
+
+private:
+    scoped_lock(const scoped_lock &);
+    scoped_lock &operator=(const scoped_lock &);
+    Lock &m_lock;
+};
+
+class read_guard
+{
+public:
+    explicit read_guard(rwlock &lock) : m_lock(lock) { m_lock.rdlock(); }
+    ~read_guard() { m_lock.rdunlock(); }
+
+private:
+    read_guard(const read_guard &);
+    read_guard &operator=(const read_guard &);
+    rwlock &m_lock;
+};
+
+class write_guard
+{
+public:
+    explicit write_guard(rwlock &lock) : m_lock(lock) { m_lock.wrlock(); }
+    ~write_guard() { m_lock.wrunlock(); }
+
+private:
+    write_guard(const write_guard &);
+    write_guard &operator=(const write_guard &);
+    rwlock &m_lock;
+};
 
 class sem
 {
@@ -60,6 +440,10 @@ public:
     {
         return pthread_mutex_unlock(&m_mutex) == 0;
     }
+    bool trylock()
+    {
+        return pthread_mutex_trylock(&m_mutex) == 0;
+    }
     pthread_mutex_t *get()
     {
         return &m_mutex;
@@ -0,0 +1,339 @@
+#include "log.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <new>
+#include <atomic>
+#include "cpu_affinity.h"
+
+struct log_record
+{
+    uint64_t ns;        /*CLOCK_REALTIME，后台线程格式化时间*/
+    uint16_t len;
+    uint8_t stream;
+    uint8_t level;
+    char text[logger::RECORD_SIZE - 12];
+};
+static_assert(sizeof(log_record) == logger::RECORD_SIZE, "log_record size");
+
+/*一个线程的环形缓冲区：head只有所属线程改，tail只有后台线程改，分在不同的缓存行上*/
+struct log_ring
+{
+    alignas(64) std::atomic<uint32_t> head;
+    alignas(64) std::atomic<uint32_t> tail;
+    std::atomic<uint64_t> dropped;
+    /*有线程在用；线程退出时清掉，留给之后新建的线程，线程池伸缩时不会越积越多*/
+    std::atomic<bool> owned;
+    log_ring *next;
+    log_record records[logger::RING_RECORDS];
+};
+
+/*一个输出文件和它的待写批次*/
+struct log_file
+{
+    char path[PATH_MAX];
+    int fd;
+    long bytes;
+    time_t opened;
+    int len;
+    char buf[64 * 1024];
+};
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static std::atomic<log_ring *> rings(NULL);
+static __thread log_ring *t_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static log_file files[logger::STREAM_COUNT];
+static bool to_stdout = true;
+static long max_bytes = 0;
+static int rotate_secs = 0;
+static uint64_t reported_drops = 0;
+static std::atomic<bool> running(false);
+static pthread_t writer;
+
+static void release_ring(void *r)
+{
+    ((log_ring *)r)->owned.store(false, std::memory_order_release);
+}
+
+static void make_ring_key()
+{
+    pthread_key_create(&ring_key, release_ring);
+}
+
+/*本线程的缓冲区：先找退出的线程留下的，没有再用mmap分配（已清零，只有写到的页才占内存）*/
+static log_ring *local_ring()
+{
+    log_ring *r = t_ring;
+    if (r)
+        return r;
+    pthread_once(&ring_key_once, make_ring_key);
+    for (r = rings.load(std::memory_order_acquire); r; r = r->next)
+    {
+        bool expected = false;
+        if (!r->owned.load(std::memory_order_relaxed) &&
+            r->owned.compare_exchange_strong(expected, true, std::memory_order_acquire))
+            break;
+    }
+    if (!r)
+    {
+        void *mem = alloc_on_node(sizeof(log_ring), -1);
+        if (!mem)
+            return NULL;
+        r = new (mem) log_ring;
+        r->owned.store(true, std::memory_order_relaxed);
+        r->next = rings.load();
+        while (!rings.compare_exchange_weak(r->next, r))
+        {
+        }
+    }
+    t_ring = r;
+    pthread_setspecific(ring_key, r);
+    return r;
+}
+
+void logger::write(int stream, int level, const char *format, ...)
+{
+    log_ring *r = local_ring();
+    if (!r)
+        return;
+    uint32_t h = r->head.load(std::memory_order_relaxed);
+    if (h - r->tail.load(std::memory_order_acquire) >= (uint32_t)RING_RECORDS)
+    {
+        /*后台线程跟不上，丢掉这条，不等待*/
+        r->dropped.store(r->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+    log_record &rec = r->records[h & (RING_RECORDS - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec.ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(rec.text, sizeof(rec.text), format, args);
+    va_end(args);
+    if (len < 0)
+        len = 0;
+    if (len >= (int)sizeof(rec.text))
+        len = sizeof(rec.text) - 1;
+    rec.len = len;
+    rec.stream = stream;
+    rec.level = level;
+    r->head.store(h + 1, std::memory_order_release);
+}
+
+uint64_t logger::dropped()
+{
+    uint64_t total = 0;
+    for (log_ring *r = rings.load(std::memory_order_acquire); r; r = r->next)
+        total += r->dropped.load(std::memory_order_relaxed);
+    return total;
+}
+
+static bool open_file(log_file &f)
+{
+    f.fd = open(f.path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (f.fd < 0)
+        return false;
+    struct stat st;
+    f.bytes = fstat(f.fd, &st) == 0 ? st.st_size : 0;
+    f.opened = time(NULL);
+    return true;
+}
+
+/*当前文件改名为 path.年月日-时分秒，同一秒里轮转多次的再加序号*/
+static void rotate(log_file &f, time_t now)
+{
+    struct tm tm;
+    localtime_r(&now, &tm);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    char target[PATH_MAX + 48];
+    snprintf(target, sizeof(target), "%s.%s", f.path, stamp);
+    for (int i = 1; access(target, F_OK) == 0; ++i)
+        snprintf(target, sizeof(target), "%s.%s.%d", f.path, stamp, i);
+    close(f.fd);
+    rename(f.path, target);
+    if (!open_file(f))
+    {
+        /*打不开新文件时退回到标准输出，日志不至于全丢*/
+        f.fd = STDOUT_FILENO;
+    }
+}
+
+static void flush(log_file &f)
+{
+    if (f.len == 0)
+        return;
+    if (!to_stdout && f.fd != STDOUT_FILENO)
+    {
+        time_t now = time(NULL);
+        if ((max_bytes && f.bytes > 0 && f.bytes + f.len > max_bytes) ||
+            (rotate_secs && now - f.opened >= rotate_secs))
+            rotate(f, now);
+    }
+    int off = 0;
+    while (off < f.len)
+    {
+        ssize_t n = ::write(f.fd, f.buf + off, f.len - off);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        off += n;
+    }
+    f.bytes += off;
+    f.len = 0;
+}
+
+/*时间格式化只在秒变化时做一次*/
+static const char *format_second(time_t sec)
+{
+    static time_t last = -1;
+    static char text[32];
+    if (sec != last)
+    {
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &tm);
+        last = sec;
+    }
+    return text;
+}
+
+static void append(int stream, int level, uint64_t ns, const char *text, int len)
+{
+    log_file &f = files[stream];
+    /*时间戳 + 级别 + 内容 + 换行，最长不超过这么多*/
+    if (f.len + len + 64 > (int)sizeof(f.buf))
+        flush(f);
+    const char *sec = format_second(ns / 1000000000ULL);
+    long us = (ns % 1000000000ULL) / 1000;
+    int n;
+    if (stream == logger::SERVER)
+        n = snprintf(f.buf + f.len, sizeof(f.buf) - f.len, "%s.%06ld %-5s %.*s\n", sec, us, level_names[level & 3], len, text);
+    else
+        n = snprintf(f.buf + f.len, sizeof(f.buf) - f.len, "%s.%06ld %.*s\n", sec, us, len, text);
+    if (n > 0 && n < (int)sizeof(f.buf) - f.len)
+        f.len += n;
+}
+
+/*把所有线程缓冲的记录取出来写掉，返回取到的条数
+不同线程的记录不按时间归并，一批之内可能有先后颠倒，每行都带着自己的时间戳*/
+static int drain()
+{
+    int count = 0;
+    for (log_ring *r = rings.load(std::memory_order_acquire); r; r = r->next)
+    {
+        uint32_t t = r->tail.load(std::memory_order_relaxed);
+        uint32_t h = r->head.load(std::memory_order_acquire);
+        for (; t != h; ++t)
+        {
+            const log_record &rec = r->records[t & (logger::RING_RECORDS - 1)];
+            append(rec.stream < logger::STREAM_COUNT ? rec.stream : (int)logger::SERVER, rec.level, rec.ns, rec.text, rec.len);
+            ++count;
+        }
+        r->tail.store(h, std::memory_order_release);
+    }
+
+    uint64_t drops = logger::dropped();
+    if (drops != reported_drops)
+    {
+        char text[64];
+        int len = snprintf(text, sizeof(text), "logger: %llu records dropped, buffers were full",
+                           (unsigned long long)(drops - reported_drops));
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        append(logger::SERVER, LOG_LEVEL_WARN, ts.tv_sec * 1000000000ULL + ts.tv_nsec, text, len);
+        reported_drops = drops;
+    }
+
+    for (int s = 0; s < logger::STREAM_COUNT; ++s)
+        flush(files[s]);
+    return count;
+}
+
+/*请求路径上不唤醒后台线程（那又是一次系统调用），空闲时每10ms看一次*/
+static void *writer_main(void *)
+{
+    while (running.load(std::memory_order_acquire))
+    {
+        if (drain() == 0)
+        {
+            struct timespec ts = {0, 10 * 1000 * 1000};
+            nanosleep(&ts, NULL);
+        }
+    }
+    drain();
+    return NULL;
+}
+
+bool logger::start(const char *dir, long max, int secs)
+{
+    if (running.load())
+        return true;
+    to_stdout = dir == NULL;
+    max_bytes = max;
+    rotate_secs = secs;
+    static const char *names[STREAM_COUNT] = {"server.log", "access.log", "slow.log"};
+    if (dir && mkdir(dir, 0755) != 0 && errno != EEXIST)
+    {
+        printf("log: mkdir %s failed: %s\n", dir, strerror(errno));
+        return false;
+    }
+    for (int s = 0; s < STREAM_COUNT; ++s)
+    {
+        files[s].len = 0;
+        if (to_stdout)
+        {
+            files[s].fd = STDOUT_FILENO;
+            continue;
+        }
+        snprintf(files[s].path, sizeof(files[s].path), "%s/%s", dir, names[s]);
+        if (!open_file(files[s]))
+        {
+            printf("log: open %s failed: %s\n", files[s].path, strerror(errno));
+            return false;
+        }
+    }
+
+    /*信号都留给主线程处理*/
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    running.store(true, std::memory_order_release);
+    int ret = pthread_create(&writer, NULL, writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret != 0)
+    {
+        running.store(false);
+        return false;
+    }
+    return true;
+}
+
+void logger::stop()
+{
+    if (!running.exchange(false))
+        return;
+    pthread_join(writer, NULL);
+    for (int s = 0; s < STREAM_COUNT; ++s)
+    {
+        if (files[s].fd != STDOUT_FILENO)
+            close(files[s].fd);
+        files[s].fd = STDOUT_FILENO;
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef LOG_H
+#define LOG_H
+
+/*
+异步日志：请求路径上不碰stdio的锁，也不做系统调用
+每个线程有自己的环形缓冲区（第一次写时用mmap分配，不经过全局堆），只有本线程写、后台线程读，不加锁；
+写满时丢弃新的记录并计数，不阻塞请求
+后台线程把各线程的记录格式化成行，攒成一批用一次write()写到文件，文件按大小和时间轮转
+三个输出：server.log 是运行/调试日志，access.log 每个请求一行，slow.log 是超过阈值的慢请求（见trace.h）
+编译时用 -DLOG_LEVEL=LOG_LEVEL_DEBUG 打开调试日志；低于LOG_LEVEL的调用连参数都不会求值
+*/
+
+#include <stdint.h>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+class logger
+{
+public:
+    enum STREAM
+    {
+        SERVER = 0,     /*server.log*/
+        ACCESS,         /*access.log*/
+        SLOW,           /*slow.log*/
+        STREAM_COUNT
+    };
+    /*一条记录的大小（含头部），更长的内容被截断*/
+    static const int RECORD_SIZE = 256;
+    /*每个线程缓冲的记录数，2的幂*/
+    static const int RING_RECORDS = 1024;
+
+    /*启动后台写线程；dir为NULL时所有输出都写到标准输出，不轮转
+    max_bytes为0表示不按大小轮转，rotate_secs为0表示不按时间轮转*/
+    static bool start(const char *dir, long max_bytes, int rotate_secs);
+    /*写完已经缓冲的记录后退出后台线程*/
+    static void stop();
+    static void write(int stream, int level, const char *format, ...) __attribute__((format(printf, 3, 4)));
+    /*缓冲区满丢弃的记录数*/
+    static uint64_t dropped();
+};
+
+/*关掉的级别仍然让编译器检查格式串，但整个调用被优化掉*/
+#define LOG_AT(level, ...) do { if (LOG_LEVEL <= (level)) logger::write(logger::SERVER, (level), __VA_ARGS__); } while (0)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_ACCESS(...) logger::write(logger::ACCESS, LOG_LEVEL_INFO, __VA_ARGS__)
+
+#endif
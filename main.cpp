@@ -9,13 +9,27 @@
 #include <stdlib.h>
 #include <cassert>
 #include <sys/epoll.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <sys/syscall.h>
 
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
 #include "sql_connection_pool.h"
+#include "mysql_storage.h"
+#include "local_storage.h"
+#include "cpu_affinity.h"
+#include "coro.h"
+#include "slab.h"
+#include "hw_counter.h"
+#include "metrics.h"
+#include "log.h"
+#include "trace.h"
+#include "profiler.h"
 
-#define MAX_FD 65536
+/*fd表（users）的大小按RLIMIT_NOFILE定，硬限制是无穷大时取这个上限*/
+#define MAX_FD_LIMIT (1 << 20)
 #define MAX_EVENT_NUMBER 10000
 
 extern int addfd(int epollfd, int fd, bool one_shot);
@@ -34,20 +48,277 @@ void addsig(int sig, void(handler)(int), bool restart = true)
     assert(sigaction(sig, &sa, NULL) != -1);
 }
 
+/*连接数已满时还没有http_conn可用，直接回一个完整的503响应再关闭*/
 void show_error(int connfd, const char *info)
 {
-    printf("%s", info);
-    send(connfd, info, strlen(info), 0);
+    LOG_WARN("%s", info);
+    metrics::inc(metrics::REJECTED);
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), "HTTP/1.1 503 Service Unavailable\r\nRetry-After: %d\r\nContent-Length: %d\r\nConnection: close\r\n\r\n%s",
+                       http_conn::m_retry_after, (int)strlen(info), info);
+    send(connfd, buf, len, 0);
     close(connfd);
 }
 
-int main()
+/*隔舱：静态文件、读库、写库三类请求各用一个线程池，线程数、队列上限、优先级各自独立
+数据库线程池占满或排队到上限时，只影响自己这一类请求
+每个线程池的线程数按排队时延和忙碌比例在[min_threads, threads]之间自动伸缩
+准入控制：排队数到了max_requests的请求直接回503；在队列里等了超过deadline_ms的，工作线程也不再处理，回503*/
+struct lane_conf
+{
+    const char *name;
+    int min_threads;
+    int threads;
+    int max_requests;
+    int nice;
+    int deadline_ms;
+};
+static lane_conf lanes[http_conn::LANE_COUNT] =
+{
+    {"static",   2, 4, 10000, 0, 2000},
+    {"db-read",  2, 8, 1000,  5, 3000},
+    {"db-write", 1, 4, 500,   5, 5000},
+};
+
+static int max_fd = 65536;
+
+/*把打开文件数的软限制提到硬限制，返回fd表的大小；十万级的连接数需要先调大硬限制（ulimit -Hn / fs.nr_open）*/
+static int raise_fd_limit()
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+        return max_fd;
+    rlim_t want = (rl.rlim_max == RLIM_INFINITY || rl.rlim_max > MAX_FD_LIMIT) ? MAX_FD_LIMIT : rl.rlim_max;
+    if (rl.rlim_cur < want)
+    {
+        struct rlimit raised = rl;
+        raised.rlim_cur = want;
+        if (setrlimit(RLIMIT_NOFILE, &raised) != 0)
+            want = rl.rlim_cur;
+    }
+    return want > MAX_FD_LIMIT ? MAX_FD_LIMIT : (int)want;
+}
+
+/*连接对象按需从slab分配，只有在线的连接占用内存；-g 时放在2M大页上*/
+static slab<http_conn> conn_slab(256, true);
+
+/*连接只在主线程里关闭和回收；交给工作线程的连接（EPOLLONESHOT）在它重新注册事件之前不会出现在这里*/
+static void release_conn(http_conn **users, int fd)
+{
+    users[fd]->close_conn();
+    conn_slab.free(users[fd]);
+    users[fd] = NULL;
+}
+
+/*GET /metrics 中的当前值，抓取时由工作线程调用*/
+static const char *lane_labels[http_conn::LANE_COUNT] = {"lane=\"static\"", "lane=\"db-read\"", "lane=\"db-write\""};
+static double gauge_connections(void *)
+{
+    return http_conn::m_user_count;
+}
+static double gauge_conn_objects(void *)
+{
+    return conn_slab.live();
+}
+#ifdef ARENA_COUNT_ALLOCS
+static double gauge_static_heap_allocs(void *)
+{
+    return http_conn::static_heap_allocs();
+}
+#endif
+static double gauge_log_dropped(void *)
+{
+    return logger::dropped();
+}
+static double gauge_conn_bytes(void *)
+{
+    return (double)conn_slab.live() * sizeof(http_conn);
+}
+static double gauge_buffers(void *write)
+{
+    return http_conn::buffers_in_use(write != NULL);
+}
+/*/metrics走静态隔舱，这两个读/proc的不用fopen/opendir：它们会在堆上分配缓冲区，算成静态路径上的堆分配*/
+static double gauge_rss_bytes(void *)
+{
+    char buf[128];
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0)
+        return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    long pages = 0, resident = 0;
+    if (sscanf(buf, "%ld %ld", &pages, &resident) != 2)
+        return 0;
+    return (double)resident * sysconf(_SC_PAGESIZE);
+}
+static double gauge_open_fds(void *)
+{
+    int fd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return 0;
+    char buf[4096];
+    long n = 0;
+    long len;
+    while ((len = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0)
+    {
+        for (long off = 0; off < len; off += ((struct dirent64 *)(buf + off))->d_reclen)
+            ++n;
+    }
+    close(fd);
+    return n - 3;   /*.、..和这里打开的fd*/
+}
+static double gauge_max_fds(void *)
+{
+    return max_fd;
+}
+static double gauge_page_bytes(void *kind)
+{
+    return huge_page_bytes((int)(long)kind);
+}
+template <typename Pool>
+static double gauge_queue_size(void *pool)
+{
+    return ((Pool *)pool)->queue_size();
+}
+template <typename Pool>
+static double gauge_active_threads(void *pool)
+{
+    return ((Pool *)pool)->active_threads();
+}
+
+/*收到SIGUSR1时打印大页和dTLB缺失的统计*/
+static volatile sig_atomic_t dump_stats = 0;
+static void on_usr1(int)
+{
+    dump_stats = 1;
+}
+
+static void print_tlb_stats(hw_counter &load_misses, hw_counter &store_misses, long long requests)
+{
+    printf("huge pages %s: hugetlb %ld KB, thp %ld KB (AnonHugePages %ld KB), live connections %ld, requests %lld\n",
+           huge_pages_enabled() ? "on" : "off", huge_page_bytes(PAGE_HUGETLB) / 1024, huge_page_bytes(PAGE_THP) / 1024,
+           anon_huge_kb(), conn_slab.live(), requests);
+    if (!load_misses.valid())
+    {
+        printf("dTLB counters unavailable (perf_event_paranoid or no PMU)\n");
+        fflush(stdout);
+        return;
+    }
+    long long loads = load_misses.read();
+    long long stores = store_misses.read();
+    printf("dTLB load misses %lld, store misses %lld, per request %.1f\n",
+           loads, stores, requests ? (double)(loads + (stores > 0 ? stores : 0)) / requests : 0.0);
+    fflush(stdout);
+}
+
+void usage(const char *prog)
+{
+    printf("usage: %s [-i ip] [-p port] [-s mysql|local] [-d log_file] [-t threads] [-a auto|cpu_list] [-c coro_threads] [-g] [-l log_dir] [-r max_mb[,rotate_secs]] [-T slow_ms[,sample_every]] [-P]\n", prog);
+    printf("  -s  存储后端：mysql（默认，使用连接池）或 local（嵌入式日志存储，不需要mysqld）\n");
+    printf("  -d  local后端的日志文件路径，默认 tinydb.log\n");
+    printf("  -t  各线程池的最大工作线程数 static[,db-read[,db-write]]，默认 4,8,4\n");
+    printf("  -a  绑核：auto 按NUMA节点自动分配；或CPU列表如 0,2-7，第一个给主线程，其余给工作线程\n");
+    printf("  -c  数据库请求以协程处理（需要C++20编译），参数是协程线程数；数据库隔舱的线程只用来执行查询\n");
+    printf("  -g  连接表、连接对象和读写缓冲区用2M大页（MAP_HUGETLB，没有预留大页时用透明大页）；kill -USR1 打印dTLB缺失统计\n");
+    printf("  -l  日志目录，运行日志写到server.log，每个请求一行写到access.log，慢请求写到slow.log；不指定时都写到标准输出\n");
+    printf("  -r  日志轮转：单个文件超过max_mb兆或者写了rotate_secs秒就换新文件，默认 64,86400，0表示不按这一项轮转\n");
+    printf("  -T  请求跟踪：总耗时超过slow_ms毫秒的请求按阶段写慢请求日志，每sample_every个请求抽一个，GET /trace 导出Chrome trace，默认 500,1000，0表示关闭这一项\n");
+    printf("  -P  开放 GET /profile?seconds=N&hz=99&mode=cpu|wall 进程内采样，返回folded格式的调用栈（编译加 -fno-omit-frame-pointer 栈才完整）\n");
+}
+
+int main(int argc, char *argv[])
 {
     const char *ip = "192.168.206.129";
     int port = atoi("9990");
+    const char *engine = "mysql";
+    const char *log_file = "tinydb.log";
+    const char *affinity = NULL;
+    int coro_threads = 0;
+    bool huge = false;
+    const char *log_dir = NULL;
+    long log_max_mb = 64;
+    int log_rotate_secs = 86400;
+    int slow_ms = 500;
+    int sample_every = 1000;
 
-    /*预先为每个可能的客户连接分配一个http_conn对象*/
-    http_conn *users = new http_conn[MAX_FD];
+    int opt;
+    while ((opt = getopt(argc, argv, "i:p:s:d:t:a:c:gl:r:T:Ph")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            ip = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 's':
+            engine = optarg;
+            break;
+        case 'd':
+            log_file = optarg;
+            break;
+        case 't':
+            sscanf(optarg, "%d,%d,%d", &lanes[0].threads, &lanes[1].threads, &lanes[2].threads);
+            break;
+        case 'a':
+            affinity = optarg;
+            break;
+        case 'c':
+            coro_threads = atoi(optarg);
+            break;
+        case 'g':
+            huge = true;
+            break;
+        case 'l':
+            log_dir = optarg;
+            break;
+        case 'r':
+            sscanf(optarg, "%ld,%d", &log_max_mb, &log_rotate_secs);
+            break;
+        case 'T':
+            sscanf(optarg, "%d,%d", &slow_ms, &sample_every);
+            break;
+        case 'P':
+            http_conn::m_profiling = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+#ifndef CORO_ENABLED
+    if (coro_threads > 0)
+    {
+        printf("-c needs a build with C++20 coroutines (-std=c++20)\n");
+        return 1;
+    }
+#endif
+
+    if (!logger::start(log_dir, log_max_mb * 1024 * 1024, log_rotate_secs))
+    {
+        return 1;
+    }
+    tracer::init(slow_ms, sample_every);
+    profiler::register_thread(profiler::REACTOR);
+
+    /*dTLB缺失计数要在创建任何线程之前打开，之后的线程才会计入*/
+    hw_counter load_misses, store_misses;
+    if (load_misses.open_dtlb_misses())
+        store_misses.open_dtlb_misses(true);
+    addsig(SIGUSR1, on_usr1, false);
+    set_huge_pages(huge);
+
+    /*fd到连接对象的映射，连接建立时才分配对象；按fd随机访问，启用大页时也放在大页上*/
+    max_fd = raise_fd_limit();
+    size_t users_bytes = max_fd * sizeof(http_conn *);
+    int users_kind = PAGE_SMALL;
+    http_conn **users = huge ? (http_conn **)alloc_huge_on_node(&users_bytes, -1, &users_kind) : new http_conn *[max_fd]();
     assert(users);
     /*设置数据库连接*/
     //需要修改的数据库信息,登录名,密码,库名
@@ -55,12 +326,37 @@ int main()
     string Passwd = "lw123654m";
     string Databasename = "tinydb";
 
-    /*GetInstance 返回的是一个connection_pool 静态变量 static connection_pool connPool; return &connPool;*/
-    connection_pool *connPool = connection_pool::GetInstance();
-    /*connPool 初始化了 N个 与数据库的连接*/
-    connPool -> init("localhost", User, Passwd, Databasename, 3306, 8);
-    //初始化数据库读取表
-    users->initmysql_result(connPool);
+    storage *store = NULL;
+    if (strcmp(engine, "local") == 0)
+    {
+        /*嵌入式存储：追加日志 + 内存索引，启动时重放日志*/
+        local_storage *local = new local_storage();
+        if (!local->open(log_file))
+        {
+            return 1;
+        }
+        store = local;
+    }
+    else if (strcmp(engine, "mysql") == 0)
+    {
+        /*GetInstance 返回的是一个connection_pool 静态变量 static connection_pool connPool; return &connPool;*/
+        connection_pool *connPool = connection_pool::GetInstance();
+        /*connPool 初始化了 N个 与数据库的连接*/
+        connPool -> init("localhost", User, Passwd, Databasename, 3306, 8);
+        /*读写分离：写请求只走主库，读请求分发到下面添加的从库（按未归还连接数最少选择）*/
+        //connPool -> AddReplica("127.0.0.1", 3307, 8);
+        /*刚写过数据库的连接在1秒内的读请求仍然走主库，避免读不到自己的写*/
+        connPool -> SetReadYourWrites(1);
+        store = new mysql_storage(connPool);
+    }
+    else
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    http_conn::m_storage = store;
+    //初始化用户名布隆过滤器，由后台线程加载，不阻塞启动
+    http_conn::init_users(store);
 
     /*忽略SIGPIPE信号*/
     /*可以通过设置信号处理函数来忽略 SIGPIPE 信号，使得进程在收到该信号时不做任何处理。
@@ -70,16 +366,107 @@ int main()
     线程池中的每个线程从被创建之初就开始运行work函数，里面是运行run函数，
     不断监听请求队列，后续一旦有请求到达就开始处理
     */
-    threadpool<http_conn> *pool = NULL;
+    /*绑核：主线程（reactor）和工作线程各自固定在CPU上，工作线程按NUMA节点分组，
+    连接交给收到它的那个节点上的工作线程处理*/
+    int thread_number = 0;
+    for (int l = 0; l < http_conn::LANE_COUNT; ++l)
+    {
+        if (lanes[l].threads <= 0)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        thread_number += lanes[l].threads;
+    }
+    affinity_plan plan;
+    if (affinity)
+    {
+        if (!plan.parse(affinity, thread_number))
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        pin_current_thread(plan.reactor_cpu);
+    }
+
+    /*请求队列使用工作窃取调度：每个线程一个收件箱，空闲线程从忙碌线程那里窃取
+    每个隔舱一个线程池，绑核方案按顺序切给各个线程池*/
+    threadpool<http_conn, steal_queue<http_conn> > *pools[http_conn::LANE_COUNT] = {NULL};
+#ifdef CORO_ENABLED
+    /*协程模式：数据库隔舱的请求在coro_pool上以协程处理，查库时挂起；
+    查询本身在该隔舱的线程池里执行，线程数、队列上限、优先级仍按lanes[]配置*/
+    threadpool<coro_job> *coro_pool = NULL;
+    threadpool<coro_job> *db_pools[http_conn::LANE_COUNT] = {NULL};
+    coro_executor *coro_ex = NULL;
+    coro_executor *db_ex[http_conn::LANE_COUNT] = {NULL};
+#endif
     try
     {
-        pool = new threadpool<http_conn>(connPool);
+        int first = 0;
+        for (int l = 0; l < http_conn::LANE_COUNT; ++l)
+        {
+            affinity_plan sub = plan.slice(first, lanes[l].threads);
+            first += lanes[l].threads;
+#ifdef CORO_ENABLED
+            if (coro_threads > 0 && l != http_conn::LANE_STATIC)
+            {
+                db_pools[l] = new threadpool<coro_job>(lanes[l].threads, lanes[l].max_requests, &sub, lanes[l].nice);
+                db_pools[l]->auto_size(std::min(lanes[l].min_threads, lanes[l].threads));
+                db_ex[l] = new pool_executor<threadpool<coro_job> >(db_pools[l]);
+                continue;
+            }
+#endif
+            pools[l] = new threadpool<http_conn, steal_queue<http_conn> >(lanes[l].threads, lanes[l].max_requests, &sub, lanes[l].nice);
+            pools[l]->auto_size(std::min(lanes[l].min_threads, lanes[l].threads));
+        }
+#ifdef CORO_ENABLED
+        if (coro_threads > 0)
+        {
+            coro_pool = new threadpool<coro_job>(coro_threads, 10000);
+            coro_ex = new pool_executor<threadpool<coro_job> >(coro_pool);
+        }
+#endif
     }
     catch (...)
     {
         return 1;
     }
 
+    /*注册/metrics中的当前值，同名的要连着注册*/
+    typedef threadpool<http_conn, steal_queue<http_conn> > http_pool;
+    metrics::add_gauge("http_connections", "Open client connections (m_user_count).", NULL, gauge_connections, NULL);
+    metrics::add_gauge("http_conn_objects", "Connection objects allocated from the slab.", NULL, gauge_conn_objects, NULL);
+    metrics::add_gauge("http_conn_bytes", "Memory held by connection objects (live objects times sizeof(http_conn)).", NULL, gauge_conn_bytes, NULL);
+    metrics::add_gauge("http_buffers_in_use", "Read/write buffers taken from the buffer pools; idle keep-alive connections hold none.", "kind=\"read\"", gauge_buffers, NULL);
+    metrics::add_gauge("http_buffers_in_use", "Read/write buffers taken from the buffer pools; idle keep-alive connections hold none.", "kind=\"write\"", gauge_buffers, (void *)1);
+    metrics::add_gauge("process_resident_memory_bytes", "Resident set size.", NULL, gauge_rss_bytes, NULL);
+    metrics::add_gauge("process_open_fds", "Open file descriptors.", NULL, gauge_open_fds, NULL);
+    metrics::add_gauge("process_max_fds", "Size of the fd table, from RLIMIT_NOFILE.", NULL, gauge_max_fds, NULL);
+#ifdef ARENA_COUNT_ALLOCS
+    metrics::add_gauge("http_static_path_heap_allocs", "Global heap allocations made while serving static-lane requests; should stay 0.", NULL, gauge_static_heap_allocs, NULL);
+#endif
+    metrics::add_gauge("huge_page_bytes", "Memory mapped on 2MB pages.", "kind=\"hugetlb\"", gauge_page_bytes, (void *)(long)PAGE_HUGETLB);
+    metrics::add_gauge("huge_page_bytes", "Memory mapped on 2MB pages.", "kind=\"thp\"", gauge_page_bytes, (void *)(long)PAGE_THP);
+    metrics::add_gauge("log_dropped_records", "Log records dropped because a thread's log buffer was full.", NULL, gauge_log_dropped, NULL);
+    for (int l = 0; l < http_conn::LANE_COUNT; ++l)
+    {
+        if (pools[l])
+            metrics::add_gauge("worker_queue_depth", "Requests waiting in a worker pool queue.", lane_labels[l], gauge_queue_size<http_pool>, pools[l]);
+#ifdef CORO_ENABLED
+        if (db_pools[l])
+            metrics::add_gauge("worker_queue_depth", "Requests waiting in a worker pool queue.", lane_labels[l], gauge_queue_size<threadpool<coro_job> >, db_pools[l]);
+#endif
+    }
+    for (int l = 0; l < http_conn::LANE_COUNT; ++l)
+    {
+        if (pools[l])
+            metrics::add_gauge("worker_threads_active", "Worker threads currently enabled by auto-sizing.", lane_labels[l], gauge_active_threads<http_pool>, pools[l]);
+#ifdef CORO_ENABLED
+        if (db_pools[l])
+            metrics::add_gauge("worker_threads_active", "Worker threads currently enabled by auto-sizing.", lane_labels[l], gauge_active_threads<threadpool<coro_job> >, db_pools[l]);
+#endif
+    }
+
     int listenfd = socket(PF_INET, SOCK_STREAM, 0);
     assert(listenfd >= 0);
     /*
@@ -95,6 +482,9 @@ int main()
     */
     struct linger tmp = {1, 0};
     setsockopt(listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
+    /*短连接的应答是先shutdown写端、等客户端关闭的，服务器这边会留下TIME_WAIT，不设的话重启时bind失败*/
+    int reuse = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
     int ret = 0;
     struct sockaddr_in address;
@@ -106,7 +496,8 @@ int main()
     ret = bind(listenfd, (struct sockaddr *)&address, sizeof(address));
     assert(ret >= 0);
 
-    ret = listen(listenfd, 5);
+    /*建连高峰（压测爬坡、大量客户端同时重连）时，5的积压会让SYN被丢掉、客户端1秒后重传*/
+    ret = listen(listenfd, SOMAXCONN);
     assert(ret >= 0);
 
     /*这是主线程的epoll函数，监听listen socket 发过来的连接请求，以及连接建立好后的所有事件请求*/
@@ -121,78 +512,201 @@ int main()
     /*http_conn连接类的静态变量m_epollfd*/
     http_conn::m_epollfd = epollfd;
 
+    /*一轮epoll_wait中读完数据的连接先按隔舱攒起来，循环结束后一次性交给各自的线程池，只唤醒一次*/
+    http_conn **ready[http_conn::LANE_COUNT];
+    int *ready_node[http_conn::LANE_COUNT];
+    int nready[http_conn::LANE_COUNT];
+    /*每轮从半关闭等待中取出的超时连接*/
+    const int EXPIRED_BATCH = 256;
+    http_conn::half_closed expired[EXPIRED_BATCH];
+    /*读到数据并交给线程池的次数，用来算每个请求的dTLB缺失*/
+    long long requests = 0;
+    for (int l = 0; l < http_conn::LANE_COUNT; ++l)
+    {
+        ready[l] = new http_conn *[MAX_EVENT_NUMBER];
+        ready_node[l] = new int[MAX_EVENT_NUMBER];
+    }
+
     while (true)
     {
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+        profiler::set_state(profiler::IDLE);
+        metrics::inc(metrics::SYSCALL_EPOLL_WAIT);
+        /*没有事件时也每秒醒一次，关闭等客户端关闭等超时的连接*/
+        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, 1000);
+        profiler::set_state(profiler::REACTOR);
         if ((number < 0) && (errno != EINTR))
         {
             printf("epoll failure\n");
             break;
         }
+        if (dump_stats)
+        {
+            dump_stats = 0;
+            print_tlb_stats(load_misses, store_misses, requests);
+        }
 
+        memset(nready, 0, sizeof(nready));
+        long long now_us = metrics::now_us();
+        long long now = now_us / 1000;
+        if (number > 0)
+            metrics::observe(metrics::EPOLL_EVENTS, number);
         for (int i = 0; i < number; i++)
         {
             int sockfd = events[i].data.fd;
             if (sockfd == listenfd)
             {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr *)&client_address, &client_addrlength);
-                if (connfd < 0)
+                /*listenfd是边沿触发的，一次通知可能对应多个连接，要一直accept到EAGAIN，否则剩下的连接没人管*/
+                while (true)
                 {
-                    printf("errno is: %d\n", errno);
-                    continue;
+                    struct sockaddr_in client_address;
+                    char ip_text[INET_ADDRSTRLEN];
+                    socklen_t client_addrlength = sizeof(client_address);
+                    metrics::inc(metrics::SYSCALL_ACCEPT);
+                    int connfd = accept(listenfd, (struct sockaddr *)&client_address, &client_addrlength);
+                    if (connfd < 0)
+                    {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                            LOG_ERROR("accept failed: %s", strerror(errno));
+                        break;
+                    }
+                    if (connfd >= max_fd || http_conn::m_user_count >= max_fd)
+                    {
+                        show_error(connfd, "Internal server busy");
+                        continue;
+                    }
+                    /*在收到连接的NUMA节点上分配连接对象，初始化这个连接，将connfd加入到m_epollfd中*/
+                    int node = plan.enabled ? socket_node(connfd) : -1;
+                    http_conn *conn = conn_slab.alloc(node);
+                    if (!conn)
+                    {
+                        show_error(connfd, "Internal server busy");
+                        continue;
+                    }
+                    metrics::inc(metrics::ACCEPTED);
+                    LOG_DEBUG("accept fd %d from %s:%d", connfd,
+                              inet_ntop(AF_INET, &client_address.sin_addr, ip_text, sizeof(ip_text)), ntohs(client_address.sin_port));
+                    conn->m_node = node;
+                    conn->init(connfd, client_address);
+                    users[connfd] = conn;
                 }
-                if (http_conn::m_user_count >= MAX_FD)
-                {
-                    show_error(connfd, "Internal server busy");
-                    continue;
-                }
-                /*初始化这个连接。将connfd加入到m_epollfd中；初始化读写缓冲区，分配给这个connfd的*/
-                printf("Got connection from ip: %s , port: %d\n",inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
-                users[connfd].init(connfd, client_address, User, Passwd, Databasename);
+            }
+            else if (!users[sockfd])
+            {
+                continue;
             }
             else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
             {
-                /*如果有异常，直接关闭客户连接*/
-                users[sockfd].close_conn();
+                /*如果有异常（包括工作线程shutdown掉的连接），关闭客户连接并回收*/
+                release_conn(users, sockfd);
             }
             else if (events[i].events & EPOLLIN) /*有数据需要读*/
             {
                 /*根据读的结果，决定是将任务添加到线程池，还是关闭连接
                 将数据读入到了users[sockfd]的m_read_buf中
-                随后将这个任务 httpconn* request = users + sockfd 添加到工作队列中
+                随后将这个任务 httpconn* request = users[sockfd] 添加到工作队列中
                 依旧是主线程负责将数据读入到对应user[sockfd]的buff中，再交给子线程处理
                 子线程就是把buff中的数据（http请求）读出来进行处理，然后再返回相应的资源文件
                 */
-                if (users[sockfd].read())
+                http_conn *conn = users[sockfd];
+                conn->clear_close_deadline();
+                if (conn->read())
                 {
-                    /*users是一个指针+ sockfd偏移量，就是将users[sockfd]加入到线程池任务中*/
-                    pool->append(users + sockfd);
+                    ++requests;
+                    /*先记下users[sockfd]，本轮结束后成批加入线程池任务中
+                    只看请求行决定交给哪个隔舱*/
+                    int l = conn->lane();
+                    conn->m_enqueue_us = now_us;
+                    conn->m_trace.mark(request_trace::ENQUEUED);
+                    conn->m_deadline_ms = now + lanes[l].deadline_ms;
+#ifdef CORO_ENABLED
+                    if (db_ex[l])
+                    {
+                        /*协程一开始就切到协程线程上，这里立即返回*/
+                        conn->process_async(*coro_ex, *db_ex[l]);
+                        continue;
+                    }
+#endif
+                    ready_node[l][nready[l]] = conn->m_node;
+                    ready[l][nready[l]++] = conn;
                 }
                 else
                 {
-                    users[sockfd].close_conn();
+                    release_conn(users, sockfd);
                 }
             }
             /*是否可以进行写操作
             当文件描述符上的输出缓冲区变为可写时，会触发 EPOLLOUT 事件*/
             else if (events[i].events & EPOLLOUT)
             {
-                /*根据写的结果，决定是否关闭连接*/
-                if (!users[sockfd].write())  /*如果不保持连接，就关闭连接，否则维持连接*/
+                /*工作线程直接写没写完的，在这里接着写；写出错就关闭连接*/
+                if (!users[sockfd]->write())
                 {
-                    users[sockfd].close_conn();
+                    release_conn(users, sockfd);
                 }
             }
             else
             {}
         }
+        for (int l = 0; l < http_conn::LANE_COUNT; ++l)
+        {
+            if (nready[l] == 0)
+                continue;
+            /*隔舱的队列满了，放不进去的请求马上回503，让客户端稍后重试，也不挤占别的隔舱*/
+            int added = pools[l]->append_batch(ready[l], nready[l], ready_node[l]);
+            for (int k = added; k < nready[l]; ++k)
+            {
+                ready[l][k]->reject();
+            }
+        }
+        /*一轮事件处理的时间，也就是排在后面的就绪事件最多要等多久*/
+        if (number > 0)
+            metrics::observe(metrics::EVENT_LOOP, metrics::now_us() - now_us);
+
+        /*回完Connection: close后只关了写端的连接，客户端过了期限还不关的，不再让它占着fd和连接对象；
+        期间已经被关闭回收（users[fd]换了或者空了）、或者又来了请求的（期限被清除）跳过*/
+        int nexpired;
+        do
+        {
+            nexpired = http_conn::take_expired(now, expired, EXPIRED_BATCH);
+            for (int k = 0; k < nexpired; ++k)
+            {
+                int fd = expired[k].fd;
+                if (users[fd] == expired[k].conn && expired[k].conn->still_half_closed(expired[k].deadline_ms))
+                    release_conn(users, fd);
+            }
+        } while (nexpired == EXPIRED_BATCH);
     }
 
+    for (int l = 0; l < http_conn::LANE_COUNT; ++l)
+    {
+        delete[] ready[l];
+        delete[] ready_node[l];
+    }
     close(epollfd);
     close(listenfd);
-    delete[] users;
-    delete pool;
+    for (int fd = 0; fd < max_fd; ++fd)
+    {
+        if (users[fd])
+            release_conn(users, fd);
+    }
+    if (huge)
+        free_huge_on_node(users, users_bytes, users_kind);
+    else
+        delete[] users;
+    for (int l = 0; l < http_conn::LANE_COUNT; ++l)
+    {
+        delete pools[l];
+    }
+#ifdef CORO_ENABLED
+    for (int l = 0; l < http_conn::LANE_COUNT; ++l)
+    {
+        delete db_ex[l];
+        delete db_pools[l];
+    }
+    delete coro_ex;
+    delete coro_pool;
+#endif
+    delete store;
+    logger::stop();
     return 0;
 }
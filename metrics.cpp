@@ -0,0 +1,252 @@
+#include "metrics.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <new>
+#include <atomic>
+#include "arena.h"
+#include "cpu_affinity.h"
+
+/*一个线程的全部计数，只有这个线程写*/
+struct metrics_shard
+{
+    std::atomic<uint64_t> counters[metrics::COUNTER_COUNT];
+    std::atomic<uint64_t> buckets[metrics::HISTOGRAM_COUNT][metrics::BUCKETS];
+    std::atomic<uint64_t> sums[metrics::HISTOGRAM_COUNT];
+    metrics_shard *next;
+};
+
+/*同名的几项要挨着放*/
+struct counter_desc
+{
+    const char *name;
+    const char *labels;
+    const char *help;
+};
+
+/*同名的几项要挨着放，HELP/TYPE只输出一次*/
+struct histogram_desc
+{
+    const char *name;
+    const char *labels;
+    const char *help;
+    bool seconds;       /*记录的是微秒，输出成秒*/
+};
+
+struct gauge_desc
+{
+    const char *name;
+    const char *help;
+    const char *labels;
+    metrics::gauge_fn fn;
+    void *arg;
+};
+
+static const counter_desc counter_descs[metrics::COUNTER_COUNT] =
+{
+    {"http_connections_accepted_total", NULL, "Connections accepted by the main thread."},
+    {"http_rejected_total", NULL, "Requests answered with 503 because a queue was full or the deadline had passed."},
+    {"http_syscalls_total", "call=\"epoll_wait\"", "System calls made by the event loop and request handling (futex, storage and logger threads excluded)."},
+    {"http_syscalls_total", "call=\"epoll_ctl\"", "System calls made by the event loop and request handling (futex, storage and logger threads excluded)."},
+    {"http_syscalls_total", "call=\"accept\"", "System calls made by the event loop and request handling (futex, storage and logger threads excluded)."},
+    {"http_syscalls_total", "call=\"read\"", "System calls made by the event loop and request handling (futex, storage and logger threads excluded)."},
+    {"http_syscalls_total", "call=\"write\"", "System calls made by the event loop and request handling (futex, storage and logger threads excluded)."},
+    {"http_syscalls_total", "call=\"file\"", "System calls made by the event loop and request handling (futex, storage and logger threads excluded)."},
+};
+
+static const histogram_desc histogram_descs[metrics::HISTOGRAM_COUNT] =
+{
+    {"http_queue_wait_seconds", "lane=\"static\"", "Time a request waited in its worker pool queue.", true},
+    {"http_queue_wait_seconds", "lane=\"db-read\"", "Time a request waited in its worker pool queue.", true},
+    {"http_queue_wait_seconds", "lane=\"db-write\"", "Time a request waited in its worker pool queue.", true},
+    {"http_parse_seconds", NULL, "Time spent parsing a request in process_read().", true},
+    {"db_checkout_wait_seconds", NULL, "Time spent waiting for a free connection in GetConnection().", true},
+    {"storage_query_seconds", NULL, "Time spent in one storage backend call.", true},
+    {"http_response_bytes", NULL, "Response size, headers plus body.", false},
+    {"http_write_seconds", NULL, "Time from the response being ready until it was fully written.", true},
+    {"event_loop_iteration_seconds", NULL, "Time the main thread spent handling one batch of epoll_wait events.", true},
+    {"epoll_wait_events", NULL, "Events returned by one epoll_wait call.", false},
+};
+
+/*输出的上限：时间到2^26微秒（约67秒），字节数到1G*/
+static const uint64_t MAX_SECONDS_BUCKET = 1ULL << 26;
+static const uint64_t MAX_BYTES_BUCKET = 1ULL << 30;
+
+static const int MAX_GAUGES = 64;
+static gauge_desc gauges[MAX_GAUGES];
+static std::atomic<int> gauge_count(0);
+
+static std::atomic<metrics_shard *> shards(NULL);
+static __thread metrics_shard *t_shard = NULL;
+
+/*本线程的计数；第一次用时用mmap分配（已清零），不经过全局堆*/
+static metrics_shard *local_shard()
+{
+    metrics_shard *s = t_shard;
+    if (s)
+        return s;
+    void *mem = alloc_on_node(sizeof(metrics_shard), -1);
+    if (!mem)
+        return NULL;
+    s = new (mem) metrics_shard();
+    s->next = shards.load();
+    while (!shards.compare_exchange_weak(s->next, s))
+    {
+    }
+    t_shard = s;
+    return s;
+}
+
+/*只有本线程写，不需要原子的加法*/
+static inline void bump(std::atomic<uint64_t> &a, uint64_t n)
+{
+    a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/*桶按上界包含：v落在 bucket_of(v - 1)，每个桶是 (上一个桶的上界, 本桶上界]，和Prometheus的le（小于等于）一致*/
+static int bucket_of(uint64_t v)
+{
+    v = v ? v - 1 : 0;
+    if (v < 8)
+        return v;
+    int e = 63 - __builtin_clzll(v);
+    int index = 8 + (e - 3) * 4 + ((v >> (e - 2)) & 3);
+    return index < metrics::BUCKETS ? index : metrics::BUCKETS - 1;
+}
+
+/*桶的上界（包含）*/
+static uint64_t bucket_upper(int index)
+{
+    if (index < 8)
+        return index + 1;
+    int e = (index - 8) / 4 + 3;
+    int sub = (index - 8) % 4;
+    return (uint64_t)(4 + sub + 1) << (e - 2);
+}
+
+/*只在2^k和3*2^k处输出le，每个2的幂区间两行*/
+static bool emit_bound(uint64_t u)
+{
+    if ((u & (u - 1)) == 0)
+        return true;
+    return u % 3 == 0 && ((u / 3) & (u / 3 - 1)) == 0;
+}
+
+void metrics::inc(int counter, uint64_t n)
+{
+    metrics_shard *s = local_shard();
+    if (s)
+        bump(s->counters[counter], n);
+}
+
+void metrics::observe(int histogram, uint64_t value)
+{
+    metrics_shard *s = local_shard();
+    if (!s)
+        return;
+    bump(s->buckets[histogram][bucket_of(value)], 1);
+    bump(s->sums[histogram], value);
+}
+
+bool metrics::add_gauge(const char *name, const char *help, const char *labels, gauge_fn fn, void *arg)
+{
+    int n = gauge_count.load();
+    if (n >= MAX_GAUGES)
+        return false;
+    gauge_desc &g = gauges[n];
+    g.name = name;
+    g.help = help;
+    g.labels = labels;
+    g.fn = fn;
+    g.arg = arg;
+    gauge_count.store(n + 1, std::memory_order_release);
+    return true;
+}
+
+static bool put(arena_string &out, const char *format, ...)
+{
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len < 0 || len >= (int)sizeof(line))
+        return false;
+    return out.append(line, len);
+}
+
+static void put_header(arena_string &out, const char *name, const char *help, const char *type)
+{
+    put(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+bool metrics::render(arena_string &out)
+{
+    metrics_shard *head = shards.load();
+
+    for (int c = 0; c < COUNTER_COUNT; ++c)
+    {
+        uint64_t total = 0;
+        for (metrics_shard *s = head; s; s = s->next)
+            total += s->counters[c].load(std::memory_order_relaxed);
+        const counter_desc &d = counter_descs[c];
+        if (c == 0 || strcmp(counter_descs[c - 1].name, d.name) != 0)
+            put_header(out, d.name, d.help, "counter");
+        if (d.labels)
+            put(out, "%s{%s} %llu\n", d.name, d.labels, (unsigned long long)total);
+        else
+            put(out, "%s %llu\n", d.name, (unsigned long long)total);
+    }
+
+    int n = gauge_count.load(std::memory_order_acquire);
+    for (int i = 0; i < n; ++i)
+    {
+        const gauge_desc &g = gauges[i];
+        if (i == 0 || strcmp(gauges[i - 1].name, g.name) != 0)
+            put_header(out, g.name, g.help, "gauge");
+        if (g.labels)
+            put(out, "%s{%s} %.17g\n", g.name, g.labels, g.fn(g.arg));
+        else
+            put(out, "%s %.17g\n", g.name, g.fn(g.arg));
+    }
+
+    for (int h = 0; h < HISTOGRAM_COUNT; ++h)
+    {
+        const histogram_desc &d = histogram_descs[h];
+        uint64_t merged[BUCKETS] = {0};
+        uint64_t sum = 0;
+        for (metrics_shard *s = head; s; s = s->next)
+        {
+            for (int b = 0; b < BUCKETS; ++b)
+                merged[b] += s->buckets[h][b].load(std::memory_order_relaxed);
+            sum += s->sums[h].load(std::memory_order_relaxed);
+        }
+        if (h == 0 || strcmp(histogram_descs[h - 1].name, d.name) != 0)
+            put_header(out, d.name, d.help, "histogram");
+
+        const char *sep = d.labels ? "," : "";
+        const char *labels = d.labels ? d.labels : "";
+        uint64_t limit = d.seconds ? MAX_SECONDS_BUCKET : MAX_BYTES_BUCKET;
+        uint64_t count = 0;
+        for (int b = 0; b < BUCKETS; ++b)
+        {
+            count += merged[b];
+            uint64_t upper = bucket_upper(b);
+            if (upper > limit || !emit_bound(upper))
+                continue;
+            if (d.seconds)
+                put(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", d.name, labels, sep, upper / 1e6, (unsigned long long)count);
+            else
+                put(out, "%s_bucket{%s%sle=\"%llu\"} %llu\n", d.name, labels, sep, (unsigned long long)upper, (unsigned long long)count);
+        }
+        put(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", d.name, labels, sep, (unsigned long long)count);
+        const char *lbrace = d.labels ? "{" : "";
+        const char *rbrace = d.labels ? "}" : "";
+        if (d.seconds)
+            put(out, "%s_sum%s%s%s %.6f\n", d.name, lbrace, labels, rbrace, sum / 1e6);
+        else
+            put(out, "%s_sum%s%s%s %llu\n", d.name, lbrace, labels, rbrace, (unsigned long long)sum);
+        put(out, "%s_count%s%s%s %llu\n", d.name, lbrace, labels, rbrace, (unsigned long long)count);
+    }
+    return !out.failed();
+}
@@ -0,0 +1,78 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/*
+服务器内部指标，由 GET /metrics 以Prometheus文本格式输出
+每个线程有自己的一份计数器和直方图（第一次记录时分配），记录时只改自己那份，是几次relaxed原子读写，不加锁；
+抓取时才把所有线程的数据加在一起
+直方图按HDR的方式分桶：每个2的幂区间再等分成4份，相对误差不超过25%；时间以微秒记录，输出时换算成秒
+连接数、队列长度这类当前值不用记录，启动时用add_gauge()注册一个取值函数，抓取时调用
+*/
+
+#include <stdint.h>
+#include <time.h>
+
+class arena_string;
+
+class metrics
+{
+public:
+    enum COUNTER
+    {
+        ACCEPTED = 0,       /*accept到的连接数*/
+        REJECTED,           /*过载回503的请求数*/
+        SYSCALL_EPOLL_WAIT, /*主线程和请求处理路径上的系统调用次数，按调用分开（futex、存储和日志线程的不算）*/
+        SYSCALL_EPOLL_CTL,
+        SYSCALL_ACCEPT,
+        SYSCALL_READ,
+        SYSCALL_WRITE,
+        SYSCALL_FILE,       /*静态文件的stat/open/mmap/close/munmap*/
+        COUNTER_COUNT
+    };
+    enum HISTOGRAM
+    {
+        QUEUE_WAIT = 0,     /*在线程池队列里等待的时间，按隔舱分三个，顺序同http_conn::LANE*/
+        QUEUE_WAIT_DB_READ,
+        QUEUE_WAIT_DB_WRITE,
+        PARSE,              /*process_read()解析请求的时间*/
+        DB_CHECKOUT,        /*connection_pool::GetConnection()等待空闲连接的时间*/
+        QUERY,              /*存储后端执行一次查询/写入的时间*/
+        RESPONSE_BYTES,     /*应答的字节数（头部+内容）*/
+        WRITE,              /*从应答准备好到全部写完的时间*/
+        EVENT_LOOP,         /*主线程处理一轮epoll_wait返回的事件的时间*/
+        EPOLL_EVENTS,       /*一次epoll_wait返回的事件数*/
+        HISTOGRAM_COUNT
+    };
+    /*直方图的桶数：值小于8时每个值一个桶，之后每个2的幂区间4个桶，最大到2^40*/
+    static const int BUCKETS = 160;
+
+    typedef double (*gauge_fn)(void *arg);
+
+    static void inc(int counter, uint64_t n = 1);
+    static void observe(int histogram, uint64_t value);
+    static long long now_us()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    }
+
+    /*注册一个当前值，labels形如 lane="static"，可以为NULL；字符串要一直有效；启动时在主线程里调用*/
+    static bool add_gauge(const char *name, const char *help, const char *labels, gauge_fn fn, void *arg);
+    /*把所有指标按Prometheus文本格式写到out，内存不足时返回false*/
+    static bool render(arena_string &out);
+};
+
+/*作用域计时，析构时记录到直方图*/
+class metric_timer
+{
+public:
+    explicit metric_timer(int histogram) : m_histogram(histogram), m_start(metrics::now_us()) {}
+    ~metric_timer() { metrics::observe(m_histogram, metrics::now_us() - m_start); }
+
+private:
+    int m_histogram;
+    long long m_start;
+};
+
+#endif
@@ -0,0 +1,179 @@
+#include <mysql/mysql.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mysql_storage.h"
+#include "metrics.h"
+#include "log.h"
+#include "trace.h"
+#include "profiler.h"
+
+mysql_storage::mysql_storage(connection_pool *connPool) : m_connPool(connPool)
+{
+}
+
+bool mysql_storage::query_user(const char *name, char *passwd, int len, connection_pool::ROLE role, time_t last_write)
+{
+    profile_state db_wait(profiler::DB_WAIT);
+    MYSQL *mysql = NULL;
+    connectionRAII mysqlcon(&mysql, m_connPool, role, last_write);
+    if (!mysql)
+        return false;
+    /*只计执行时间，等待空闲连接的时间另外统计*/
+    metric_timer timer(metrics::QUERY);
+    trace_db_call traced;
+
+    char escaped[2 * 100 + 1];
+    int name_len = strlen(name);
+    if (name_len >= 100)
+        return false;
+    mysql_real_escape_string(mysql, escaped, name, name_len);
+    char sql_query[300];
+    snprintf(sql_query, sizeof(sql_query), "SELECT passwd FROM user WHERE username = '%s'", escaped);
+
+    if (mysql_query(mysql, sql_query))
+        return false;
+    MYSQL_RES *result = mysql_store_result(mysql);
+    if (!result)
+        return false;
+
+    bool found = false;
+    MYSQL_ROW row = mysql_fetch_row(result);
+    if (row && row[0])
+    {
+        if (passwd)
+        {
+            strncpy(passwd, row[0], len);
+            passwd[len - 1] = '\0';
+        }
+        found = true;
+    }
+    mysql_free_result(result);
+    return found;
+}
+
+bool mysql_storage::get_user(const char *name, char *passwd, int len, time_t last_write)
+{
+    return query_user(name, passwd, len, connection_pool::READ, last_write);
+}
+
+/*注册查重必须看到最新数据，所以走主库*/
+bool mysql_storage::has_user(const char *name)
+{
+    return query_user(name, NULL, 0, connection_pool::WRITE, 0);
+}
+
+bool mysql_storage::add_user(const char *name, const char *passwd)
+{
+    profile_state db_wait(profiler::DB_WAIT);
+    MYSQL *mysql = NULL;
+    connectionRAII mysqlcon(&mysql, m_connPool, connection_pool::WRITE);
+    if (!mysql)
+        return false;
+    metric_timer timer(metrics::QUERY);
+    trace_db_call traced;
+
+    char e_name[2 * 100 + 1], e_passwd[2 * 100 + 1];
+    if (strlen(name) >= 100 || strlen(passwd) >= 100)
+        return false;
+    mysql_real_escape_string(mysql, e_name, name, strlen(name));
+    mysql_real_escape_string(mysql, e_passwd, passwd, strlen(passwd));
+    char sql_insert[500];
+    snprintf(sql_insert, sizeof(sql_insert), "INSERT INTO user(username, passwd) VALUES('%s', '%s')", e_name, e_passwd);
+    return mysql_query(mysql, sql_insert) == 0;
+}
+
+bool mysql_storage::add_info(const char *user, const char *content)
+{
+    profile_state db_wait(profiler::DB_WAIT);
+    MYSQL *mysql = NULL;
+    connectionRAII mysqlcon(&mysql, m_connPool, connection_pool::WRITE);
+    if (!mysql)
+        return false;
+    metric_timer timer(metrics::QUERY);
+    trace_db_call traced;
+
+    char e_user[2 * 100 + 1], e_content[2 * 100 + 1];
+    if (strlen(user) >= 100 || strlen(content) >= 100)
+        return false;
+    mysql_real_escape_string(mysql, e_user, user, strlen(user));
+    mysql_real_escape_string(mysql, e_content, content, strlen(content));
+    char sql_insert[500];
+    snprintf(sql_insert, sizeof(sql_insert), "INSERT INTO info(user, content) VALUES('%s', '%s')", e_user, e_content);
+    return mysql_query(mysql, sql_insert) == 0;
+}
+
+/*流式读取，每行直接交给fn，不复制结果集*/
+bool mysql_storage::scan_info(void (*fn)(const char *user, const char *content, void *arg), void *arg, time_t last_write)
+{
+    profile_state db_wait(profiler::DB_WAIT);
+    MYSQL *mysql = NULL;
+    /*只读查询，分发到从库；刚写过的会话在窗口内仍读主库*/
+    connectionRAII mysqlcon(&mysql, m_connPool, connection_pool::READ, last_write);
+    if (!mysql)
+        return false;
+    metric_timer timer(metrics::QUERY);
+    trace_db_call traced;
+
+    if (mysql_query(mysql, "SELECT* from info"))
+        return false;
+    MYSQL_RES *result = mysql_use_result(mysql);
+    if (!result)
+        return false;
+
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(result)))  /*提取每一行的结果*/
+        fn(row[0] ? row[0] : "", row[1] ? row[1] : "", arg);
+    mysql_free_result(result);
+    return true;
+}
+
+/*流式读取，不在内存中保存整个结果集*/
+bool mysql_storage::scan_users(void (*fn)(const char *name, void *arg), void *arg)
+{
+    MYSQL *mysql = NULL;
+    connectionRAII mysqlcon(&mysql, m_connPool, connection_pool::READ);
+    if (!mysql)
+        return false;
+
+    if (mysql_query(mysql, "SELECT username FROM user"))
+    {
+        LOG_ERROR("SELECT error:%s", mysql_error(mysql));
+        return false;
+    }
+    MYSQL_RES *result = mysql_use_result(mysql);
+    if (!result)
+        return false;
+
+    while (MYSQL_ROW row = mysql_fetch_row(result))
+    {
+        if (row[0])
+            fn(row[0], arg);
+    }
+    mysql_free_result(result);
+    return true;
+}
+
+/*information_schema中的行数是估计值，不需要扫表*/
+long mysql_storage::estimate_users()
+{
+    MYSQL *mysql = NULL;
+    connectionRAII mysqlcon(&mysql, m_connPool, connection_pool::READ);
+    if (!mysql)
+        return 0;
+
+    long n = 0;
+    if (!mysql_query(mysql, "SELECT TABLE_ROWS FROM information_schema.TABLES "
+                            "WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = 'user'"))
+    {
+        MYSQL_RES *result = mysql_store_result(mysql);
+        if (result)
+        {
+            MYSQL_ROW row = mysql_fetch_row(result);
+            if (row && row[0])
+                n = atol(row[0]);
+            mysql_free_result(result);
+        }
+    }
+    return n;
+}
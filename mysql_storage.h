@@ -0,0 +1,29 @@
+#ifndef MYSQL_STORAGE_H
+#define MYSQL_STORAGE_H
+
+#include "storage.h"
+#include "sql_connection_pool.h"
+
+/*基于MySQL连接池的存储：写走主库，读按connection_pool的规则分发到从库*/
+class mysql_storage : public storage
+{
+public:
+    mysql_storage(connection_pool *connPool);
+
+    bool get_user(const char *name, char *passwd, int len, time_t last_write = 0);
+    bool has_user(const char *name);
+    bool add_user(const char *name, const char *passwd);
+    bool add_info(const char *user, const char *content);
+    bool scan_info(void (*fn)(const char *user, const char *content, void *arg), void *arg, time_t last_write = 0);
+    bool scan_users(void (*fn)(const char *name, void *arg), void *arg);
+    long estimate_users();
+
+private:
+    /*查询一个用户，passwd为NULL时只判断是否存在*/
+    bool query_user(const char *name, char *passwd, int len, connection_pool::ROLE role, time_t last_write);
+
+private:
+    connection_pool *m_connPool;
+};
+
+#endif
@@ -0,0 +1,486 @@
+#include "profiler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <limits.h>
+#include <link.h>
+#include <elf.h>
+#include <ucontext.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <cxxabi.h>
+#include <algorithm>
+#include <atomic>
+#include "arena.h"
+#include "log.h"
+
+/*老版本glibc的sigevent没有这个名字*/
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+__thread volatile sig_atomic_t profiler::t_state = profiler::IDLE;
+
+/*一次采样最多保留的样本数，每个样本约280字节，只有写到的页才占内存*/
+static const long MAX_SAMPLES = 1 << 18;
+
+static const char *state_names[profiler::STATE_COUNT] = {"idle", "reactor", "worker", "db_wait"};
+
+struct profile_sample
+{
+    std::atomic<int> ready;     /*信号处理函数写完后置1*/
+    int state;
+    int depth;
+    uintptr_t pcs[profiler::MAX_DEPTH];    /*pcs[0]是被打断的位置，之后是各层的返回地址*/
+};
+
+struct profile_buffer
+{
+    profile_sample *samples;
+    long capacity;
+    std::atomic<long> next;
+    std::atomic<long> dropped;
+};
+
+/*登记的线程；tid为0的还没登记完*/
+static std::atomic<pid_t> thread_ids[profiler::MAX_THREADS];
+static std::atomic<int> thread_count(0);
+/*本线程栈的范围，回溯时帧指针超出它就停下，不会读到没映射的内存*/
+static __thread uintptr_t t_stack_lo = 0;
+static __thread uintptr_t t_stack_hi = 0;
+
+static std::atomic<profile_buffer *> active(NULL);
+/*正在执行的信号处理函数个数，采样结束后等它归零才能读样本、释放缓冲区*/
+static std::atomic<int> in_handler(0);
+static std::atomic<bool> running(false);
+static pthread_once_t handler_once = PTHREAD_ONCE_INIT;
+
+void profiler::register_thread(int state)
+{
+    t_state = state;
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0)
+    {
+        void *addr = NULL;
+        size_t size = 0;
+        if (pthread_attr_getstack(&attr, &addr, &size) == 0)
+        {
+            t_stack_lo = (uintptr_t)addr;
+            t_stack_hi = (uintptr_t)addr + size;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    int n = thread_count.fetch_add(1);
+    if (n < MAX_THREADS)
+        thread_ids[n].store(syscall(SYS_gettid), std::memory_order_release);
+}
+
+/*顺着帧指针回溯：[fp]是上一层的fp，[fp+8]是返回地址；只在本线程的栈里走，而且必须一直往高地址走*/
+static int walk_stack(void *context, uintptr_t *pcs)
+{
+    ucontext_t *uc = (ucontext_t *)context;
+    uintptr_t pc, fp;
+#if defined(__x86_64__)
+    pc = uc->uc_mcontext.gregs[REG_RIP];
+    fp = uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+    pc = uc->uc_mcontext.pc;
+    fp = uc->uc_mcontext.regs[29];
+#else
+    (void)uc;
+    return 0;
+#endif
+    int depth = 0;
+    pcs[depth++] = pc;
+    while (depth < profiler::MAX_DEPTH && fp >= t_stack_lo && fp + 2 * sizeof(uintptr_t) <= t_stack_hi &&
+           fp % sizeof(uintptr_t) == 0)
+    {
+        uintptr_t *frame = (uintptr_t *)fp;
+        if (!frame[1])
+            break;
+        pcs[depth++] = frame[1];
+        if (frame[0] <= fp)
+            break;
+        fp = frame[0];
+    }
+    return depth;
+}
+
+/*只用无锁的原子操作，不分配内存，可以在任何地方被打断*/
+static void on_sigprof(int, siginfo_t *, void *context)
+{
+    int saved_errno = errno;
+    in_handler.fetch_add(1);
+    profile_buffer *b = active.load();
+    if (b && t_stack_hi)
+    {
+        long n = b->next.fetch_add(1, std::memory_order_relaxed);
+        if (n < b->capacity)
+        {
+            profile_sample &s = b->samples[n];
+            s.state = profiler::state();
+            s.depth = walk_stack(context, s.pcs);
+            s.ready.store(1, std::memory_order_release);
+        }
+        else
+        {
+            b->dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    in_handler.fetch_sub(1);
+    errno = saved_errno;
+}
+
+/*信号处理函数装上就不再卸下：定时器删掉之后可能还有没递送的SIGPROF，默认动作是终止进程*/
+static void install_handler()
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = on_sigprof;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+}
+
+/*同glibc的pthread_getcpuclockid：内核把线程的CPU时钟编码成 ~tid<<3 | CPUCLOCK_PERTHREAD_MASK | CPUCLOCK_SCHED
+直接用tid，不需要拿到那个线程的pthread_t*/
+static clockid_t thread_cpu_clock(pid_t tid)
+{
+    return ((~(clockid_t)tid) << 3) | 4 | 2;
+}
+
+/*--- 符号解析：读各个已加载对象的ELF符号表（没有.symtab的用.dynsym），不需要-rdynamic ---*/
+
+struct elf_symbol
+{
+    uintptr_t addr;     /*相对加载偏移*/
+    uintptr_t size;
+    const char *name;
+};
+
+struct elf_module
+{
+    uintptr_t base;     /*加载偏移，非PIE的可执行文件是0*/
+    uintptr_t lo, hi;   /*可执行段的地址范围*/
+    char path[PATH_MAX];
+    bool loaded;
+    void *map;
+    size_t map_len;
+    elf_symbol *symbols;
+    size_t count;
+};
+
+static const int MAX_MODULES = 256;
+
+struct symbolizer
+{
+    elf_module modules[MAX_MODULES];
+    int count;
+};
+
+static int collect_module(struct dl_phdr_info *info, size_t, void *arg)
+{
+    symbolizer *sym = (symbolizer *)arg;
+    for (int i = 0; i < info->dlpi_phnum && sym->count < MAX_MODULES; ++i)
+    {
+        const ElfW(Phdr) &ph = info->dlpi_phdr[i];
+        if (ph.p_type != PT_LOAD || !(ph.p_flags & PF_X))
+            continue;
+        elf_module &m = sym->modules[sym->count++];
+        memset(&m, 0, sizeof(m));
+        m.base = info->dlpi_addr;
+        m.lo = info->dlpi_addr + ph.p_vaddr;
+        m.hi = m.lo + ph.p_memsz;
+        /*主程序的名字是空串*/
+        snprintf(m.path, sizeof(m.path), "%s", info->dlpi_name[0] ? info->dlpi_name : "/proc/self/exe");
+    }
+    return 0;
+}
+
+static int compare_symbol(const void *a, const void *b)
+{
+    uintptr_t x = ((const elf_symbol *)a)->addr, y = ((const elf_symbol *)b)->addr;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/*文件整个映射进来，符号名直接指向映射里的字符串表*/
+static void load_symbols(elf_module &m)
+{
+    m.loaded = true;
+    int fd = open(m.path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ElfW(Ehdr)))
+    {
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+    m.map = map;
+    m.map_len = st.st_size;
+
+    const char *base = (const char *)map;
+    const ElfW(Ehdr) *eh = (const ElfW(Ehdr) *)base;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_shentsize != sizeof(ElfW(Shdr)) ||
+        eh->e_shoff + (size_t)eh->e_shnum * sizeof(ElfW(Shdr)) > m.map_len)
+        return;
+    const ElfW(Shdr) *sh = (const ElfW(Shdr) *)(base + eh->e_shoff);
+    const ElfW(Shdr) *table = NULL;
+    for (int i = 0; i < eh->e_shnum; ++i)
+    {
+        if (sh[i].sh_type == SHT_SYMTAB)
+            table = &sh[i];
+        else if (sh[i].sh_type == SHT_DYNSYM && !table)
+            table = &sh[i];
+    }
+    if (!table || table->sh_link >= eh->e_shnum || table->sh_offset + table->sh_size > m.map_len)
+        return;
+    const ElfW(Shdr) &strtab = sh[table->sh_link];
+    if (strtab.sh_offset + strtab.sh_size > m.map_len)
+        return;
+
+    const ElfW(Sym) *syms = (const ElfW(Sym) *)(base + table->sh_offset);
+    size_t n = table->sh_size / sizeof(ElfW(Sym));
+    m.symbols = (elf_symbol *)malloc(n * sizeof(elf_symbol));
+    if (!m.symbols)
+        return;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if ((syms[i].st_info & 0xf) != STT_FUNC || syms[i].st_shndx == SHN_UNDEF || !syms[i].st_value ||
+            syms[i].st_name >= strtab.sh_size)
+            continue;
+        elf_symbol &e = m.symbols[m.count++];
+        e.addr = syms[i].st_value;
+        e.size = syms[i].st_size;
+        e.name = base + strtab.sh_offset + syms[i].st_name;
+    }
+    qsort(m.symbols, m.count, sizeof(elf_symbol), compare_symbol);
+}
+
+static void free_symbolizer(symbolizer *sym)
+{
+    for (int i = 0; i < sym->count; ++i)
+    {
+        free(sym->modules[i].symbols);
+        if (sym->modules[i].map)
+            munmap(sym->modules[i].map, sym->modules[i].map_len);
+    }
+    munmap(sym, sizeof(symbolizer));
+}
+
+/*一帧的名字追加到out：能找到符号的输出还原后的函数名，否则输出 文件名+偏移，可以再交给addr2line*/
+static void append_frame(arena_string &out, symbolizer *sym, uintptr_t pc)
+{
+    elf_module *m = NULL;
+    for (int i = 0; i < sym->count; ++i)
+    {
+        if (pc >= sym->modules[i].lo && pc < sym->modules[i].hi)
+        {
+            m = &sym->modules[i];
+            break;
+        }
+    }
+    if (!m)
+    {
+        char text[32];
+        snprintf(text, sizeof(text), "0x%lx", (unsigned long)pc);
+        out.append(text);
+        return;
+    }
+    if (!m->loaded)
+        load_symbols(*m);
+
+    uintptr_t rel = pc - m->base;
+    const elf_symbol *found = NULL;
+    size_t lo = 0, hi = m->count;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (m->symbols[mid].addr <= rel)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 0)
+    {
+        const elf_symbol &s = m->symbols[lo - 1];
+        if (!s.size || rel < s.addr + s.size)
+            found = &s;
+    }
+    if (!found)
+    {
+        const char *name = strrchr(m->path, '/');
+        char text[PATH_MAX + 32];
+        snprintf(text, sizeof(text), "%s+0x%lx", name ? name + 1 : m->path, (unsigned long)rel);
+        out.append(text);
+        return;
+    }
+    int status = 0;
+    char *demangled = abi::__cxa_demangle(found->name, NULL, NULL, &status);
+    const char *name = status == 0 && demangled ? demangled : found->name;
+    /*folded格式用分号分隔各帧*/
+    for (const char *p = name; *p; ++p)
+        out.append(*p == ';' ? ":" : p, 1);
+    free(demangled);
+}
+
+static int compare_stack(const void *a, const void *b)
+{
+    const profile_sample *x = *(const profile_sample *const *)a;
+    const profile_sample *y = *(const profile_sample *const *)b;
+    if (x->state != y->state)
+        return x->state - y->state;
+    if (x->depth != y->depth)
+        return x->depth - y->depth;
+    for (int i = 0; i < x->depth; ++i)
+    {
+        if (x->pcs[i] != y->pcs[i])
+            return x->pcs[i] < y->pcs[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+/*相同的栈排到一起数出次数，每种栈一行：状态;最外层;...;最内层 次数*/
+static bool render_folded(profile_buffer &b, arena_string &out)
+{
+    long n = std::min(b.next.load(), b.capacity);
+    const profile_sample **order = (const profile_sample **)malloc((n ? n : 1) * sizeof(profile_sample *));
+    void *mem = mmap(NULL, sizeof(symbolizer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!order || mem == MAP_FAILED)
+    {
+        free(order);
+        if (mem != MAP_FAILED)
+            munmap(mem, sizeof(symbolizer));
+        return false;
+    }
+    symbolizer *sym = (symbolizer *)mem;
+    dl_iterate_phdr(collect_module, sym);
+
+    long count = 0;
+    for (long i = 0; i < n; ++i)
+    {
+        if (b.samples[i].ready.load(std::memory_order_acquire))
+            order[count++] = &b.samples[i];
+    }
+    qsort(order, count, sizeof(profile_sample *), compare_stack);
+    for (long i = 0; i < count;)
+    {
+        long j = i + 1;
+        while (j < count && compare_stack(&order[i], &order[j]) == 0)
+            ++j;
+        const profile_sample &s = *order[i];
+        out.append(s.state >= 0 && s.state < profiler::STATE_COUNT ? state_names[s.state] : "unknown");
+        for (int d = s.depth - 1; d >= 0; --d)
+        {
+            out.append(";");
+            /*返回地址指向call的下一条指令，减1才落在调用者的函数里*/
+            append_frame(out, sym, d == 0 ? s.pcs[d] : s.pcs[d] - 1);
+        }
+        char tail[32];
+        snprintf(tail, sizeof(tail), " %ld\n", j - i);
+        out.append(tail);
+        i = j;
+    }
+    LOG_INFO("profile: %ld samples, %ld dropped", count, b.dropped.load());
+    free(order);
+    free_symbolizer(sym);
+    return !out.failed();
+}
+
+bool profiler::run(int seconds, int hz, int mode, arena_string &out)
+{
+    bool expected = false;
+    if (!running.compare_exchange_strong(expected, true))
+        return false;
+    seconds = std::min(std::max(seconds, 1), 60);
+    hz = std::min(std::max(hz, 1), 1000);
+    pthread_once(&handler_once, install_handler);
+
+    int threads = std::min(thread_count.load(), (int)MAX_THREADS);
+    long capacity = std::min((long)seconds * hz * threads + 1024, MAX_SAMPLES);
+    size_t bytes = capacity * sizeof(profile_sample);
+    void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        running.store(false);
+        return false;
+    }
+    profile_buffer b;
+    b.samples = (profile_sample *)mem;
+    b.capacity = capacity;
+    b.next.store(0);
+    b.dropped.store(0);
+    active.store(&b);
+
+    /*每个线程一个定时器，第一次到期的时间错开，墙上时间模式下各线程不会同时被打断*/
+    timer_t timers[MAX_THREADS];
+    bool armed[MAX_THREADS];
+    long interval_ns = 1000000000L / hz;
+    int started = 0;
+    for (int i = 0; i < threads; ++i)
+    {
+        armed[i] = false;
+        pid_t tid = thread_ids[i].load(std::memory_order_acquire);
+        if (!tid)
+            continue;
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = SIGPROF;
+        sev.sigev_notify_thread_id = tid;
+        clockid_t clock = mode == WALL ? CLOCK_MONOTONIC : thread_cpu_clock(tid);
+        if (timer_create(clock, &sev, &timers[i]) != 0)
+            continue;
+        long first = interval_ns / threads * i + 1;
+        struct itimerspec its;
+        its.it_interval.tv_sec = interval_ns / 1000000000L;
+        its.it_interval.tv_nsec = interval_ns % 1000000000L;
+        its.it_value.tv_sec = first / 1000000000L;
+        its.it_value.tv_nsec = first % 1000000000L;
+        if (timer_settime(timers[i], 0, &its, NULL) != 0)
+        {
+            timer_delete(timers[i]);
+            continue;
+        }
+        armed[i] = true;
+        ++started;
+    }
+
+    bool ok = started > 0;
+    if (ok)
+    {
+        /*本线程也登记过的话，睡眠期间的样本算idle；墙上时间模式下睡眠会被信号打断，按绝对时间接着睡*/
+        profile_state sleeping(IDLE);
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec += seconds;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+        {
+        }
+    }
+    for (int i = 0; i < threads; ++i)
+    {
+        if (armed[i])
+            timer_delete(timers[i]);
+    }
+    active.store(NULL);
+    while (in_handler.load() != 0)
+        sched_yield();
+
+    if (ok)
+        ok = render_folded(b, out);
+    munmap(mem, bytes);
+    running.store(false);
+    return ok;
+}
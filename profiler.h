@@ -0,0 +1,61 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+/*
+进程内的采样profiler：不能挂perf的时候，用 GET /profile?seconds=N 在线上直接采样
+每个登记过的线程一个timer_create定时器，到期时给这个线程发SIGPROF；信号处理函数顺着帧指针回溯调用栈，
+写进预先分配好的样本数组（原子地占一个位置，不加锁，不分配内存）
+采样结束后把相同的栈合并计数，按ELF符号表解析成函数名，输出folded格式（flamegraph.pl、speedscope可以直接用）：
+    状态;最外层函数;...;最内层函数 次数
+每个样本带着线程当时的状态：reactor（主线程）、worker（工作线程）、db_wait（在存储调用里，含等待连接）、idle（等事件/等任务）
+mode=cpu（默认）按线程的CPU时间计时，只采到正在运行的线程；mode=wall按墙上时间计时，阻塞中的线程也会被采到，
+可以看出时间耗在等数据库还是等锁上（信号会让阻塞的系统调用提前返回EINTR，这里用到的等待都会重试）
+回溯依赖帧指针，编译时加 -fno-omit-frame-pointer 才有完整的栈，否则只有最内层的函数
+*/
+
+#include <stdint.h>
+#include <signal.h>
+
+class arena_string;
+
+class profiler
+{
+public:
+    enum STATE { IDLE = 0, REACTOR, WORKER, DB_WAIT, STATE_COUNT };
+    enum MODE { CPU = 0, WALL };
+    /*每个样本最多记录的栈帧数*/
+    static const int MAX_DEPTH = 32;
+    /*最多登记的线程数*/
+    static const int MAX_THREADS = 256;
+
+    /*当前线程参与采样，线程开始时调用一次；state是它平时的状态*/
+    static void register_thread(int state);
+    /*设置当前线程的状态，返回原来的状态；信号处理函数读它*/
+    static int set_state(int state)
+    {
+        int old = t_state;
+        t_state = state;
+        return old;
+    }
+    static int state() { return t_state; }
+
+    /*采样seconds秒，每个线程每秒hz次，阻塞调用者直到结束，结果按folded格式写到out
+    同一时刻只能有一次采样；已经有采样在进行、建不了定时器或者内存不足时返回false*/
+    static bool run(int seconds, int hz, int mode, arena_string &out);
+
+private:
+    static __thread volatile sig_atomic_t t_state;
+};
+
+/*作用域内切换当前线程的状态，析构时恢复*/
+class profile_state
+{
+public:
+    explicit profile_state(int state) : m_old(profiler::set_state(state)) {}
+    ~profile_state() { profiler::set_state(m_old); }
+
+private:
+    int m_old;
+};
+
+#endif
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/random.h>
+#include "session_store.h"
+
+session_store::session_store(int shards, int ttl) : m_ttl(ttl)
+{
+    int n = 1;
+    while (n < shards)
+        n <<= 1;
+    m_shard_mask = n - 1;
+    m_shards = new shard[n];
+    for (int i = 0; i < n; ++i)
+        m_shards[i].inserts = 0;
+}
+
+session_store::~session_store()
+{
+    delete[] m_shards;
+}
+
+time_t session_store::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/*令牌本身就是随机数，直接取前几个十六进制字符选分片；
+不能只取低4位：'a'..'f'的低4位是1..6，和'1'..'6'撞在一起，分片会不均匀*/
+session_store::shard &session_store::shard_of(const char *token)
+{
+    unsigned int h = 0;
+    for (int i = 0; i < 8 && token[i]; ++i)
+    {
+        char c = token[i];
+        unsigned int digit = c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+        h = h * 16 + (digit & 0x0f);
+    }
+    return m_shards[h & m_shard_mask];
+}
+
+void session_store::sweep(shard &s, time_t t)
+{
+    std::unordered_map<std::string, session>::iterator it = s.table.begin();
+    while (it != s.table.end())
+    {
+        if (it->second.expire <= t)
+            it = s.table.erase(it);
+        else
+            ++it;
+    }
+}
+
+bool session_store::create(const char *name, char *token, time_t last_write)
+{
+    unsigned char rnd[TOKEN_LEN / 2];
+    if (getrandom(rnd, sizeof(rnd), 0) != (ssize_t)sizeof(rnd))
+        return false;
+    for (int i = 0; i < TOKEN_LEN / 2; ++i)
+        sprintf(token + 2 * i, "%02x", rnd[i]);
+    token[TOKEN_LEN] = '\0';
+
+    time_t t = now();
+    session item;
+    item.name = name;
+    item.expire = t + m_ttl;
+    item.last_write = last_write;
+
+    shard &s = shard_of(token);
+    scoped_lock<fmutex> guard(s.lock);
+    if (++s.inserts >= 1024)
+    {
+        s.inserts = 0;
+        sweep(s, t);
+    }
+    s.table[token] = item;
+    return true;
+}
+
+bool session_store::lookup(const char *token, char *name, int len)
+{
+    if (strlen(token) != TOKEN_LEN)
+        return false;
+
+    time_t t = now();
+    shard &s = shard_of(token);
+    scoped_lock<fmutex> guard(s.lock);
+    std::unordered_map<std::string, session>::iterator it = s.table.find(token);
+    if (it != s.table.end())
+    {
+        if (it->second.expire <= t)
+        {
+            s.table.erase(it);
+        }
+        else
+        {
+            it->second.expire = t + m_ttl;
+            strncpy(name, it->second.name.c_str(), len);
+            name[len - 1] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+void session_store::remove(const char *token)
+{
+    shard &s = shard_of(token);
+    scoped_lock<fmutex> guard(s.lock);
+    s.table.erase(token);
+}
+
+void session_store::wrote(const char *token, time_t when)
+{
+    if (strlen(token) != TOKEN_LEN)
+        return;
+    shard &s = shard_of(token);
+    scoped_lock<fmutex> guard(s.lock);
+    std::unordered_map<std::string, session>::iterator it = s.table.find(token);
+    if (it != s.table.end() && it->second.last_write < when)
+        it->second.last_write = when;
+}
+
+time_t session_store::last_write(const char *token)
+{
+    if (strlen(token) != TOKEN_LEN)
+        return 0;
+    shard &s = shard_of(token);
+    scoped_lock<fmutex> guard(s.lock);
+    std::unordered_map<std::string, session>::iterator it = s.table.find(token);
+    if (it == s.table.end() || it->second.expire <= now())
+        return 0;
+    return it->second.last_write;
+}
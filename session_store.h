@@ -0,0 +1,62 @@
+#ifndef SESSION_STORE_H
+#define SESSION_STORE_H
+
+#include <time.h>
+#include <string>
+#include <unordered_map>
+#include "locker.h"
+
+/*
+登录会话表：登录成功后发放一个不透明的随机令牌（放在Cookie里），
+之后的请求凭令牌查一次哈希表就能得到用户名，不必再重新提交、比较用户名和密码
+按令牌哈希分片，每个分片一把锁；过期时间用单调时钟，访问时顺延
+会话里还记着最近一次写的时间，读己之写按会话算，同一用户换一个连接也能读到自己刚写的
+*/
+class session_store
+{
+public:
+    /*令牌是16字节随机数的十六进制表示*/
+    static const int TOKEN_LEN = 32;
+
+    session_store(int shards = 16, int ttl = 1800);
+    ~session_store();
+
+    /*为name创建会话，令牌写入token（至少TOKEN_LEN+1字节）；last_write是登录前这个连接最近一次写的时间*/
+    bool create(const char *name, char *token, time_t last_write = 0);
+    /*令牌有效时把用户名写入name并顺延过期时间*/
+    bool lookup(const char *token, char *name, int len);
+    void remove(const char *token);
+    /*记下会话最近一次写的时间（time(NULL)），令牌无效时忽略*/
+    void wrote(const char *token, time_t when);
+    /*会话最近一次写的时间，没有写过或者令牌无效时返回0*/
+    time_t last_write(const char *token);
+    int ttl() { return m_ttl; }
+
+    /*单调时钟的秒数，不受系统改时间影响*/
+    static time_t now();
+
+private:
+    struct session
+    {
+        std::string name;
+        time_t expire;
+        time_t last_write;
+    };
+    struct shard
+    {
+        fmutex lock;
+        std::unordered_map<std::string, session> table;
+        int inserts;  /*每插入一定数量就顺手清理一次过期会话*/
+        char padding[64];
+    };
+
+    shard &shard_of(const char *token);
+    void sweep(shard &s, time_t t);
+
+private:
+    shard *m_shards;
+    unsigned int m_shard_mask;
+    int m_ttl;
+};
+
+#endif
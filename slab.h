@@ -0,0 +1,142 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+/*
+定长对象的slab分配器：按块（chunk）向系统要内存，块内切成一个个对象，用完放回空闲链表，不还给系统
+每个NUMA节点一组块和一条空闲链表，alloc(node)从该节点上的内存里分配；块用mmap分配，
+新块按顺序切分、不预先串成链表，页面在第一次构造对象时才真正分配物理内存，所以常驻内存随着用过的对象数增长
+alloc()/free()可以在任意线程调用，每个节点一把锁
+huge为true的slab在启用大页（set_huge_pages）时按2M大页分配块，一块里能放多少个对象就放多少个
+*/
+
+#include <stddef.h>
+#include <new>
+#include <atomic>
+#include "locker.h"
+#include "cpu_affinity.h"
+
+template <typename T>
+class slab
+{
+public:
+    slab(int per_chunk = 256, bool huge = false) : m_per_chunk(per_chunk), m_huge(huge), m_live(0)
+    {
+        int nodes = cpu_topology::GetInstance()->node_count();
+        m_nodes = new node_list[nodes > 0 ? nodes : 1];
+        m_node_count = nodes > 0 ? nodes : 1;
+    }
+    ~slab()
+    {
+        for (int n = 0; n < m_node_count; ++n)
+        {
+            while (m_nodes[n].chunks)
+            {
+                chunk *c = m_nodes[n].chunks;
+                m_nodes[n].chunks = c->next;
+                if (c->kind == PAGE_SMALL)
+                    free_on_node(c, c->bytes);
+                else
+                    free_huge_on_node(c, c->bytes, c->kind);
+            }
+        }
+        delete[] m_nodes;
+    }
+
+    /*在node上构造一个T，node为-1时不指定节点；内存不足返回NULL*/
+    T *alloc(int node = -1)
+    {
+        int index = node < 0 ? 0 : node % m_node_count;
+        node_list &list = m_nodes[index];
+        cell *c = NULL;
+        {
+            scoped_lock<fmutex> guard(list.lock);
+            if (list.free)
+            {
+                c = list.free;
+                list.free = c->next;
+            }
+            else
+            {
+                if (list.fresh_left == 0 && !grow(list, node))
+                    return NULL;
+                c = list.fresh++;
+                --list.fresh_left;
+            }
+        }
+        c->list = index;
+        m_live.fetch_add(1, std::memory_order_relaxed);
+        return new (c->storage) T();
+    }
+
+    void free(T *obj)
+    {
+        if (!obj)
+            return;
+        obj->~T();
+        cell *c = (cell *)((char *)obj - offsetof(cell, storage));
+        node_list &list = m_nodes[c->list];
+        scoped_lock<fmutex> guard(list.lock);
+        c->next = list.free;
+        list.free = c;
+        m_live.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    /*在用的对象数*/
+    long live() { return m_live.load(std::memory_order_relaxed); }
+
+private:
+    struct cell
+    {
+        cell *next;
+        int list;
+        /*按最严格的对齐放对象*/
+        alignas(alignof(max_align_t)) char storage[sizeof(T)];
+    };
+    /*块头，块之间串成链表，分配新块时不用再向全局堆要内存*/
+    struct alignas(alignof(cell)) chunk
+    {
+        chunk *next;
+        size_t bytes;
+        int kind;     /*PAGE_KIND*/
+    };
+    struct node_list
+    {
+        fmutex lock;
+        cell *free;
+        cell *fresh;      /*最新一块中还没用过的部分*/
+        int fresh_left;
+        chunk *chunks;
+        node_list() : free(NULL), fresh(NULL), fresh_left(0), chunks(NULL) {}
+    };
+
+    /*再要一块，调用者持有list.lock*/
+    bool grow(node_list &list, int node)
+    {
+        size_t bytes = sizeof(chunk) + sizeof(cell) * m_per_chunk;
+        int kind = PAGE_SMALL;
+        void *mem;
+        if (m_huge && huge_pages_enabled())
+            mem = alloc_huge_on_node(&bytes, node, &kind);
+        else
+            mem = alloc_on_node(bytes, node);
+        if (!mem)
+            return false;
+        chunk *c = (chunk *)mem;
+        c->next = list.chunks;
+        c->bytes = bytes;
+        c->kind = kind;
+        list.chunks = c;
+        list.fresh = (cell *)(c + 1);
+        list.fresh_left = (bytes - sizeof(chunk)) / sizeof(cell);
+        return true;
+    }
+
+private:
+    int m_per_chunk;
+    bool m_huge;
+    int m_node_count;
+    node_list *m_nodes;
+    std::atomic<long> m_live;
+};
+
+#endif
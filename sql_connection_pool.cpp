@@ -7,13 +7,15 @@
 #include <pthread.h>
 #include <iostream>
 #include "sql_connection_pool.h"
+#include "metrics.h"
 
 using namespace std;
 
 connection_pool::connection_pool()
 {
-	m_CurConn = 0;
-	m_FreeConn = 0;
+	m_primary = NULL;
+	m_rr = 0;
+	m_rywWindow = 0;
 }
 
 connection_pool *connection_pool::GetInstance()
@@ -22,14 +24,14 @@ connection_pool *connection_pool::GetInstance()
 	return &connPool;
 }
 
-//构造初始化
-void connection_pool::init(string url, string User, string PassWord, string DBName, int Port, int MaxConn)
+//建立到某个数据库实例的MaxConn个连接
+connection_pool::sql_node *connection_pool::CreateNode(string url, int Port, int MaxConn)
 {
-	m_url = url;
-	m_Port = Port;
-	m_User = User;
-	m_PassWord = PassWord;
-	m_DatabaseName = DBName;
+	sql_node *node = new sql_node;
+	node->url = url;
+	node->port = Port;
+	node->m_CurConn = 0;
+	node->m_FreeConn = 0;
 
 	for (int i = 0; i < MaxConn; i++)
 	{
@@ -41,88 +43,156 @@ void connection_pool::init(string url, string User, string PassWord, string DBNa
 			printf("MySQL Error");
 			exit(1);
 		}
-		con = mysql_real_connect(con, url.c_str(), User.c_str(), PassWord.c_str(), DBName.c_str(), Port, NULL, 0);
+		con = mysql_real_connect(con, url.c_str(), m_User.c_str(), m_PassWord.c_str(), m_DatabaseName.c_str(), Port, NULL, 0);
 
 		if (con == NULL)
 		{
-			printf("MySQL Error");
+			printf("MySQL Error: %s:%d\n", url.c_str(), Port);
 			exit(1);
 		}
-		connList.push_back(con);
-		++m_FreeConn;
+		node->connList.push_back(con);
+		m_owner[con] = node;
+		++node->m_FreeConn;
 	}
 
-	reserve = sem(m_FreeConn);
+	node->reserve = new fsem(node->m_FreeConn);
+	node->m_MaxConn = node->m_FreeConn;
+	return node;
+}
+
+//构造初始化
+void connection_pool::init(string url, string User, string PassWord, string DBName, int Port, int MaxConn)
+{
+	m_url = url;
+	m_Port = Port;
+	m_User = User;
+	m_PassWord = PassWord;
+	m_DatabaseName = DBName;
+
+	m_primary = CreateNode(url, Port, MaxConn);
+}
+
+void connection_pool::AddReplica(string url, int Port, int MaxConn)
+{
+	m_replicas.push_back(CreateNode(url, Port, MaxConn));
+}
 
-	m_MaxConn = m_FreeConn;
+void connection_pool::SetReadYourWrites(int seconds)
+{
+	m_rywWindow = seconds;
 }
 
+/*选择未归还连接最少的从库，数量相同时轮询，避免总压在第一个从库上
+m_CurConn在这里是不加锁读取的，只作为负载的近似值*/
+connection_pool::sql_node *connection_pool::PickReplica()
+{
+	int n = m_replicas.size();
+	unsigned int start = __sync_fetch_and_add(&m_rr, 1);
+	sql_node *best = NULL;
+	for (int i = 0; i < n; ++i)
+	{
+		sql_node *node = m_replicas[(start + i) % n];
+		if (node->m_MaxConn == 0)
+			continue;
+		if (!best || node->m_CurConn < best->m_CurConn)
+			best = node;
+	}
+	return best;
+}
 
 //当有请求时，从数据库连接池中返回一个可用连接，更新使用和空闲连接数
-MYSQL *connection_pool::GetConnection()
+//读请求分发到从库；没有从库，或者处于读己之写窗口内时，仍然走主库
+MYSQL *connection_pool::GetConnection(ROLE role, time_t last_write)
 {
 	MYSQL *con = NULL;
+	sql_node *node = m_primary;
 
-	if (0 == connList.size())
-		return NULL;
+	if (role == READ && !m_replicas.empty())
+	{
+		bool fresh = m_rywWindow > 0 && last_write != 0 && time(NULL) - last_write < m_rywWindow;
+		if (!fresh)
+		{
+			sql_node *replica = PickReplica();
+			if (replica)
+				node = replica;
+		}
+	}
 
-	reserve.wait();
-	
-	lock.lock();
+	if (!node || 0 == node->m_MaxConn)
+		return NULL;
 
-	con = connList.front();
-	connList.pop_front();
+	{
+		metric_timer timer(metrics::DB_CHECKOUT);
+		node->reserve->wait();
+	}
 
-	--m_FreeConn;
-	++m_CurConn;
+	scoped_lock<fmutex> guard(node->lock);
+	con = node->connList.front();
+	node->connList.pop_front();
 
-	lock.unlock();
+	--node->m_FreeConn;
+	++node->m_CurConn;
 	return con;
 }
 
-//释放当前使用的连接
+//释放当前使用的连接，放回它所属的子池
 bool connection_pool::ReleaseConnection(MYSQL *con)
 {
 	if (NULL == con)
 		return false;
 
-	lock.lock();
-
-	connList.push_back(con);
-	++m_FreeConn;
-	--m_CurConn;
+	map<MYSQL *, sql_node *>::iterator it = m_owner.find(con);
+	if (it == m_owner.end())
+		return false;
+	sql_node *node = it->second;
 
-	lock.unlock();
+	{
+		scoped_lock<fmutex> guard(node->lock);
+		node->connList.push_back(con);
+		++node->m_FreeConn;
+		--node->m_CurConn;
+	}
 
-	reserve.post();
+	node->reserve->post();
 	return true;
 }
 
 //销毁数据库连接池
 void connection_pool::DestroyPool()
 {
+	vector<sql_node *> nodes(m_replicas);
+	if (m_primary)
+		nodes.push_back(m_primary);
 
-	lock.lock();
-	if (connList.size() > 0)
+	for (size_t i = 0; i < nodes.size(); ++i)
 	{
-		list<MYSQL *>::iterator it;
-		for (it = connList.begin(); it != connList.end(); ++it)
+		sql_node *node = nodes[i];
 		{
-			MYSQL *con = *it;
-			mysql_close(con);
+			scoped_lock<fmutex> guard(node->lock);
+			list<MYSQL *>::iterator it;
+			for (it = node->connList.begin(); it != node->connList.end(); ++it)
+			{
+				MYSQL *con = *it;
+				mysql_close(con);
+			}
+			node->connList.clear();
 		}
-		m_CurConn = 0;
-		m_FreeConn = 0;
-		connList.clear();
+		delete node->reserve;
+		delete node;
 	}
 
-	lock.unlock();
+	m_primary = NULL;
+	m_replicas.clear();
+	m_owner.clear();
 }
 
-//当前空闲的连接数
+//当前空闲的连接数（主库和所有从库之和）
 int connection_pool::GetFreeConn()
 {
-	return this->m_FreeConn;
+	int free_conn = m_primary ? m_primary->m_FreeConn : 0;
+	for (size_t i = 0; i < m_replicas.size(); ++i)
+		free_conn += m_replicas[i]->m_FreeConn;
+	return free_conn;
 }
 
 connection_pool::~connection_pool()
@@ -130,8 +200,8 @@ connection_pool::~connection_pool()
 	DestroyPool();
 }
 
-connectionRAII::connectionRAII(MYSQL **SQL, connection_pool *connPool){
-	*SQL = connPool->GetConnection();
+connectionRAII::connectionRAII(MYSQL **SQL, connection_pool *connPool, connection_pool::ROLE role, time_t last_write){
+	*SQL = connPool->GetConnection(role, last_write);
 	
 	conRAII = *SQL;  // 这是pool 返回的一个connection
 	poolRAII = connPool;  // 这是连接池
@@ -139,4 +209,4 @@ connectionRAII::connectionRAII(MYSQL **SQL, connection_pool *connPool){
 
 connectionRAII::~connectionRAII(){
 	poolRAII->ReleaseConnection(conRAII);  // 这是把连接再放回连接池中
-}
\ No newline at end of file
+}
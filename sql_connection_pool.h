@@ -3,9 +3,12 @@
 
 #include <stdio.h>
 #include <list>
+#include <map>
+#include <vector>
 #include <mysql/mysql.h>
 #include <error.h>
 #include <string.h>
+#include <time.h>
 #include <iostream>
 #include <string>
 #include "locker.h"
@@ -15,7 +18,10 @@ using namespace std;
 class connection_pool
 {
 public:
-	MYSQL *GetConnection();				 //获取数据库连接
+	/*连接用途：写请求只能走主库，读请求优先分发到从库*/
+	enum ROLE { WRITE = 0, READ };
+
+	MYSQL *GetConnection(ROLE role = WRITE, time_t last_write = 0); //获取数据库连接
 	bool ReleaseConnection(MYSQL *conn); //释放连接
 	int GetFreeConn();					 //获取连接
 	void DestroyPool();					 //销毁所有连接
@@ -24,17 +30,36 @@ public:
 	static connection_pool *GetInstance();
 
 	void init(string url, string User, string PassWord, string DataBaseName, int Port, int MaxConn); 
+	//添加一个只读从库，需要在init之后、启动线程池之前调用
+	void AddReplica(string url, int Port, int MaxConn);
+	//读己之写窗口（秒）：会话在最近一次写之后的这段时间内，读请求仍然走主库，0表示关闭
+	void SetReadYourWrites(int seconds);
 
 private:
 	connection_pool();
 	~connection_pool();
 
-	int m_MaxConn;  //最大连接数
-	int m_CurConn;  //当前已使用的连接数
-	int m_FreeConn; //当前空闲的连接数
-	locker lock;
-	list<MYSQL *> connList; //连接池
-	sem reserve;
+	/*一个数据库实例（主库或从库）对应的子连接池*/
+	struct sql_node
+	{
+		string url;
+		int port;
+		int m_MaxConn;  //最大连接数
+		int m_CurConn;  //当前已使用的连接数
+		int m_FreeConn; //当前空闲的连接数
+		fmutex lock;
+		list<MYSQL *> connList; //连接池
+		fsem *reserve;
+	};
+
+	sql_node *CreateNode(string url, int Port, int MaxConn);
+	sql_node *PickReplica();
+
+	sql_node *m_primary;			//主库，处理所有写请求
+	vector<sql_node *> m_replicas;  //从库，处理读请求
+	map<MYSQL *, sql_node *> m_owner; //连接属于哪个子池，init之后只读
+	unsigned int m_rr;				//从库轮询游标
+	int m_rywWindow;				//读己之写窗口（秒）
 
 public:
 	string m_url;			 //主机地址
@@ -47,7 +72,7 @@ public:
 class connectionRAII{
 
 public:
-	connectionRAII(MYSQL **con, connection_pool *connPool);
+	connectionRAII(MYSQL **con, connection_pool *connPool, connection_pool::ROLE role = connection_pool::WRITE, time_t last_write = 0);
 	~connectionRAII();
 	
 private:
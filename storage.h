@@ -0,0 +1,37 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <time.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+处理函数用到的数据访问接口：user表（用户名、密码）和info表（用户、内容）
+启动时选择后端：mysql_storage（走connection_pool）或 local_storage（嵌入式日志存储）
+所有接口都可以被多个工作线程并发调用
+*/
+class storage
+{
+public:
+    virtual ~storage() {}
+
+    /*读出用户的密码，不存在时返回false；last_write是调用者最近一次写的时间，用于读己之写*/
+    virtual bool get_user(const char *name, char *passwd, int len, time_t last_write = 0) = 0;
+    /*用户是否存在，强一致（注册查重用）*/
+    virtual bool has_user(const char *name) = 0;
+    /*注册新用户，用户已存在或写入失败时返回false*/
+    virtual bool add_user(const char *name, const char *passwd) = 0;
+    /*插入一条info记录*/
+    virtual bool add_info(const char *user, const char *content) = 0;
+    /*遍历info表的所有记录，每行调用一次fn；user和content只在这次调用内有效，需要的话由调用者自己复制*/
+    virtual bool scan_info(void (*fn)(const char *user, const char *content, void *arg), void *arg, time_t last_write = 0) = 0;
+
+    /*遍历所有用户名，供后台加载布隆过滤器*/
+    virtual bool scan_users(void (*fn)(const char *name, void *arg), void *arg) = 0;
+    /*用户数的估计值，不需要精确，返回0表示未知*/
+    virtual long estimate_users() = 0;
+};
+
+#endif
@@ -10,44 +10,108 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <list>
 #include <cstdio>
+#include <cmath>
+#include <algorithm>
 #include <exception>
+#include <atomic>
 #include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
 #include "locker.h"
-#include "sql_connection_pool.h"
+#include "work_queue.h"
+#include "cpu_affinity.h"
+#include "log.h"
+#include "profiler.h"
 
-template <typename T>
+/*Queue是请求队列的实现，见work_queue.h：
+list_queue 是原来的 list + 互斥锁 + 信号量；steal_queue 是每线程收件箱 + 工作窃取；
+ring_queue 是定长无锁环形队列，容量就是max_requests
+T要有 process() 和 m_enqueue_us（入队时的单调时钟微秒，0表示没记），后者用于测量排队时延*/
+template <typename T, typename Queue = list_queue<T> >
 class threadpool
 {
 public:
     /*参数thread_number是线程池中线程的数量，max_requests是请求队列中最多允
-    许的、等待处理的请求的数量*/
-    threadpool(connection_pool *connPool, int thread_number = 8, int max_requests = 10000);
+    许的、等待处理的请求的数量；plan不为空时按它把工作线程绑到CPU上，并按NUMA节点分组；
+    nice是工作线程的调度优先级（同setpriority，越大越低），用于让几个线程池之间分出轻重*/
+    threadpool(int thread_number = 8, int max_requests = 10000, const affinity_plan *plan = NULL, int nice = 0);
     ~threadpool();
     /*往请求队列中添加任务*/
     bool append(T *request);
+    /*成批添加任务，只唤醒一次，返回成功添加的个数（前若干个）
+    nodes[i]是第i个请求的连接所在的NUMA节点，用于投递给同节点的工作线程*/
+    int append_batch(T **requests, int n, const int *nodes = NULL);
+    /*开启自动伸缩：启用的工作线程数在[min_threads, thread_number]之间调整，每interval_ms毫秒评估一次
+    线程一开始就全部创建好，缩容只是让多出来的线程停下来睡眠，扩容时再叫醒*/
+    bool auto_size(int min_threads, int interval_ms = 500);
+    /*当前启用的工作线程数*/
+    int active_threads() { return m_active.load(std::memory_order_relaxed); }
+    /*队列中等待的请求数（近似值）*/
+    int queue_size() { return m_queue.size(); }
 
 private:
     /*工作线程运行的函数，它不断从工作队列中取出任务并执行之*/
     static void *worker(void *arg);
-    void run();
+    void run(int id);
+    /*调节线程运行的函数，按排队时延和忙碌比例调整启用的线程数*/
+    static void *tuner(void *arg);
+    void tune();
+    void resize(int n);
+    /*让所有线程退出并等它们结束：工作线程取前n个（构造失败时只有已创建的那些），调节线程在的话也等*/
+    void stop_threads(int n);
+
+    /*传给工作线程的参数：线程池和该线程的编号（按编号使用队列中属于自己的部分）*/
+    struct worker_arg
+    {
+        threadpool *pool;
+        int id;
+        int cpu;  /*要绑定的CPU，-1表示不绑*/
+        int nice;
+        /*该线程处理请求的累计耗时（包括阻塞在数据库上的时间）和处理完的请求数，只由该线程写*/
+        std::atomic<long long> busy_ns;
+        std::atomic<long long> done;
+        /*该线程取到的请求从入队到出队的累计等待时间和次数，只由该线程写*/
+        std::atomic<long long> wait_us;
+        std::atomic<long long> waited;
+        char padding[64];
+        worker_arg() : busy_ns(0), done(0), wait_us(0), waited(0) {}
+    };
 
 private:
     int m_thread_number;        /*线程池中的线程数*/
     int m_max_requests;         /*请求队列中允许的最大请求数*/
     pthread_t *m_threads;       /*描述线程池的数组，其大小为m_thread_number*/
-    std::list<T *> m_workqueue; /*请求队列*/
-    locker m_queuelocker;       /*保护请求队列的互斥锁*/
-    sem m_queuestat;            /*是否有任务需要处理*/
-    bool m_stop;                /*是否结束线程*/
-
-    connection_pool *m_connPool;  //数据库的连接
+    worker_arg *m_args;
+    Queue m_queue;              /*请求队列*/
+    volatile bool m_stop;       /*是否结束线程*/
+    pthread_t m_tuner;          /*调节线程，m_has_tuner为true时有效*/
+    bool m_has_tuner;
 
+    std::atomic<int> m_active;  /*启用的工作线程数，编号不小于它的线程停在m_resize上*/
+    eventcount m_resize;
+    std::atomic<long long> m_appended;  /*入队成功的请求总数，用于计算到达率*/
+    int m_min_threads;
+    int m_interval_ms;
 };
 
-template <typename T>
-threadpool<T>::threadpool(connection_pool *connPool, int thread_number, int max_requests) : m_thread_number(thread_number), m_max_requests(max_requests), m_stop(false), m_threads(NULL), m_connPool(connPool)
+/*自动伸缩的参数
+排队时延超过TUNE_WAIT_MS或忙碌比例超过TUNE_BUSY_HIGH时扩容，一次最多扩一半；
+两者都很低时每次缩一个线程，避免来回抖动*/
+static const double TUNE_WAIT_MS = 5;
+static const double TUNE_BUSY_HIGH = 0.85;
+static const double TUNE_BUSY_LOW = 0.5;
+static const double TUNE_TARGET_UTIL = 0.7;
+
+static inline long long tune_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+template <typename T, typename Queue>
+threadpool<T, Queue>::threadpool(int thread_number, int max_requests, const affinity_plan *plan, int nice) : m_thread_number(thread_number), m_max_requests(max_requests), m_threads(NULL), m_args(NULL), m_queue(thread_number, max_requests), m_stop(false), m_has_tuner(false), m_active(thread_number), m_appended(0), m_min_threads(thread_number), m_interval_ms(0)
 {
     if ((thread_number <= 0) || (max_requests <= 0))
     {
@@ -55,11 +119,16 @@ threadpool<T>::threadpool(connection_pool *connPool, int thread_number, int max_
     }
 
     m_threads = new pthread_t[m_thread_number];
+    m_args = new worker_arg[m_thread_number];
     if (!m_threads)
     {
         throw std::exception();
     }
-    /*创建thread_number个线程，并将它们都设置为脱离线程*/
+    if (plan && plan->enabled)
+    {
+        m_queue.set_worker_nodes(plan->worker_node);
+    }
+    /*创建thread_number个线程；不设为脱离线程，析构时要等它们都退出了才能释放m_args*/
     for (int i = 0; i < thread_number; ++i)
     {
         printf("create the %dth thread\n", i);
@@ -70,78 +139,207 @@ threadpool<T>::threadpool(connection_pool *connPool, int thread_number, int max_
         而要在一个静态函数中使用类的动态成员（包括成员函数和成员变量），则只能通过如下两种方式来实现：
         1. 通过类的静态对象来调用。比如单体模式中，静态函数可以通过类的全局唯一实例来访问动态成员函数。
         2. 将类的对象作为参数传递给该静态函数，然后在静态函数中引用这个对象，并调用其动态方法。
-        使用的是第2种方式：将线程参数设置为this指针，然后在worker函数中获取该指针并调用其动态方法run。
+        使用的是第2种方式：将线程参数设置为worker_arg（this指针和线程编号），然后在worker函数中获取该指针并调用其动态方法run。
         */
-        if (pthread_create(m_threads + i, NULL, worker, this) != 0)
-        {
-            delete[] m_threads;
-            throw std::exception();
-        }
-        /*在创建每个线程后，通过调用 pthread_detach() 函数将其设置为脱离线程。
-        脱离线程意味着线程在退出时将自动释放其资源，而不需要其他线程调用 pthread_join() 来等待其退出。
-        如果任何一个线程的创建或脱离失败，都会抛出 std::exception 异常，并释放之前分配的内存。*/
-        if (pthread_detach(m_threads[i]))
+        m_args[i].pool = this;
+        m_args[i].id = i;
+        m_args[i].cpu = (plan && plan->enabled) ? plan->worker_cpu[i] : -1;
+        m_args[i].nice = nice;
+        /*创建失败时先让已经创建的线程退出，再释放它们正在用的数组，然后抛出 std::exception 异常*/
+        if (pthread_create(m_threads + i, NULL, worker, m_args + i) != 0)
         {
+            stop_threads(i);
             delete[] m_threads;
+            delete[] m_args;
             throw std::exception();
         }
     }
 }
 
-template <typename T>
-threadpool<T>::~threadpool()
+/*工作线程在run()里引用着m_args，调节线程也在读它，所以先通知退出、等线程都结束，最后才释放*/
+template <typename T, typename Queue>
+threadpool<T, Queue>::~threadpool()
 {
+    stop_threads(m_thread_number);
     delete[] m_threads;
+    delete[] m_args;
+}
+
+template <typename T, typename Queue>
+void threadpool<T, Queue>::stop_threads(int n)
+{
     m_stop = true;
+    m_queue.stop();
+    m_resize.notify_all();
+    for (int i = 0; i < n; ++i)
+        pthread_join(m_threads[i], NULL);
+    if (m_has_tuner)
+        pthread_join(m_tuner, NULL);
 }
 
-template <typename T>
-bool threadpool<T>::append(T *request)
+template <typename T, typename Queue>
+bool threadpool<T, Queue>::append(T *request)
 {
-    /*操作工作队列时一定要加锁，因为它被所有线程共享*/
-    m_queuelocker.lock();
-    if (m_workqueue.size() > m_max_requests)
-    {
-        m_queuelocker.unlock();
+    /*队列满了返回false*/
+    if (!m_queue.push(request))
         return false;
-    }
-    m_workqueue.push_back(request);
-    m_queuelocker.unlock();
-    m_queuestat.post();
+    m_appended.fetch_add(1, std::memory_order_relaxed);
     return true;
 }
 
-template <typename T>
-void *threadpool<T>::worker(void *arg)  /*arg是threadpool<T>类对象的指针*/
-{  /*worker函数在线程创建之初就已经开始工作了，run函数已经执行了*/
+template <typename T, typename Queue>
+int threadpool<T, Queue>::append_batch(T **requests, int n, const int *nodes)
+{
+    int added = m_queue.push_batch(requests, n, nodes);
+    m_appended.fetch_add(added, std::memory_order_relaxed);
+    return added;
+}
+
+template <typename T, typename Queue>
+bool threadpool<T, Queue>::auto_size(int min_threads, int interval_ms)
+{
+    if (min_threads <= 0 || min_threads > m_thread_number || interval_ms <= 0)
+        return false;
+    m_min_threads = min_threads;
+    m_interval_ms = interval_ms;
+    if (min_threads == m_thread_number || m_has_tuner)
+        return true;
+    if (pthread_create(&m_tuner, NULL, tuner, this) != 0)
+        return false;
+    m_has_tuner = true;
+    return true;
+}
+
+template <typename T, typename Queue>
+void threadpool<T, Queue>::resize(int n)
+{
+    /*先改队列，让新投递只落到前n个线程上；再叫醒停着的线程，编号在n以内的恢复工作*/
+    m_active.store(n, std::memory_order_seq_cst);
+    m_queue.set_active(n);
+    m_resize.notify_all();
+}
+
+template <typename T, typename Queue>
+void *threadpool<T, Queue>::tuner(void *arg)
+{
     threadpool *pool = (threadpool *)arg;
-    pool->run();
+    pool->tune();
     return pool;
 }
-/*run函数不断地监听工作队列，一有任务，所有线程开始争抢*/
-template <typename T>
-void threadpool<T>::run()
+
+/*排队时延用工作线程实测的：这段时间里出队的请求从入队到出队的平均等待时间
+Little定律：平均同时在处理的请求数 = 到达率 × 平均处理时间，除以目标利用率就是需要的线程数*/
+template <typename T, typename Queue>
+void threadpool<T, Queue>::tune()
 {
+    long long last_t = tune_now_ns();
+    long long last_appended = m_appended.load(std::memory_order_relaxed);
+    long long last_busy = 0, last_done = 0, last_wait = 0, last_waited = 0;
+    for (int i = 0; i < m_thread_number; ++i)
+    {
+        last_busy += m_args[i].busy_ns.load(std::memory_order_relaxed);
+        last_done += m_args[i].done.load(std::memory_order_relaxed);
+        last_wait += m_args[i].wait_us.load(std::memory_order_relaxed);
+        last_waited += m_args[i].waited.load(std::memory_order_relaxed);
+    }
+
     while (!m_stop)
     {
-        m_queuestat.wait();
-        m_queuelocker.lock();
-        if (m_workqueue.empty())
+        usleep(m_interval_ms * 1000);
+        long long t = tune_now_ns();
+        long long appended = m_appended.load(std::memory_order_relaxed);
+        long long busy = 0, done = 0, wait = 0, waited = 0;
+        for (int i = 0; i < m_thread_number; ++i)
         {
-            m_queuelocker.unlock();
-            continue;
+            busy += m_args[i].busy_ns.load(std::memory_order_relaxed);
+            done += m_args[i].done.load(std::memory_order_relaxed);
+            wait += m_args[i].wait_us.load(std::memory_order_relaxed);
+            waited += m_args[i].waited.load(std::memory_order_relaxed);
         }
-        T *request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
+
+        double secs = (t - last_t) / 1e9;
+        double arrival = (appended - last_appended) / secs;
+        int queued = m_queue.size();
+        int active = m_active.load(std::memory_order_relaxed);
+        /*一个都没出队却还有排队的，说明整段时间都没处理动*/
+        double wait_ms = waited > last_waited ? (wait - last_wait) / 1000.0 / (waited - last_waited) : (queued > 0 ? secs * 1000 : 0);
+        double busy_ratio = (busy - last_busy) / ((t - last_t) * (double)active);
+        double service = done > last_done ? (busy - last_busy) / 1e9 / (done - last_done) : 0;
+        int need = (int)ceil(arrival * service / TUNE_TARGET_UTIL);
+
+        int want = active;
+        if (wait_ms > TUNE_WAIT_MS || busy_ratio > TUNE_BUSY_HIGH)
+            want = std::max(need, active + std::max(1, active / 2));
+        else if (wait_ms < TUNE_WAIT_MS / 2 && busy_ratio < TUNE_BUSY_LOW)
+            want = std::max(need, active - 1);
+        want = std::min(std::max(want, m_min_threads), m_thread_number);
+        if (want != active)
+            resize(want);
+
+        last_t = t;
+        last_appended = appended;
+        last_busy = busy;
+        last_done = done;
+        last_wait = wait;
+        last_waited = waited;
+    }
+}
+
+template <typename T, typename Queue>
+void *threadpool<T, Queue>::worker(void *arg)  /*arg是worker_arg，里面有threadpool对象的指针*/
+{  /*worker函数在线程创建之初就已经开始工作了，run函数已经执行了*/
+    worker_arg *wa = (worker_arg *)arg;
+    threadpool *pool = wa->pool;
+    if (wa->cpu >= 0 && !pin_current_thread(wa->cpu))
+    {
+        LOG_WARN("pin worker %d to cpu %d failed", wa->id, wa->cpu);
+    }
+    /*Linux上PRIO_PROCESS配合线程id只改这一个线程；调高优先级（负值）需要权限，失败时保持默认*/
+    if (wa->nice != 0 && setpriority(PRIO_PROCESS, syscall(SYS_gettid), wa->nice) != 0)
+    {
+        LOG_WARN("set worker %d nice %d failed", wa->id, wa->nice);
+    }
+    profiler::register_thread(profiler::WORKER);
+    pool->run(wa->id);
+    return pool;
+}
+/*run函数不断地从工作队列取任务，没有任务时在队列里阻塞*/
+template <typename T, typename Queue>
+void threadpool<T, Queue>::run(int id)
+{
+    worker_arg &self = m_args[id];
+    while (!m_stop)
+    {
+        profiler::set_state(profiler::IDLE);
+        T *request = m_queue.pop(id);
         if (!request)
         {
+            /*被缩容停用了，睡到重新启用为止*/
+            while (!m_stop && id >= m_active.load(std::memory_order_relaxed))
+            {
+                int key = m_resize.prepare_wait();
+                if (m_stop || id < m_active.load(std::memory_order_seq_cst))
+                {
+                    m_resize.cancel_wait();
+                    break;
+                }
+                m_resize.wait(key);
+            }
             continue;
         }
-        /* 这是通过connectionRAII的构造函数，
-        将 m_connPool -> getInstance() 返回的一个空闲的数据库连接线程，赋给request->mysql MYSQL类型*/
-        connectionRAII mysqlcon(&request->mysql, m_connPool);  
+        profiler::set_state(profiler::WORKER);
+        /* 数据库连接不在这里预先取出：静态文件请求根本用不到，
+        需要读写数据的请求在do_request()中通过http_conn::m_storage按需访问*/
+        long long start = tune_now_ns();
+        /*process()之后连接可能已经被主线程拿去处理下一个请求了，入队时间要在这之前读*/
+        if (request->m_enqueue_us)
+        {
+            self.wait_us.fetch_add(std::max(0LL, start / 1000 - request->m_enqueue_us), std::memory_order_relaxed);
+            self.waited.fetch_add(1, std::memory_order_relaxed);
+        }
         request->process();
+        self.busy_ns.fetch_add(tune_now_ns() - start, std::memory_order_relaxed);
+        self.done.fetch_add(1, std::memory_order_relaxed);
     }
 }
 
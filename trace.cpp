@@ -0,0 +1,260 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include "arena.h"
+#include "log.h"
+
+/*一个抽样的请求，导出时复制出来*/
+struct trace_sample
+{
+    request_trace trace;
+    int fd;
+    int status;
+    unsigned long bytes;
+    bool slow;
+    char method[8];
+    char url[64];
+};
+
+/*环形缓冲区的一格：seq是奇数时正在写，读的一方前后各看一次seq，对不上就跳过（seqlock），写的一方不用等*/
+struct trace_slot
+{
+    std::atomic<uint64_t> seq;
+    trace_sample sample;
+};
+
+/*保留最近这么多个抽样的请求，2的幂*/
+static const int SAMPLE_SLOTS = 1024;
+static trace_slot slots[SAMPLE_SLOTS];
+static std::atomic<uint64_t> next_slot(0);
+
+static uint64_t slow_us = 0;
+static unsigned sample_every = 0;
+static uint64_t base_tick = 0;
+static __thread request_trace *t_current = NULL;
+static __thread unsigned t_finished = 0;
+
+bool tracer::m_tsc = false;
+double tracer::m_ticks_per_us = 1000;
+
+/*每一段以它结束的阶段命名，FIRST_BYTE之前没有段*/
+static const char *segment_names[request_trace::STAGE_COUNT] =
+{
+    NULL, NULL, "read", "queue", "parse", "db_wait", "db", "handle", "write"
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+/*频率变化和深度睡眠时TSC都匀速走，才能直接当时钟用*/
+static bool invariant_tsc()
+{
+    FILE *fp = fopen("/proc/cpuinfo", "r");
+    if (!fp)
+        return false;
+    char line[4096];
+    bool ok = false;
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (strncmp(line, "flags", 5) == 0)
+        {
+            ok = strstr(line, " constant_tsc") && strstr(line, " nonstop_tsc");
+            break;
+        }
+    }
+    fclose(fp);
+    return ok;
+}
+#endif
+
+void tracer::init(int slow_ms, int every)
+{
+    slow_us = slow_ms > 0 ? slow_ms * 1000ULL : 0;
+    sample_every = every > 0 ? every : 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (invariant_tsc())
+    {
+        struct timespec a, b;
+        clock_gettime(CLOCK_MONOTONIC, &a);
+        uint64_t t0 = __rdtsc();
+        struct timespec ts = {0, 20 * 1000 * 1000};
+        nanosleep(&ts, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &b);
+        uint64_t t1 = __rdtsc();
+        double ns = (b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec);
+        if (ns > 0 && t1 > t0)
+        {
+            m_ticks_per_us = (t1 - t0) / ns * 1000;
+            m_tsc = true;
+        }
+    }
+#endif
+    base_tick = now();
+    LOG_INFO("trace clock %s, %.1f ticks/us; slow request threshold %d ms, sampling 1/%u",
+             m_tsc ? "tsc" : "clock_gettime", m_ticks_per_us, slow_ms, sample_every);
+}
+
+void tracer::set_current(request_trace *t)
+{
+    t_current = t;
+}
+
+void tracer::mark_current(int stage, bool first_only)
+{
+    request_trace *t = t_current;
+    if (t && !(first_only && t->at[stage]))
+        t->mark(stage);
+}
+
+/*从前一个经过的阶段到这个阶段的微秒数*/
+static double segment_us(const request_trace &t, int stage, int *prev)
+{
+    double us = 0;
+    if (*prev >= 0 && t.at[stage] > t.at[*prev])
+        us = tracer::elapsed_us(t.at[*prev], t.at[stage]);
+    *prev = stage;
+    return us;
+}
+
+static int first_stage(const request_trace &t)
+{
+    for (int i = request_trace::FIRST_BYTE; i < request_trace::STAGE_COUNT; ++i)
+    {
+        if (t.at[i])
+            return i;
+    }
+    return -1;
+}
+
+/*慢请求日志：一个请求一行，列出经过的每一段的耗时（微秒）*/
+static void log_slow(const request_trace &t, int fd, const char *method, const char *url, int status, size_t bytes, double total)
+{
+    char stages[160];
+    int len = 0;
+    int prev = first_stage(t);
+    for (int i = prev + 1; prev >= 0 && i < request_trace::STAGE_COUNT; ++i)
+    {
+        if (!t.at[i])
+            continue;
+        double us = segment_us(t, i, &prev);
+        int n = snprintf(stages + len, sizeof(stages) - len, " %s=%.0f", segment_names[i], us);
+        if (n < 0 || n >= (int)sizeof(stages) - len)
+            break;
+        len += n;
+    }
+    stages[len] = '\0';
+    double age = t.at[request_trace::ACCEPT] && t.at[request_trace::FIRST_BYTE] > t.at[request_trace::ACCEPT]
+                     ? tracer::elapsed_us(t.at[request_trace::ACCEPT], t.at[request_trace::FIRST_BYTE]) : 0;
+    logger::write(logger::SLOW, LOG_LEVEL_WARN, "fd=%d method=%s url=\"%.48s\" status=%d bytes=%zu total_us=%.0f conn_age_us=%.0f%s",
+                  fd, method, url, status, bytes, total, age, stages);
+}
+
+/*JSON里不转义，直接把引号、反斜杠和控制字符换掉*/
+static void copy_clean(char *dst, size_t size, const char *src)
+{
+    size_t i = 0;
+    for (; src[i] && i + 1 < size; ++i)
+    {
+        unsigned char c = src[i];
+        dst[i] = (c < 0x20 || c == '"' || c == '\\') ? '_' : c;
+    }
+    dst[i] = '\0';
+}
+
+static void keep_sample(const request_trace &t, int fd, const char *method, const char *url, int status, size_t bytes, bool slow)
+{
+    uint64_t n = next_slot.fetch_add(1, std::memory_order_relaxed);
+    trace_slot &s = slots[n & (SAMPLE_SLOTS - 1)];
+    s.seq.store(n * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    s.sample.trace = t;
+    s.sample.fd = fd;
+    s.sample.status = status;
+    s.sample.bytes = bytes;
+    s.sample.slow = slow;
+    copy_clean(s.sample.method, sizeof(s.sample.method), method);
+    copy_clean(s.sample.url, sizeof(s.sample.url), url);
+    s.seq.store(n * 2 + 2, std::memory_order_release);
+}
+
+void tracer::finish(const request_trace &t, int fd, const char *method, const char *url, int status, size_t bytes)
+{
+    int first = first_stage(t);
+    if (first < 0 || !t.at[request_trace::LAST_BYTE])
+        return;
+    double total = t.at[request_trace::LAST_BYTE] > t.at[first] ? elapsed_us(t.at[first], t.at[request_trace::LAST_BYTE]) : 0;
+    bool slow = slow_us && total >= slow_us;
+    if (slow)
+        log_slow(t, fd, method, url, status, bytes, total);
+    bool sampled = sample_every && ++t_finished % sample_every == 0;
+    if (slow || sampled)
+        keep_sample(t, fd, method, url, status, bytes, slow);
+}
+
+static bool put(arena_string &out, const char *format, ...)
+{
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len < 0 || len >= (int)sizeof(line))
+        return false;
+    return out.append(line, len);
+}
+
+static double trace_ts(uint64_t tick)
+{
+    return tick > base_tick ? tracer::elapsed_us(base_tick, tick) : 0;
+}
+
+/*每个请求一个完整事件，下面按阶段切成几段；tid用fd，同一连接上的请求排在一行里，不会重叠*/
+static void render_sample(arena_string &out, const trace_sample &s, int pid, bool *first_event)
+{
+    const request_trace &t = s.trace;
+    int prev = first_stage(t);
+    if (prev < 0 || !t.at[request_trace::LAST_BYTE])
+        return;
+    double start = trace_ts(t.at[prev]);
+    double age = t.at[request_trace::ACCEPT] && t.at[request_trace::FIRST_BYTE] > t.at[request_trace::ACCEPT]
+                     ? tracer::elapsed_us(t.at[request_trace::ACCEPT], t.at[request_trace::FIRST_BYTE]) : 0;
+    put(out, "%s\n{\"name\":\"%s %s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+             "\"args\":{\"status\":%d,\"bytes\":%lu,\"slow\":%s,\"conn_age_us\":%.0f}}",
+        *first_event ? "" : ",", s.method, s.url, start, trace_ts(t.at[request_trace::LAST_BYTE]) - start, pid, s.fd,
+        s.status, s.bytes, s.slow ? "true" : "false", age);
+    *first_event = false;
+    for (int i = prev + 1; i < request_trace::STAGE_COUNT; ++i)
+    {
+        if (!t.at[i])
+            continue;
+        double from = trace_ts(t.at[prev]);
+        double us = segment_us(t, i, &prev);
+        put(out, ",\n{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+            segment_names[i], from, us, pid, s.fd);
+    }
+}
+
+bool tracer::render(arena_string &out)
+{
+    int pid = getpid();
+    bool first_event = true;
+    out.append("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    uint64_t end = next_slot.load(std::memory_order_acquire);
+    uint64_t begin = end > (uint64_t)SAMPLE_SLOTS ? end - SAMPLE_SLOTS : 0;
+    for (uint64_t n = begin; n < end; ++n)
+    {
+        trace_slot &slot = slots[n & (SAMPLE_SLOTS - 1)];
+        uint64_t seq = slot.seq.load(std::memory_order_acquire);
+        if (seq != n * 2 + 2)
+            continue;
+        trace_sample s;
+        memcpy(&s, &slot.sample, sizeof(s));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != seq)
+            continue;
+        render_sample(out, s, pid, &first_event);
+    }
+    out.append("\n]}\n");
+    return !out.failed();
+}
@@ -0,0 +1,97 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+请求跟踪：每个请求在http_conn里带一条定长记录，经过各个阶段时打一个时间戳
+时间戳用TSC（rdtsc，不进内核，比clock_gettime还便宜），启动时对着CLOCK_MONOTONIC标定一次；
+CPU没有constant_tsc（频率变化时TSC不匀速）或者不是x86时退回CLOCK_MONOTONIC
+请求写完时：总耗时超过阈值的写一行到慢请求日志（slow.log），每隔若干个请求抽一个，连同慢请求一起
+存到一个定长的环形缓冲区里，GET /trace 以Chrome trace的JSON格式导出，保存下来用chrome://tracing或Perfetto打开
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+class arena_string;
+
+struct request_trace
+{
+    /*按实际发生的先后排列：解析在工作线程上做，所以在出队之后*/
+    enum STAGE
+    {
+        ACCEPT = 0,         /*连接accept的时间，保持连接的后续请求沿用*/
+        FIRST_BYTE,         /*主线程读到这个请求的第一段数据*/
+        ENQUEUED,           /*交给线程池*/
+        DEQUEUED,           /*工作线程取到*/
+        PARSED,             /*process_read()解析完*/
+        DB_ACQUIRED,        /*第一次拿到数据库连接（本地存储是拿到锁）*/
+        DB_DONE,            /*最后一次存储调用返回*/
+        RESPONSE_QUEUED,    /*应答填好*/
+        LAST_BYTE,          /*应答的最后一个字节写出*/
+        STAGE_COUNT
+    };
+
+    /*时钟读数，0表示没有经过这个阶段；请求没读全要多轮处理时，入队到解析这几项以最后一轮为准*/
+    uint64_t at[STAGE_COUNT];
+
+    void mark(int stage);
+    /*开始下一个请求，保留ACCEPT*/
+    void reset()
+    {
+        for (int i = FIRST_BYTE; i < STAGE_COUNT; ++i)
+            at[i] = 0;
+    }
+};
+
+class tracer
+{
+public:
+    /*标定时钟（要睡20毫秒，启动时在主线程里调用一次）
+    slow_ms：总耗时超过它的请求写慢请求日志，0表示不写；sample_every：每隔这么多个请求抽一个导出，0表示不抽样*/
+    static void init(int slow_ms, int sample_every);
+
+    static uint64_t now()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        if (m_tsc)
+            return __rdtsc();
+#endif
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+    /*两个时钟读数之间的微秒数*/
+    static double elapsed_us(uint64_t from, uint64_t to) { return (double)(to - from) / m_ticks_per_us; }
+
+    /*本线程正在为哪个请求访问存储，存储后端通过它记DB_ACQUIRED/DB_DONE，不用层层传参*/
+    static void set_current(request_trace *t);
+    static void mark_current(int stage, bool first_only);
+
+    /*请求写完时调用：超过阈值的写慢请求日志，抽中的和慢的存起来给 GET /trace*/
+    static void finish(const request_trace &t, int fd, const char *method, const char *url, int status, size_t bytes);
+    /*把存下来的请求按Chrome trace格式（traceEvents数组）写到out，内存不足时返回false*/
+    static bool render(arena_string &out);
+
+private:
+    static bool m_tsc;
+    static double m_ticks_per_us;
+};
+
+inline void request_trace::mark(int stage)
+{
+    at[stage] = tracer::now();
+}
+
+/*存储后端的一次调用，在拿到连接（或锁）之后构造*/
+class trace_db_call
+{
+public:
+    trace_db_call() { tracer::mark_current(request_trace::DB_ACQUIRED, true); }
+    ~trace_db_call() { tracer::mark_current(request_trace::DB_DONE, false); }
+};
+
+#endif
@@ -0,0 +1,217 @@
+#include "user_store.h"
+
+user_store::user_store(int shards, int capacity)
+{
+    int n = 1;
+    while (n < shards)
+        n <<= 1;
+    m_shard_mask = n - 1;
+    m_shard_cap = capacity > 0 ? (capacity + n - 1) / n : 0;
+    m_shards = new shard[n];
+    for (int i = 0; i < n; ++i)
+    {
+        m_shards[i].seq.store(0);
+        m_shards[i].mask.store(15);
+        m_shards[i].count = 0;
+        m_shards[i].hand = 0;
+        m_shards[i].table.store(new slot[16]());
+    }
+}
+
+user_store::~user_store()
+{
+    for (unsigned int i = 0; i <= m_shard_mask; ++i)
+    {
+        delete[] m_shards[i].table.load();
+        for (size_t j = 0; j < m_shards[i].retired.size(); ++j)
+            delete[] m_shards[i].retired[j];
+    }
+    delete[] m_shards;
+}
+
+/*FNV-1a，0留给空槽*/
+uint64_t user_store::hash_of(const char *name)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)name; *p; ++p)
+    {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+bool user_store::lookup(const char *name, char *passwd, int len)
+{
+    uint64_t h = hash_of(name);
+    shard &s = shard_of(h);
+    char buf[NAME_LEN];
+
+    while (true)
+    {
+        unsigned int begin = s.seq.load(std::memory_order_acquire);
+        if (begin & 1)
+            continue;  /*写者正在修改这个分片*/
+
+        unsigned int mask = s.mask.load(std::memory_order_acquire);
+        slot *table = s.table.load(std::memory_order_acquire);
+        bool found = false;
+        for (unsigned int i = h & mask, n = 0; n <= mask; i = (i + 1) & mask, ++n)
+        {
+            uint64_t sh = table[i].hash;
+            if (sh == 0)
+                break;
+            if (sh == h && strncmp(table[i].name, name, NAME_LEN) == 0)
+            {
+                /*只在访问位为0时才写，热门用户的槽不会被反复写脏*/
+                if (m_shard_cap && !table[i].ref)
+                    __atomic_store_n(&table[i].ref, 1, __ATOMIC_RELAXED);
+                if (passwd)
+                    memcpy(buf, table[i].passwd, NAME_LEN);
+                found = true;
+                break;
+            }
+        }
+
+        /*读到的内容只有在序列号没变的情况下才可信*/
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s.seq.load(std::memory_order_relaxed) != begin)
+            continue;
+
+        if (found && passwd)
+        {
+            buf[NAME_LEN - 1] = '\0';
+            strncpy(passwd, buf, len);
+            passwd[len - 1] = '\0';
+        }
+        return found;
+    }
+}
+
+bool user_store::contains(const char *name)
+{
+    return lookup(name, NULL, 0);
+}
+
+bool user_store::find(const char *name, char *passwd, int len)
+{
+    return lookup(name, passwd, len);
+}
+
+bool user_store::check(const char *name, const char *passwd)
+{
+    char stored[NAME_LEN];
+    if (!lookup(name, stored, NAME_LEN))
+        return false;
+    return strcmp(stored, passwd) == 0;
+}
+
+void user_store::place(slot *table, unsigned int mask, const slot &item)
+{
+    unsigned int i = item.hash & mask;
+    while (table[i].hash != 0)
+        i = (i + 1) & mask;
+    table[i] = item;
+}
+
+/*装载因子超过3/4时扩容一倍，调用者持有分片锁并已将seq置为奇数*/
+void user_store::grow(shard &s)
+{
+    slot *old = s.table.load(std::memory_order_relaxed);
+    unsigned int old_mask = s.mask.load(std::memory_order_relaxed);
+    unsigned int mask = old_mask * 2 + 1;
+    slot *table = new slot[mask + 1]();
+    for (unsigned int i = 0; i <= old_mask; ++i)
+    {
+        if (old[i].hash != 0)
+            place(table, mask, old[i]);
+    }
+    s.table.store(table, std::memory_order_release);
+    s.mask.store(mask, std::memory_order_release);
+    s.retired.push_back(old);
+}
+
+/*CLOCK淘汰：从指针处扫描，访问位为1的清0放过，遇到为0的就删掉
+删除用反向移位，保持线性探测链不断；调用者持有分片锁并已将seq置为奇数*/
+void user_store::evict(shard &s)
+{
+    slot *table = s.table.load(std::memory_order_relaxed);
+    unsigned int mask = s.mask.load(std::memory_order_relaxed);
+    unsigned int i = s.hand & mask;
+    while (true)
+    {
+        if (table[i].hash != 0)
+        {
+            if (!table[i].ref)
+                break;
+            table[i].ref = 0;
+        }
+        i = (i + 1) & mask;
+    }
+    s.hand = (i + 1) & mask;
+
+    unsigned int hole = i;
+    unsigned int j = i;
+    while (true)
+    {
+        j = (j + 1) & mask;
+        if (table[j].hash == 0)
+            break;
+        unsigned int home = table[j].hash & mask;
+        /*home不在(hole, j]区间内，说明j上的元素可以挪到hole*/
+        bool movable = (hole <= j) ? (home <= hole || home > j) : (home <= hole && home > j);
+        if (movable)
+        {
+            table[hole] = table[j];
+            hole = j;
+        }
+    }
+    table[hole].hash = 0;
+    table[hole].ref = 0;
+    --s.count;
+}
+
+bool user_store::insert(const char *name, const char *passwd)
+{
+    uint64_t h = hash_of(name);
+    shard &s = shard_of(h);
+
+    scoped_lock<fmutex> guard(s.lock);
+    slot *table = s.table.load(std::memory_order_relaxed);
+    unsigned int mask = s.mask.load(std::memory_order_relaxed);
+    for (unsigned int i = h & mask; table[i].hash != 0; i = (i + 1) & mask)
+    {
+        if (table[i].hash == h && strncmp(table[i].name, name, NAME_LEN) == 0)
+            return false;
+    }
+
+    slot item;
+    item.hash = h;
+    item.ref = 0;
+    strncpy(item.name, name, NAME_LEN);
+    item.name[NAME_LEN - 1] = '\0';
+    strncpy(item.passwd, passwd, NAME_LEN);
+    item.passwd[NAME_LEN - 1] = '\0';
+
+    unsigned int seq = s.seq.load(std::memory_order_relaxed);
+    s.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    if (m_shard_cap && s.count >= m_shard_cap)
+        evict(s);
+    else if ((s.count + 1) * 4 > (int)(mask + 1) * 3)
+        grow(s);
+    place(s.table.load(std::memory_order_relaxed), s.mask.load(std::memory_order_relaxed), item);
+    ++s.count;
+
+    s.seq.store(seq + 2, std::memory_order_release);
+    return true;
+}
+
+int user_store::size()
+{
+    int total = 0;
+    for (unsigned int i = 0; i <= m_shard_mask; ++i)
+        total += m_shards[i].count;
+    return total;
+}
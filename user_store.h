@@ -0,0 +1,75 @@
+#ifndef USER_STORE_H
+#define USER_STORE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <vector>
+#include "locker.h"
+
+/*
+用户名 -> 密码 的并发表，替代原来的 全局map + m_lock
+按哈希高位分成若干个分片，每个分片是一张线性探测的开放寻址表：
+写（注册、加载）持有分片自己的锁；读（登录校验）不加锁，
+靠分片上的序列号（seqlock）发现并重试被并发写打断的读
+设置了容量时作为有界缓存使用：分片满了之后按CLOCK（近似LRU）淘汰最久没被读到的用户
+*/
+class user_store
+{
+public:
+    /*用户名和密码的最大长度，与do_request()中的缓冲区一致*/
+    static const int NAME_LEN = 100;
+
+    /*shards会被向上取整为2的幂，capacity为0表示不限容量*/
+    user_store(int shards = 64, int capacity = 0);
+    ~user_store();
+
+    /*插入一个用户，已存在时返回false；分片满时淘汰一个旧用户*/
+    bool insert(const char *name, const char *passwd);
+    /*用户是否存在，无锁*/
+    bool contains(const char *name);
+    /*用户存在且密码一致时返回true，无锁*/
+    bool check(const char *name, const char *passwd);
+    /*读出密码，不存在时返回false，无锁*/
+    bool find(const char *name, char *passwd, int len);
+    /*用户总数*/
+    int size();
+
+private:
+    struct slot
+    {
+        uint64_t hash;  /*0表示空槽*/
+        unsigned char ref;  /*CLOCK访问位，读者用原子写置1，写者扫过时清0*/
+        char name[NAME_LEN];
+        char passwd[NAME_LEN];
+    };
+
+    struct shard
+    {
+        std::atomic<unsigned int> seq;  /*奇数表示正在写*/
+        std::atomic<slot *> table;
+        std::atomic<unsigned int> mask;  /*先换表再换mask，读者先读mask再读表，保证不越界*/
+        int count;
+        unsigned int hand;  /*CLOCK指针*/
+        fmutex lock;
+        /*扩容后被替换下来的旧表：无锁读者可能还在上面探测，所以直到析构才释放*/
+        std::vector<slot *> retired;
+        /*相邻分片的seq不落在同一缓存行，避免不同分片的写互相干扰*/
+        char padding[64];
+    };
+
+    static uint64_t hash_of(const char *name);
+    shard &shard_of(uint64_t hash) { return m_shards[(hash >> 40) & m_shard_mask]; }
+    /*在分片中查找，找到时把密码拷贝到passwd（可为NULL）*/
+    bool lookup(const char *name, char *passwd, int len);
+    void grow(shard &s);
+    void evict(shard &s);
+    static void place(slot *table, unsigned int mask, const slot &item);
+
+private:
+    shard *m_shards;
+    unsigned int m_shard_mask;
+    int m_shard_cap;  /*每个分片最多缓存的用户数，0表示不限*/
+};
+
+#endif
@@ -0,0 +1,662 @@
+/*
+线程池的请求队列
+threadpool通过模板参数选择队列实现，队列需要提供：
+    Queue(int workers, int max_requests)
+    bool push(T *request)     由主线程（或其他生产者）调用，队列满时返回false
+    int push_batch(T **requests, int n, const int *nodes = NULL)
+                              成批入队，只做一次唤醒，返回入队成功的个数（前若干个）；
+                              nodes[i]是第i个请求所在的NUMA节点（-1表示未知），队列可以据此就近投递
+    void set_worker_nodes(const std::vector<int> &nodes)
+                              告知每个工作线程所在的NUMA节点
+    T *pop(int worker)        由第worker个工作线程调用，没有任务时先自旋再阻塞，stop()后返回NULL；
+                              worker不在前active个之内时，处理完属于自己的请求后也返回NULL
+    void set_active(int n)    只让前n个工作线程取任务、接收投递，用于线程池伸缩
+    int size()                排队中的请求数（近似值）
+    void stop()
+队列为空时工作线程先自适应自旋，再在eventcount上睡眠；生产者只在有睡眠者时才发起唤醒
+*/
+
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <list>
+#include <vector>
+#include <atomic>
+#include <exception>
+#include "locker.h"
+
+/*原来的实现：一个 list + 互斥锁，所有线程争抢同一个队列
+原来每个请求都要sem_post一次，现在改为eventcount，只有在有线程睡眠时才唤醒*/
+template <typename T>
+class list_queue
+{
+public:
+    list_queue(int workers, int max_requests) : m_max_requests(max_requests), m_count(0), m_active(workers), m_stop(false)
+    {
+        m_spins = new adaptive_spin[workers];
+    }
+    ~list_queue() { delete[] m_spins; }
+
+    bool push(T *request)
+    {
+        return push_batch(&request, 1) == 1;
+    }
+
+    /*共享队列，没有就近投递的余地，忽略nodes*/
+    int push_batch(T **requests, int n, const int * = NULL)
+    {
+        /*操作工作队列时一定要加锁，因为它被所有线程共享*/
+        int i = 0;
+        {
+            scoped_lock<fmutex> guard(m_queuelocker);
+            for (; i < n && (int)m_workqueue.size() <= m_max_requests; ++i)
+                m_workqueue.push_back(requests[i]);
+            m_count.fetch_add(i, std::memory_order_seq_cst);
+        }
+        if (i > 0)
+            m_queuestat.notify(i);
+        return i;
+    }
+
+    T *pop(int worker)
+    {
+        while (!m_stop && worker < m_active.load(std::memory_order_relaxed))
+        {
+            T *request = try_pop();
+            if (request)
+                return request;
+            if (m_spins[worker].spin([this] { return m_count.load(std::memory_order_relaxed) > 0 || m_stop; }))
+                continue;
+
+            int key = m_queuestat.prepare_wait();
+            if (m_count.load(std::memory_order_seq_cst) > 0 || m_stop || worker >= m_active.load(std::memory_order_seq_cst))
+            {
+                m_queuestat.cancel_wait();
+                continue;
+            }
+            m_queuestat.wait(key);
+        }
+        return NULL;
+    }
+
+    void set_worker_nodes(const std::vector<int> &) {}
+
+    /*被停用的线程可能正睡在队列里，全部叫醒让它们自己退出pop()*/
+    void set_active(int n)
+    {
+        m_active.store(n, std::memory_order_seq_cst);
+        m_queuestat.notify_all();
+    }
+
+    int size() { return m_count.load(std::memory_order_relaxed); }
+
+    void stop()
+    {
+        m_stop = true;
+        m_queuestat.notify_all();
+    }
+
+private:
+    T *try_pop()
+    {
+        if (m_count.load(std::memory_order_relaxed) == 0)
+            return NULL;
+        scoped_lock<fmutex> guard(m_queuelocker);
+        if (m_workqueue.empty())
+            return NULL;
+        T *request = m_workqueue.front();
+        m_workqueue.pop_front();
+        m_count.fetch_sub(1, std::memory_order_relaxed);
+        return request;
+    }
+
+private:
+    int m_max_requests;         /*请求队列中允许的最大请求数*/
+    std::list<T *> m_workqueue; /*请求队列*/
+    fmutex m_queuelocker;       /*保护请求队列的互斥锁*/
+    std::atomic<int> m_count;   /*队列长度，供不加锁地判断是否有任务*/
+    std::atomic<int> m_active;  /*可以取任务的工作线程数*/
+    eventcount m_queuestat;     /*是否有任务需要处理*/
+    adaptive_spin *m_spins;     /*每个工作线程的自旋状态*/
+    volatile bool m_stop;
+};
+
+/*
+Chase-Lev 工作窃取双端队列（定长）
+只有属主线程在底部push/pop，其他线程在顶部steal，全程无锁
+内存序按 Lê 等人的 C11 版本（PPoPP'13）
+*/
+template <typename T>
+class ws_deque
+{
+public:
+    ws_deque(int capacity = 1024) : m_top(0), m_bottom(0)
+    {
+        int n = 1;
+        while (n < capacity)
+            n <<= 1;
+        m_mask = n - 1;
+        m_buf = new std::atomic<T *>[n];
+    }
+    ~ws_deque() { delete[] m_buf; }
+
+    /*属主线程调用，满了返回false*/
+    bool push(T *item)
+    {
+        long b = m_bottom.load(std::memory_order_relaxed);
+        long t = m_top.load(std::memory_order_acquire);
+        if (b - t > (long)m_mask)
+            return false;
+        m_buf[b & m_mask].store(item, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /*属主线程调用，空了返回NULL*/
+    T *pop()
+    {
+        long b = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long t = m_top.load(std::memory_order_relaxed);
+        if (t > b)
+        {
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return NULL;
+        }
+        T *item = m_buf[b & m_mask].load(std::memory_order_relaxed);
+        if (t == b)
+        {
+            /*只剩最后一个，和窃取者竞争*/
+            if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                item = NULL;
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    /*任意线程调用，空了或者竞争失败返回NULL*/
+    T *steal()
+    {
+        long t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long b = m_bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return NULL;
+        T *item = m_buf[t & m_mask].load(std::memory_order_relaxed);
+        if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return NULL;
+        return item;
+    }
+
+    long size()
+    {
+        long b = m_bottom.load(std::memory_order_relaxed);
+        long t = m_top.load(std::memory_order_relaxed);
+        return b > t ? b - t : 0;
+    }
+
+private:
+    std::atomic<long> m_top;
+    char m_pad[64];  /*top和bottom分属不同的缓存行，窃取者和属主不互相干扰*/
+    std::atomic<long> m_bottom;
+    std::atomic<T *> *m_buf;
+    unsigned long m_mask;
+};
+
+/*
+工作窃取调度：每个工作线程一个收件箱和一个Chase-Lev双端队列
+主线程把请求轮流放进各线程的收件箱（只和该线程竞争这把锁），
+工作线程成批取出收件箱中的请求放进自己的双端队列再逐个处理；
+自己没活干时先从别的线程的双端队列顶部窃取，再从别的线程的收件箱里拿，
+都没有才自旋、睡眠；生产者只在目标线程睡眠时才唤醒它
+*/
+template <typename T>
+class steal_queue
+{
+public:
+    steal_queue(int workers, int max_requests) : m_workers(workers), m_max_requests(max_requests), m_pending(0), m_next(0), m_active(workers), m_stop(false)
+    {
+        m_slots = new slot[workers];
+        set_worker_nodes(std::vector<int>(workers, 0));
+    }
+    ~steal_queue() { delete[] m_slots; }
+
+    bool push(T *request)
+    {
+        return push_batch(&request, 1) == 1;
+    }
+
+    /*一批请求轮流放进各线程的收件箱，放完之后再统一唤醒睡眠中的目标线程
+    知道请求所在的NUMA节点时，只在该节点的工作线程之间轮流*/
+    int push_batch(T **requests, int n, const int *nodes = NULL)
+    {
+        int i = 0;
+        int targets[64];
+        int ntargets = 0;
+        for (; i < n; ++i)
+        {
+            if (m_pending.fetch_add(1, std::memory_order_seq_cst) >= m_max_requests)
+            {
+                m_pending.fetch_sub(1, std::memory_order_relaxed);
+                break;
+            }
+            int target = pick(nodes ? nodes[i] : -1);
+            slot &s = m_slots[target];
+            {
+                scoped_lock<fmutex> guard(s.inbox_lock);
+                s.inbox.push_back(requests[i]);
+                s.inbox_count.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (ntargets < 64 && (ntargets == 0 || targets[ntargets - 1] != target))
+                targets[ntargets++] = target;
+        }
+
+        int woken = 0;
+        for (int k = 0; k < ntargets; ++k)
+            woken += wake(m_slots[targets[k]]);
+        /*目标线程都在忙时，叫醒一个空闲线程来窃取，免得请求排在慢请求后面*/
+        if (i > 0 && woken == 0)
+            wake_one();
+        return i;
+    }
+
+    T *pop(int worker)
+    {
+        slot &self = m_slots[worker];
+        unsigned int seed = worker * 2654435761u + 1;
+        while (!m_stop)
+        {
+            T *request = self.deque.pop();
+            if (!request)
+                request = drain_inbox(self);
+            /*被停用的线程不再窃取，自己的收件箱和双端队列空了就退出；
+            之后还投到它收件箱里的请求（投递与停用竞争时）由其他线程窃取*/
+            bool retiring = worker >= m_active.load(std::memory_order_relaxed);
+            if (!request && !retiring)
+                request = steal(worker, seed);
+            if (request)
+            {
+                m_pending.fetch_sub(1, std::memory_order_relaxed);
+                return request;
+            }
+            if (retiring)
+                return NULL;
+
+            /*还有别处待处理的请求，说明只是窃取竞争失败，继续找*/
+            if (self.spin.spin([this] { return m_pending.load(std::memory_order_relaxed) > 0 || m_stop; }))
+                continue;
+
+            /*先登记为等待者，再检查一遍，和push_batch()中“先入队再看等待者”配对，不会丢失唤醒*/
+            int key = self.wake.prepare_wait();
+            if (m_pending.load(std::memory_order_seq_cst) > 0 || m_stop || worker >= m_active.load(std::memory_order_seq_cst))
+            {
+                self.wake.cancel_wait();
+                continue;
+            }
+            self.wake.wait(key);
+        }
+        return NULL;
+    }
+
+    /*按节点给工作线程分组；窃取时先找同节点的线程，再找其他节点的*/
+    void set_worker_nodes(const std::vector<int> &nodes)
+    {
+        m_node_workers.clear();
+        for (int i = 0; i < m_workers && i < (int)nodes.size(); ++i)
+        {
+            if (nodes[i] < 0)
+                continue;
+            if (nodes[i] >= (int)m_node_workers.size())
+                m_node_workers.resize(nodes[i] + 1);
+            m_node_workers[nodes[i]].push_back(i);
+        }
+        for (int i = 0; i < m_workers; ++i)
+        {
+            m_slots[i].victims.clear();
+            int node = i < (int)nodes.size() ? nodes[i] : -1;
+            for (int pass = 0; pass < 2; ++pass)
+            {
+                for (int k = 1; k < m_workers; ++k)
+                {
+                    int v = (i + k) % m_workers;
+                    bool local = v < (int)nodes.size() && nodes[v] == node;
+                    if (local == (pass == 0))
+                        m_slots[i].victims.push_back(v);
+                }
+            }
+            m_slots[i].local_victims = 0;
+            for (int k = 1; k < m_workers; ++k)
+            {
+                int v = (i + k) % m_workers;
+                if (v < (int)nodes.size() && nodes[v] == node)
+                    ++m_slots[i].local_victims;
+            }
+        }
+    }
+
+    /*新投递只给前n个线程；叫醒所有睡眠者，被停用的自己退出pop()*/
+    void set_active(int n)
+    {
+        m_active.store(n, std::memory_order_seq_cst);
+        for (int i = 0; i < m_workers; ++i)
+            m_slots[i].wake.notify_all();
+    }
+
+    int size() { return m_pending.load(std::memory_order_relaxed); }
+
+    void stop()
+    {
+        m_stop = true;
+        for (int i = 0; i < m_workers; ++i)
+            m_slots[i].wake.notify_all();
+    }
+
+private:
+    struct slot
+    {
+        fmutex inbox_lock;
+        std::vector<T *> inbox;     /*主线程投递的请求*/
+        std::vector<T *> batch;     /*从收件箱一次性换出来的请求，只有属主访问*/
+        std::atomic<int> inbox_count;
+        ws_deque<T> deque;
+        eventcount wake;
+        adaptive_spin spin;
+        std::vector<int> victims;   /*窃取顺序：同节点的在前*/
+        int local_victims;          /*victims中同节点线程的个数*/
+        char padding[64];
+        slot() : inbox_count(0) {}
+    };
+
+    /*选择投递的工作线程：节点已知且该节点有工作线程时在节点内轮询，否则全局轮询
+    只投给启用中的线程；轮到的同节点线程被停用时改为全局轮询*/
+    int pick(int node)
+    {
+        unsigned int next = m_next.fetch_add(1, std::memory_order_relaxed);
+        int active = m_active.load(std::memory_order_relaxed);
+        if (node >= 0 && node < (int)m_node_workers.size() && !m_node_workers[node].empty())
+        {
+            std::vector<int> &group = m_node_workers[node];
+            int target = group[next % group.size()];
+            if (target < active)
+                return target;
+        }
+        return next % active;
+    }
+
+    bool wake(slot &s)
+    {
+        if (s.wake.waiters() > 0)
+        {
+            s.wake.notify();
+            return true;
+        }
+        return false;
+    }
+
+    void wake_one()
+    {
+        for (int i = 0; i < m_workers; ++i)
+        {
+            if (wake(m_slots[i]))
+                return;
+        }
+    }
+
+    /*把收件箱整个换出来，能放进双端队列的放进去（可被窃取），返回其中一个直接处理*/
+    T *drain_inbox(slot &self)
+    {
+        {
+            scoped_lock<fmutex> guard(self.inbox_lock);
+            if (self.inbox.empty())
+                return NULL;
+            self.batch.swap(self.inbox);
+            self.inbox_count.store(0, std::memory_order_relaxed);
+        }
+
+        T *first = self.batch[0];
+        size_t i = 1;
+        for (; i < self.batch.size(); ++i)
+        {
+            if (!self.deque.push(self.batch[i]))
+                break;
+        }
+        if (i < self.batch.size())
+        {
+            /*双端队列满了，剩下的放回收件箱*/
+            scoped_lock<fmutex> guard(self.inbox_lock);
+            self.inbox.insert(self.inbox.begin(), self.batch.begin() + i, self.batch.end());
+            self.inbox_count.store(self.inbox.size(), std::memory_order_relaxed);
+        }
+        self.batch.clear();
+        return first;
+    }
+
+    T *steal(int worker, unsigned int &seed)
+    {
+        std::vector<int> &victims = m_slots[worker].victims;
+        int local = m_slots[worker].local_victims;
+        int n = victims.size();
+        seed = seed * 1103515245 + 12345;
+        unsigned int r = seed >> 16;
+        /*先在同节点的线程里从随机位置开始找，再找其他节点的*/
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            int begin = pass == 0 ? 0 : local;
+            int count = pass == 0 ? local : n - local;
+            for (int k = 0; k < count; ++k)
+            {
+                T *request = m_slots[victims[begin + (r + k) % count]].deque.steal();
+                if (request)
+                    return request;
+            }
+        }
+        /*双端队列都空了，再看别人的收件箱：对方可能正忙于处理一个慢请求*/
+        for (int k = 0; k < n; ++k)
+        {
+            slot &v = m_slots[victims[k]];
+            if (v.inbox_count.load(std::memory_order_relaxed) == 0 || !v.inbox_lock.trylock())
+                continue;
+            T *request = NULL;
+            if (!v.inbox.empty())
+            {
+                request = v.inbox.front();
+                v.inbox.erase(v.inbox.begin());
+                v.inbox_count.fetch_sub(1, std::memory_order_relaxed);
+            }
+            v.inbox_lock.unlock();
+            if (request)
+                return request;
+        }
+        return NULL;
+    }
+
+private:
+    int m_workers;
+    int m_max_requests;
+    std::atomic<int> m_pending;  /*已入队未取出的请求数，用于容量限制*/
+    std::atomic<unsigned int> m_next;  /*轮询投递的游标*/
+    std::atomic<int> m_active;   /*接收投递、可以窃取的工作线程数*/
+    slot *m_slots;
+    std::vector<std::vector<int> > m_node_workers;  /*每个节点上的工作线程，启动前设置，之后只读*/
+    volatile bool m_stop;
+};
+
+/*
+定长无锁多生产者多消费者环形队列（Vyukov的序列号方案）
+每个槽有一个序列号：等于位置号表示可写，等于位置号+1表示可读，生产者和消费者各自CAS推进下标
+容量即max_requests（向上取整为2的幂），没有按任务的内存分配，也不需要加锁判断长度
+队列空时消费者先自旋再在eventcount上睡眠；生产者每批都通知，没有睡眠者时eventcount不进内核
+*/
+template <typename T>
+class ring_queue
+{
+public:
+    ring_queue(int workers, int max_requests) : m_enqueue_pos(0), m_dequeue_pos(0), m_active(workers), m_stop(false)
+    {
+        m_spins = new adaptive_spin[workers];
+        size_t n = 2;
+        while (n < (size_t)max_requests)
+            n <<= 1;
+        m_mask = n - 1;
+        m_cells = new cell[n];
+        for (size_t i = 0; i < n; ++i)
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+    ~ring_queue()
+    {
+        delete[] m_cells;
+        delete[] m_spins;
+    }
+
+    bool push(T *request)
+    {
+        return push_batch(&request, 1) == 1;
+    }
+
+    /*一批只通知一次，最多叫醒i个睡眠者
+    不能只在队列由空变为非空时通知：持续有负载时队列一直不空，已经睡下的消费者就一直没人叫醒
+    共享队列，忽略nodes*/
+    int push_batch(T **requests, int n, const int * = NULL)
+    {
+        int i = 0;
+        for (; i < n; ++i)
+        {
+            size_t pos;
+            if (!try_push(requests[i], pos))
+                break;
+        }
+        if (i > 0)
+            m_event.notify(i);
+        return i;
+    }
+
+    T *pop(int worker)
+    {
+        while (!m_stop && worker < m_active.load(std::memory_order_relaxed))
+        {
+            T *request = try_pop();
+            if (request)
+                return request;
+            if (m_spins[worker].spin([this] { return !empty() || m_stop; }))
+                continue;
+
+            int key = m_event.prepare_wait();
+            if (!empty() || m_stop || worker >= m_active.load(std::memory_order_seq_cst))
+            {
+                m_event.cancel_wait();
+                continue;
+            }
+            m_event.wait(key);
+        }
+        return NULL;
+    }
+
+    void set_worker_nodes(const std::vector<int> &) {}
+
+    void set_active(int n)
+    {
+        m_active.store(n, std::memory_order_seq_cst);
+        m_event.notify_all();
+    }
+
+    int size()
+    {
+        long n = (long)m_enqueue_pos.load(std::memory_order_relaxed) - (long)m_dequeue_pos.load(std::memory_order_relaxed);
+        return n > 0 ? n : 0;
+    }
+
+    void stop()
+    {
+        m_stop = true;
+        m_event.notify_all();
+    }
+
+private:
+    struct cell
+    {
+        std::atomic<size_t> seq;
+        T *data;
+        char padding[64 - sizeof(std::atomic<size_t>) - sizeof(T *)];
+    };
+
+    bool try_push(T *request, size_t &pos)
+    {
+        pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        cell *c;
+        while (true)
+        {
+            c = &m_cells[pos & m_mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            long diff = (long)seq - (long)pos;
+            if (diff == 0)
+            {
+                if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return false;  /*满了*/
+            }
+            else
+            {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        c->data = request;
+        c->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    T *try_pop()
+    {
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        cell *c;
+        while (true)
+        {
+            c = &m_cells[pos & m_mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            long diff = (long)seq - (long)(pos + 1);
+            if (diff == 0)
+            {
+                if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return NULL;  /*空了*/
+            }
+            else
+            {
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        T *request = c->data;
+        c->seq.store(pos + m_mask + 1, std::memory_order_release);
+        return request;
+    }
+
+    bool empty()
+    {
+        size_t pos = m_dequeue_pos.load(std::memory_order_seq_cst);
+        return (long)m_cells[pos & m_mask].seq.load(std::memory_order_acquire) - (long)(pos + 1) < 0;
+    }
+
+private:
+    /*生产者下标、消费者下标和睡眠状态各占一个缓存行*/
+    char m_pad0[64];
+    std::atomic<size_t> m_enqueue_pos;
+    char m_pad1[64];
+    std::atomic<size_t> m_dequeue_pos;
+    char m_pad2[64];
+    eventcount m_event;
+    char m_pad3[64];
+    cell *m_cells;
+    size_t m_mask;
+    adaptive_spin *m_spins;  /*每个工作线程的自旋状态*/
+    std::atomic<int> m_active;
+    volatile bool m_stop;
+};
+
+#endif